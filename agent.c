@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "sclock.h"
+#include "mac.h"
+
+/* A per-host agent that answers many local clients with one server query.
+
+   Local processes send ordinary queries (see sclock.h) to the agent's Unix
+   datagram socket instead of to the server. Every query that arrives while
+   the agent is idle, or while its upstream query is in flight, is answered
+   by the next upstream query, so the server sees one query per host per
+   round trip however many processes sync from it.
+
+   Time spent inside the agent counts as server residence. The reply to
+   each local query carries as its receive stamp the server's receive stamp
+   moved back by the time the query waited before the upstream send, and as
+   its transmit stamp the server's transmit stamp moved forward by the time
+   between the upstream reply and the local reply. A version 2 client then
+   measures an RTT made of its two local hops and the upstream round trip,
+   with every wait in the agent removed, and its offset estimate is the one
+   a direct query over that composite path would give. Version 1 clients
+   get the transmit stamp alone and pay for the waits in their RTT.
+
+   With a key, the agent authenticates both legs as a server and a client
+   would: it answers only authenticated local queries, with authenticated
+   replies, and accepts only authenticated upstream replies. Clients use
+   the same key whether they query the server or the agent. */
+
+/* Local queries answered by one upstream query. Later ones wait. */
+#define MAX_REQUESTS 1024
+
+#define DEFAULT_TIMEOUT 1000000
+
+/* Room for one SCM_TIMESTAMPNS control message. */
+#define CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+
+enum event_sources {
+    SOURCE_LOCAL = 0,
+    SOURCE_UPSTREAM,
+    SOURCE_TIMER,
+    SOURCE_SIGNAL
+};
+
+typedef struct local_request {
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    uint32_t sequence_number;
+    uint8_t version;
+    /* Real hardware clock time at which the query reached the agent */
+    microts arrived_at;
+} local_request;
+
+static struct {
+    microts timeout;
+    microts hold;
+    int kernel_timestamps;
+    const mac_key *key;
+} options;
+
+/* Queries waiting for the next upstream query, and those the query in
+   flight answers. The two queues swap when an upstream query is sent. */
+static local_request queue_a[MAX_REQUESTS], queue_b[MAX_REQUESTS];
+static local_request *waiting = queue_a, *batch = queue_b;
+static int waiting_count, batch_count;
+
+static int upstream_pending;
+static uint32_t upstream_sequence;
+static microts upstream_sent_at;
+
+static unsigned long requests, replies, rejected, expired, dropped;
+static unsigned long upstream_queries, upstream_timeouts;
+static int largest_batch;
+
+/* Real hardware clock time of the datagram in msg: its kernel timestamp
+   if it has one, or now. */
+static microts arrival_time(struct msghdr *msg) {
+    microts t;
+    if ((msg->msg_controllen > 0
+         && real_hardware_clock_from_msghdr(msg, &t) == 0)
+        || real_hardware_clock_gettime(&t) == 0)
+        return t;
+    return 0;
+}
+
+/* Returns 0 and stores the sequence number and protocol version if buffer
+   holds a valid query. Queries without a version byte are version 1. With
+   a key, only authenticated version 2 queries with a valid tag are valid. */
+static int parse_query(char *buffer, int recv_len, uint32_t *sequence_number,
+                       uint8_t *version) {
+    if (recv_len < MESSAGE_SIZE
+        || strncmp(QUERY_STRING, buffer + SEQ_NUM_SIZE, PAYLOAD_SIZE) != 0)
+        return -1;
+
+    *sequence_number = ntohl(*(uint32_t *) buffer);
+    *version = 1;
+    if (recv_len >= MESSAGE_V2_QUERY_SIZE
+        && *(uint8_t *) (buffer + VERSION_OFFSET) >= PROTOCOL_VERSION)
+        *version = PROTOCOL_VERSION;
+
+    if (options.key != NULL
+        && (*version < PROTOCOL_VERSION
+            || mac_verify_query(options.key, buffer, recv_len) != 0))
+        return -1;
+    return 0;
+}
+
+/* Write the reply to sequence_number into buffer and return its length.
+   With a key, the reply is authenticated. */
+static int encode_reply(char *buffer, uint32_t sequence_number,
+                        uint8_t version, microts receive_time,
+                        microts transmit_time) {
+    *(uint32_t *) buffer = htonl(sequence_number + 1);
+    *(uint64_t *) (buffer + SEQ_NUM_SIZE) = htonll(transmit_time);
+    if (version < PROTOCOL_VERSION)
+        return MESSAGE_SIZE;
+
+    memset(buffer + VERSION_OFFSET, 0, RECEIVE_STAMP_OFFSET - VERSION_OFFSET);
+    *(uint8_t *) (buffer + VERSION_OFFSET) = PROTOCOL_VERSION;
+    *(uint64_t *) (buffer + RECEIVE_STAMP_OFFSET) = htonll(receive_time);
+    if (options.key == NULL)
+        return MESSAGE_V2_REPLY_SIZE;
+
+    siphash_state mac;
+    mac_reply_begin(options.key, buffer, &mac);
+    return mac_reply_end(&mac, buffer, transmit_time);
+}
+
+static void send_upstream(int upstream_fd, struct sockaddr_in *server_addr) {
+    char request_buffer[MESSAGE_AUTH_QUERY_SIZE] = {0};
+    *(uint32_t *) request_buffer = htonl(++upstream_sequence);
+    strncpy(request_buffer + SEQ_NUM_SIZE, QUERY_STRING, PAYLOAD_SIZE);
+    *(uint8_t *) (request_buffer + VERSION_OFFSET) = PROTOCOL_VERSION;
+    int request_len = MESSAGE_V2_QUERY_SIZE;
+    if (options.key != NULL)
+        request_len = mac_sign_query(options.key, request_buffer);
+
+    real_hardware_clock_gettime(&upstream_sent_at);
+    if (sendto(upstream_fd, request_buffer, request_len,
+               MSG_DONTWAIT, (struct sockaddr *) server_addr,
+               sizeof(*server_addr)) < 0)
+        printf("WARN: Upstream sendto failed. %s\n", strerror(errno));
+
+    upstream_pending = 1;
+    ++upstream_queries;
+    if (batch_count > largest_batch)
+        largest_batch = batch_count;
+}
+
+/* Hand every waiting query to a new upstream query, if none is in flight
+   and the oldest has been held long enough. */
+static void flush_waiting(int upstream_fd, struct sockaddr_in *server_addr,
+                          microts now) {
+    if (upstream_pending || waiting_count == 0
+        || now - waiting[0].arrived_at < options.hold)
+        return;
+
+    local_request *swap = batch;
+    batch = waiting;
+    batch_count = waiting_count;
+    waiting = swap;
+    waiting_count = 0;
+    send_upstream(upstream_fd, server_addr);
+}
+
+/* The upstream query timed out. Give up on queries whose clients have
+   given up too, take in the waiting ones and ask again. */
+static void retry_upstream(int upstream_fd, struct sockaddr_in *server_addr,
+                           microts now) {
+    ++upstream_timeouts;
+    int kept = 0;
+    for (int i = 0; i < batch_count; ++i) {
+        if (now - batch[i].arrived_at < options.timeout)
+            batch[kept++] = batch[i];
+        else
+            ++expired;
+    }
+    int taken = 0;
+    while (taken < waiting_count && kept < MAX_REQUESTS)
+        batch[kept++] = waiting[taken++];
+    memmove(waiting, waiting + taken,
+            (waiting_count - taken) * sizeof(local_request));
+    waiting_count -= taken;
+    batch_count = kept;
+
+    upstream_pending = 0;
+    if (batch_count > 0)
+        send_upstream(upstream_fd, server_addr);
+}
+
+static void receive_local(int local_fd) {
+    char buffer[MESSAGE_MAX_SIZE];
+    char control[CONTROL_SIZE];
+    struct iovec iov = { .iov_base = buffer, .iov_len = sizeof(buffer) };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    while (1) {
+        local_request *r = &waiting[waiting_count];
+        local_request overflow;
+        if (waiting_count == MAX_REQUESTS)
+            r = &overflow;
+
+        msg.msg_name = &r->addr;
+        msg.msg_namelen = sizeof(r->addr);
+        msg.msg_control = options.kernel_timestamps ? control : NULL;
+        msg.msg_controllen = options.kernel_timestamps ? sizeof(control) : 0;
+        int recv_len = recvmsg(local_fd, &msg, MSG_DONTWAIT);
+        if (recv_len < 0)
+            return;
+
+        ++requests;
+        r->addr_len = msg.msg_namelen;
+        r->arrived_at = arrival_time(&msg);
+
+        /* An unbound sender has no address to answer. */
+        if (r->addr_len <= sizeof(sa_family_t)
+            || parse_query(buffer, recv_len, &r->sequence_number,
+                           &r->version) != 0) {
+            ++rejected;
+            continue;
+        }
+        if (r == &overflow) {
+            ++dropped;
+            continue;
+        }
+        ++waiting_count;
+    }
+}
+
+/* Answer every query of the batch from the upstream exchange sent at
+   sent_at and received at received_at (agent real time). */
+static void fan_out(int local_fd, microts sent_at, microts server_receive,
+                    microts server_transmit, microts received_at) {
+    static char buffers[MAX_REQUESTS][MESSAGE_MAX_SIZE];
+    static struct iovec iovs[MAX_REQUESTS];
+    static struct mmsghdr messages[MAX_REQUESTS];
+
+    /* All replies leave with the same sendmmsg, so one clock read right
+       before it stands for all of their transmit times. */
+    microts now;
+    if (real_hardware_clock_gettime(&now) != 0)
+        return;
+
+    for (int i = 0; i < batch_count; ++i) {
+        local_request *r = &batch[i];
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = encode_reply(
+            buffers[i], r->sequence_number, r->version,
+            server_receive - (sent_at - r->arrived_at),
+            server_transmit + (now - received_at));
+        memset(&messages[i], 0, sizeof(messages[i]));
+        messages[i].msg_hdr.msg_name = &r->addr;
+        messages[i].msg_hdr.msg_namelen = r->addr_len;
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* sendmmsg stops at the first failure, which is usually a client that
+       exited. Skip it and carry on with the rest. */
+    int sent = 0;
+    while (sent < batch_count) {
+        int n = sendmmsg(local_fd, messages + sent, batch_count - sent,
+                         MSG_DONTWAIT);
+        if (n <= 0) {
+            ++dropped;
+            ++sent;
+            continue;
+        }
+        sent += n;
+        replies += n;
+    }
+}
+
+static void receive_upstream(int upstream_fd, int local_fd) {
+    char buffer[MESSAGE_MAX_SIZE];
+    char control[CONTROL_SIZE];
+    struct iovec iov = { .iov_base = buffer, .iov_len = sizeof(buffer) };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    while (1) {
+        msg.msg_control = options.kernel_timestamps ? control : NULL;
+        msg.msg_controllen = options.kernel_timestamps ? sizeof(control) : 0;
+        int recv_len = recvmsg(upstream_fd, &msg, MSG_DONTWAIT);
+        if (recv_len < 0)
+            return;
+
+        microts received_at = arrival_time(&msg);
+        if (options.key != NULL
+            ? mac_verify_reply(options.key, buffer, recv_len) != 0
+            : recv_len != MESSAGE_SIZE && recv_len != MESSAGE_V2_REPLY_SIZE)
+            continue;
+
+        /* The server answers sequence number n with n + 1. Replies to
+           queries that timed out are stale. */
+        uint32_t answered = ntohl(*(uint32_t *) buffer) - 1;
+        if (!upstream_pending || answered != upstream_sequence)
+            continue;
+
+        microts server_transmit = ntohll(*(uint64_t *) (buffer + SEQ_NUM_SIZE));
+        microts server_receive = server_transmit;
+        if (recv_len >= MESSAGE_V2_REPLY_SIZE)
+            server_receive =
+                ntohll(*(uint64_t *) (buffer + RECEIVE_STAMP_OFFSET));
+
+        fan_out(local_fd, upstream_sent_at, server_receive, server_transmit,
+                received_at);
+        upstream_pending = 0;
+        batch_count = 0;
+    }
+}
+
+/* Arm timer_fd for the upstream timeout or the end of the hold, or disarm
+   it if the agent is idle. */
+static void arm_timer(int timer_fd, microts now) {
+    struct itimerspec spec = {{0}};
+    microts deadline = -1;
+    if (upstream_pending)
+        deadline = upstream_sent_at + options.timeout;
+    else if (waiting_count > 0)
+        deadline = waiting[0].arrived_at + options.hold;
+
+    if (deadline >= 0) {
+        microts wait = deadline > now ? deadline - now : 0;
+        spec.it_value.tv_sec = wait / MILLION;
+        spec.it_value.tv_nsec = (wait % MILLION) * 1000;
+        /* A zero it_value would disarm the timer. */
+        if (wait == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+static void print_counters() {
+    printf("Local queries: %lu, Replies: %lu, Rejected: %lu, Expired: %lu, Dropped: %lu\n",
+           requests, replies, rejected, expired, dropped);
+    printf("Upstream queries: %lu, Timeouts: %lu, Largest batch: %d\n",
+           upstream_queries, upstream_timeouts, largest_batch);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        printf("Usage: agent [server IP] [server port] [socket path]\n");
+        printf("             [--timeout USEC (upstream reply, default %d)]\n",
+               DEFAULT_TIMEOUT);
+        printf("             [--hold USEC (wait for more local queries, default 0)]\n");
+        printf("             [--kernel-timestamps (SO_TIMESTAMPNS arrival times)]\n");
+        printf("             [--clock-source monotonic|tsc]\n");
+        printf("             [--key-file FILE (authenticate with this 32 hex digit key)]\n");
+        exit(1);
+    }
+
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &server_addr.sin_addr) != 1) {
+        printf("FATAL: Invalid server IP address.\n");
+        exit(1);
+    }
+
+    const char *SOCKET_PATH = argv[3];
+    struct sockaddr_un local_addr = {0};
+    local_addr.sun_family = AF_UNIX;
+    if (strlen(SOCKET_PATH) >= sizeof(local_addr.sun_path)) {
+        printf("FATAL: Socket path is too long.\n");
+        exit(1);
+    }
+    strcpy(local_addr.sun_path, SOCKET_PATH);
+
+    options.timeout = DEFAULT_TIMEOUT;
+    int clock_source = CLOCK_SOURCE_MONOTONIC_RAW;
+    static mac_key key;
+    for (int i = 4; i < argc; ++i) {
+        if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            options.timeout = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--hold") == 0 && i + 1 < argc) {
+            options.hold = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--kernel-timestamps") == 0) {
+            options.kernel_timestamps = 1;
+        } else if (strcmp(argv[i], "--clock-source") == 0 && i + 1 < argc) {
+            if (real_hardware_clock_parse_source(argv[++i],
+                                                 &clock_source) != 0) {
+                printf("FATAL: Unknown clock source %s.\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--key-file") == 0 && i + 1 < argc) {
+            if (mac_load_key(argv[++i], &key) != 0) {
+                printf("FATAL: Could not read a key from %s.\n", argv[i]);
+                exit(1);
+            }
+            options.key = &key;
+        } else {
+            printf("FATAL: Unrecognized option %s.\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if (options.timeout <= 0 || options.hold < 0) {
+        printf("FATAL: Timeout must be positive and hold non-negative.\n");
+        exit(1);
+    }
+
+    if (mac_random_sequence(&upstream_sequence) != 0) {
+        printf("FATAL: Could not seed the sequence number. %s\n",
+               strerror(errno));
+        exit(1);
+    }
+
+    if (clock_source != CLOCK_SOURCE_MONOTONIC_RAW
+        && real_hardware_clock_select(clock_source,
+                                      TSC_CALIBRATION_PERIOD) != 0)
+        printf("WARN: TSC unusable, falling back to CLOCK_MONOTONIC_RAW.\n");
+
+    int opt = 1;
+    int upstream_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    int local_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (upstream_fd < 0 || local_fd < 0) {
+        printf("FATAL: Socket creation failed. %s\n", strerror(errno));
+        exit(1);
+    }
+    if (options.kernel_timestamps
+        && (setsockopt(upstream_fd, SOL_SOCKET, SO_TIMESTAMPNS,
+                       &opt, sizeof(opt))
+            || setsockopt(local_fd, SOL_SOCKET, SO_TIMESTAMPNS,
+                          &opt, sizeof(opt)))) {
+        printf("FATAL: Kernel timestamp assignment failed.\n");
+        exit(1);
+    }
+
+    /* A socket file left behind by an earlier agent would fail the bind. */
+    unlink(SOCKET_PATH);
+    if (bind(local_fd, (struct sockaddr *) &local_addr,
+             sizeof(local_addr)) < 0) {
+        printf("FATAL: Could not bind the agent to %s. %s\n", SOCKET_PATH,
+               strerror(errno));
+        exit(1);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+    /* SIGINT and SIGTERM print the counters and remove the socket. */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK);
+
+    int fds[] = { local_fd, upstream_fd, timer_fd, signal_fd };
+    for (int i = SOURCE_LOCAL; i <= SOURCE_SIGNAL; ++i) {
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
+        if (epoll_fd < 0 || fds[i] < 0
+            || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event) != 0) {
+            printf("FATAL: Could not create the agent event loop.\n");
+            exit(1);
+        }
+    }
+
+    printf("Serving %s for %s:%s\n", SOCKET_PATH, argv[1], argv[2]);
+    fflush(stdout);
+
+    while (1) {
+        struct epoll_event events[SOURCE_SIGNAL + 1];
+        int ready = epoll_wait(epoll_fd, events, SOURCE_SIGNAL + 1, -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("FATAL: epoll_wait failed. %s\n", strerror(errno));
+            exit(1);
+        }
+
+        for (int n = 0; n < ready; ++n) {
+            uint32_t source = events[n].data.u32;
+            if (source == SOURCE_SIGNAL) {
+                print_counters();
+                unlink(SOCKET_PATH);
+                exit(0);
+            } else if (source == SOURCE_TIMER) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0
+                    && errno != EAGAIN)
+                    printf("WARN: Reading the agent timer failed. %s\n",
+                           strerror(errno));
+            } else if (source == SOURCE_UPSTREAM) {
+                receive_upstream(upstream_fd, local_fd);
+            } else {
+                receive_local(local_fd);
+            }
+        }
+
+        microts now;
+        real_hardware_clock_gettime(&now);
+        if (upstream_pending && now - upstream_sent_at >= options.timeout) {
+            printf("WARN: Upstream query timed out.\n");
+            retry_upstream(upstream_fd, &server_addr, now);
+        }
+        flush_waiting(upstream_fd, &server_addr, now);
+        arm_timer(timer_fd, now);
+    }
+}
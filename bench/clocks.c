@@ -0,0 +1,296 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "../sclock.h"
+#include "../mac.h"
+#include "../ratelimit.h"
+#include "../metrics.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+/* Microbenchmarks for the clock reads in sclock.c, the wire encoding and
+   message authentication (mac.c), the server's per-client rate limit
+   (ratelimit.c) and metrics recording (metrics.h).
+   Each benchmark is timed in batches of BATCH_SIZE operations so that the
+   cost of reading the timer is spread over the batch. ns/op is the total
+   time over the total operations; p50 and p99 are taken over the per-op
+   cost of each batch. Cycles are TSC reference cycles per op. */
+
+#define BATCH_SIZE 100
+
+/* Replies in the largest server batch (MAX_BATCH_SIZE in server.c). */
+#define REPLY_BATCH 64
+#define BATCHES 20000
+#define WARMUP_BATCHES 1000
+
+typedef struct bench_state {
+    vhspec vhc;
+    scspec amortizing;
+    scspec amortized;
+    char buffer[MESSAGE_MAX_SIZE];
+    mac_key key;
+    char query[MESSAGE_AUTH_QUERY_SIZE];
+    char reply[MESSAGE_AUTH_REPLY_SIZE];
+    siphash_state mac;
+    client_table clients;
+    /* queries are spread round robin over this many client addresses */
+    uint32_t client_count;
+    uint32_t next_client;
+    uint64_t counter;
+    histogram latency;
+    volatile microts sink;
+} bench_state;
+
+typedef void (*bench_op)(bench_state *state);
+
+static void op_real_hardware_clock(bench_state *state) {
+    microts t;
+    real_hardware_clock_gettime(&t);
+    state->sink += t;
+}
+
+static void op_virtual_hardware_clock(bench_state *state) {
+    microts t;
+    virtual_hardware_clock_gettime(&state->vhc, &t);
+    state->sink += t;
+}
+
+static void op_software_clock_amortizing(bench_state *state) {
+    microts t;
+    software_clock_gettime(&state->amortizing, &t);
+    state->sink += t;
+}
+
+static void op_software_clock_amortized(bench_state *state) {
+    microts t;
+    software_clock_gettime(&state->amortized, &t);
+    state->sink += t;
+}
+
+/* A version 2 reply, as server.c writes it. */
+static void op_encode_reply(bench_state *state) {
+    char *b = state->buffer;
+    microts t = state->sink;
+    *(uint32_t *) b = htonl((uint32_t) t + 1);
+    *(uint64_t *) (b + SEQ_NUM_SIZE) = htonll(t);
+    memset(b + VERSION_OFFSET, 0, RECEIVE_STAMP_OFFSET - VERSION_OFFSET);
+    *(uint8_t *) (b + VERSION_OFFSET) = PROTOCOL_VERSION;
+    *(uint64_t *) (b + RECEIVE_STAMP_OFFSET) = htonll(t - 1);
+    state->sink += b[0];
+}
+
+/* The same reply, as client.c reads it. */
+static void op_decode_reply(bench_state *state) {
+    char *b = state->buffer;
+    uint32_t sequence_number = ntohl(*(uint32_t *) b) - 1;
+    microts transmit = ntohll(*(uint64_t *) (b + SEQ_NUM_SIZE));
+    microts receive = ntohll(*(uint64_t *) (b + RECEIVE_STAMP_OFFSET));
+    state->sink += sequence_number + transmit - receive;
+}
+
+static void op_sign_query(bench_state *state) {
+    *(uint32_t *) state->query = (uint32_t) state->sink;
+    state->sink += mac_sign_query(&state->key, state->query);
+}
+
+static void op_verify_query(bench_state *state) {
+    state->sink += mac_verify_query(&state->key, state->query,
+                                    MESSAGE_AUTH_QUERY_SIZE);
+}
+
+/* The server's share before its transmit clock read... */
+static void op_reply_begin(bench_state *state) {
+    *(uint64_t *) (state->reply + RECEIVE_STAMP_OFFSET) = state->sink;
+    mac_reply_begin(&state->key, state->reply, &state->mac);
+    state->sink += state->mac.v0;
+}
+
+/* ...and between the clock read and the send. */
+static void op_reply_end(bench_state *state) {
+    state->sink += mac_reply_end(&state->mac, state->reply, state->sink);
+}
+
+/* A keyed server batch: one clock read, then every tag. The transmit
+   time of the batch trails its clock read by this much. */
+static void op_reply_batch(bench_state *state) {
+    microts t;
+    virtual_hardware_clock_gettime(&state->vhc, &t);
+    for (int i = 0; i < REPLY_BATCH; ++i)
+        state->sink += mac_reply_end(&state->mac, state->reply, t);
+}
+
+static void op_verify_reply(bench_state *state) {
+    state->sink += mac_verify_reply(&state->key, state->reply,
+                                    MESSAGE_AUTH_REPLY_SIZE);
+}
+
+static void op_admit_query(bench_state *state) {
+    uint32_t client = state->next_client++;
+    if (state->next_client == state->client_count)
+        state->next_client = 0;
+    state->sink += client_table_admit(&state->clients, htonl(client), 123,
+                                      client, state->sink);
+}
+
+static void op_metric_add(bench_state *state) {
+    metric_add(&state->counter, 1);
+}
+
+/* RTT-like values spread over a few hundred buckets. */
+static void op_hist_record_shared(bench_state *state) {
+    hist_record_shared(&state->latency, 20 + (state->counter++ & 1023) * 7);
+}
+
+static nanots now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return now.tv_sec * (nanots) 1000000000 + now.tv_nsec;
+}
+
+static uint64_t now_cycles() {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char *name, bench_op op, bench_state *state,
+                double *per_op) {
+    for (int b = 0; b < WARMUP_BATCHES; ++b)
+        for (int i = 0; i < BATCH_SIZE; ++i)
+            op(state);
+
+    nanots total_ns = 0;
+    uint64_t total_cycles = 0;
+    for (int b = 0; b < BATCHES; ++b) {
+        uint64_t cycles = now_cycles();
+        nanots start = now_ns();
+        for (int i = 0; i < BATCH_SIZE; ++i)
+            op(state);
+        nanots elapsed = now_ns() - start;
+        total_cycles += now_cycles() - cycles;
+
+        total_ns += elapsed;
+        per_op[b] = (double) elapsed / BATCH_SIZE;
+    }
+
+    qsort(per_op, BATCHES, sizeof(double), compare_doubles);
+    double ops = (double) BATCHES * BATCH_SIZE;
+    printf("%s,%.2f,%.2f,%.2f,", name, total_ns / ops,
+           per_op[BATCHES / 2], per_op[BATCHES * 99 / 100]);
+#ifdef HAVE_RDTSC
+    printf("%.1f\n", total_cycles / ops);
+#else
+    printf("n/a\n");
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    double *per_op = malloc(BATCHES * sizeof(double));
+    bench_state *state = calloc(1, sizeof(bench_state));
+    if (per_op == NULL || state == NULL) {
+        printf("FATAL: Could not allocate benchmark state.\n");
+        exit(1);
+    }
+
+    state->vhc.drift_rate = 20;
+    virtual_hardware_clock_init(&state->vhc);
+
+    /* A rapport that just happened and amortizes for an hour, and one
+       whose amortization finished long ago. */
+    microts vhc_now;
+    virtual_hardware_clock_gettime(&state->vhc, &vhc_now);
+    state->amortizing.amortization_period = 3600 * (microts) MILLION;
+    state->amortizing.rapport_vhc = vhc_now;
+    state->amortizing.rapport_local = vhc_now + 1000;
+    state->amortizing.rapport_master = vhc_now + 1500;
+    state->amortizing.vhclock = &state->vhc;
+    state->amortized = state->amortizing;
+    state->amortized.amortization_period = 1;
+    state->amortized.rapport_vhc = vhc_now - MILLION;
+
+    printf("Benchmark,ns/op,p50 ns/op,p99 ns/op,cycles/op\n");
+
+    const char *sources[] = { "monotonic", "tsc" };
+    for (int s = 0; s < 2; ++s) {
+        int source;
+        char name[64];
+        real_hardware_clock_parse_source(sources[s], &source);
+        if (real_hardware_clock_select(source, TSC_CALIBRATION_PERIOD) != 0) {
+            printf("WARN: Skipping the %s clock source.\n", sources[s]);
+            continue;
+        }
+
+        /* The VHC and software clocks sit on top of the real clock. */
+        snprintf(name, sizeof(name), "real_hardware_clock_gettime (%s)",
+                 sources[s]);
+        run(name, op_real_hardware_clock, state, per_op);
+        snprintf(name, sizeof(name), "virtual_hardware_clock_gettime (%s)",
+                 sources[s]);
+        run(name, op_virtual_hardware_clock, state, per_op);
+        snprintf(name, sizeof(name),
+                 "software_clock_gettime amortizing (%s)", sources[s]);
+        run(name, op_software_clock_amortizing, state, per_op);
+        snprintf(name, sizeof(name),
+                 "software_clock_gettime amortized (%s)", sources[s]);
+        run(name, op_software_clock_amortized, state, per_op);
+    }
+
+    run("encode reply (htonl/htonll)", op_encode_reply, state, per_op);
+    run("decode reply (ntohl/ntohll)", op_decode_reply, state, per_op);
+
+    state->key.k0 = 0x0706050403020100ULL;
+    state->key.k1 = 0x0f0e0d0c0b0a0908ULL;
+    strncpy(state->query + SEQ_NUM_SIZE, QUERY_STRING, PAYLOAD_SIZE);
+    *(uint8_t *) (state->query + VERSION_OFFSET) = PROTOCOL_VERSION;
+    *(uint8_t *) (state->reply + VERSION_OFFSET) = PROTOCOL_VERSION;
+    run("sign query (SipHash-2-4)", op_sign_query, state, per_op);
+    run("verify query", op_verify_query, state, per_op);
+    run("sign reply before clock read", op_reply_begin, state, per_op);
+    run("sign reply after clock read", op_reply_end, state, per_op);
+    run("sign 64 replies after clock read", op_reply_batch, state, per_op);
+    run("verify reply", op_verify_reply, state, per_op);
+
+    /* The server's default table. Queries from one client stay in cache,
+       half as many clients as slots fill the table, and four times as
+       many evict on almost every query. */
+    if (client_table_init(&state->clients, 4096, 10, 64) != 0) {
+        printf("FATAL: Could not allocate the client table.\n");
+        exit(1);
+    }
+    const uint32_t client_counts[] = { 1, 2048, 16384 };
+    for (int c = 0; c < 3; ++c) {
+        char name[64];
+        state->client_count = client_counts[c];
+        state->next_client = 0;
+        snprintf(name, sizeof(name), "rate limit admit (%u client%s)",
+                 client_counts[c], client_counts[c] == 1 ? "" : "s");
+        run(name, op_admit_query, state, per_op);
+    }
+    client_table_free(&state->clients);
+
+    hist_init(&state->latency);
+    run("metric_add", op_metric_add, state, per_op);
+    run("hist_record_shared", op_hist_record_shared, state, per_op);
+
+    printf("\nMessage,Query bytes,Reply bytes\n");
+    printf("version 1,%d,%d\n", MESSAGE_SIZE, MESSAGE_SIZE);
+    printf("version 2,%d,%d\n", MESSAGE_V2_QUERY_SIZE, MESSAGE_V2_REPLY_SIZE);
+    printf("authenticated,%d,%d\n", MESSAGE_AUTH_QUERY_SIZE,
+           MESSAGE_AUTH_REPLY_SIZE);
+
+    free(state);
+    free(per_op);
+    return 0;
+}
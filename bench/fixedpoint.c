@@ -0,0 +1,139 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../sclock.h"
+
+/* Compares the double and fixed-point clock arithmetic in sclock.h.
+   Reports reads per second for each (arithmetic only, no clock syscall)
+   and the worst-case distance of each from the exact real-valued result. */
+
+#define INPUTS (1 << 20)
+#define ROUNDS 16
+
+/* Up to a year of uptime, in usec. */
+#define MAX_UPTIME 31536000000000LL
+
+typedef struct bench_input {
+    vhspec v;
+    scspec s;
+    microts real_time;
+    microts vhc_time;
+} bench_input;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int64_t random_between(int64_t low, int64_t high) {
+    return low + (int64_t) (next_random() % (uint64_t) (high - low + 1));
+}
+
+static void generate(bench_input *in) {
+    in->v.initial_value = random_between(0, MAX_UPTIME);
+    in->v.offset = random_between(-(int64_t) MILLION, MILLION);
+    in->v.drift_rate = random_between(-100000, 100000) / 1000.0;
+    in->v.drift_fixed = drift_rate_to_fixed(in->v.drift_rate);
+    in->real_time = in->v.initial_value + random_between(0, MAX_UPTIME);
+
+    /* Half the reads land inside an amortization window. */
+    in->s.amortization_period = random_between(100000, 10000000);
+    in->s.rapport_vhc = random_between(0, MAX_UPTIME);
+    in->s.rapport_local = in->s.rapport_vhc
+        + random_between(-(int64_t) MILLION, MILLION);
+    in->s.rapport_master = in->s.rapport_local + random_between(-100000, 100000);
+    in->s.vhclock = &in->v;
+    software_clock_set_frequency(&in->s, random_between(-100000, 100000) / 1000.0);
+    in->vhc_time = in->s.rapport_vhc
+        + random_between(0, 2 * in->s.amortization_period);
+}
+
+static long double exact_vhc(bench_input *in) {
+    long double elapsed = in->real_time - in->v.initial_value;
+    return elapsed + elapsed * in->v.drift_rate / MILLION + in->v.offset;
+}
+
+static long double exact_software(bench_input *in) {
+    scspec *s = &in->s;
+    long double since = in->vhc_time - s->rapport_vhc;
+    long double frequency = since * (long double) s->frequency / MILLION;
+    if (s->rapport_vhc + s->amortization_period <= in->vhc_time)
+        return in->vhc_time + (s->rapport_master - s->rapport_vhc) + frequency;
+
+    return s->rapport_local + since + since
+        * (long double) (s->rapport_master - s->rapport_local)
+        / s->amortization_period + frequency;
+}
+
+static double elapsed_seconds(microts start) {
+    microts end;
+    real_hardware_clock_gettime(&end);
+    return (double) (end - start) / MILLION;
+}
+
+int main(int argc, char *argv[]) {
+    bench_input *inputs = malloc(INPUTS * sizeof(bench_input));
+    if (inputs == NULL) {
+        printf("FATAL: Could not allocate benchmark inputs.\n");
+        exit(1);
+    }
+    for (int i = 0; i < INPUTS; ++i)
+        generate(&inputs[i]);
+
+    /* Worst-case rounding error against the exact value */
+    long double vhc_error_double = 0, vhc_error_fixed = 0;
+    long double sc_error_double = 0, sc_error_fixed = 0;
+    for (int i = 0; i < INPUTS; ++i) {
+        long double vhc = exact_vhc(&inputs[i]);
+        long double sc = exact_software(&inputs[i]);
+        long double e;
+
+        e = fabsl(virtual_hardware_clock_value_double(&inputs[i].v,
+                                                      inputs[i].real_time) - vhc);
+        if (e > vhc_error_double) vhc_error_double = e;
+        e = fabsl(virtual_hardware_clock_value_fixed(&inputs[i].v,
+                                                     inputs[i].real_time) - vhc);
+        if (e > vhc_error_fixed) vhc_error_fixed = e;
+        e = fabsl(software_clock_value_double(&inputs[i].s,
+                                              inputs[i].vhc_time) - sc);
+        if (e > sc_error_double) sc_error_double = e;
+        e = fabsl(software_clock_value_fixed(&inputs[i].s,
+                                             inputs[i].vhc_time) - sc);
+        if (e > sc_error_fixed) sc_error_fixed = e;
+    }
+
+    /* Throughput of one VHC read followed by one software clock read */
+    volatile microts sink = 0;
+    microts start;
+    double reads = (double) INPUTS * ROUNDS;
+
+    real_hardware_clock_gettime(&start);
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < INPUTS; ++i)
+            sink += software_clock_value_double(&inputs[i].s,
+                virtual_hardware_clock_value_double(&inputs[i].v,
+                                                    inputs[i].real_time));
+    double double_seconds = elapsed_seconds(start);
+
+    real_hardware_clock_gettime(&start);
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < INPUTS; ++i)
+            sink += software_clock_value_fixed(&inputs[i].s,
+                virtual_hardware_clock_value_fixed(&inputs[i].v,
+                                                   inputs[i].real_time));
+    double fixed_seconds = elapsed_seconds(start);
+
+    printf("Path,Reads/sec,ns/read,Max VHC Error (usec),Max Software Clock Error (usec)\n");
+    printf("double,%.0f,%.2f,%.4Lf,%.4Lf\n", reads / double_seconds,
+           double_seconds * 1e9 / reads, vhc_error_double, sc_error_double);
+    printf("fixed,%.0f,%.2f,%.4Lf,%.4Lf\n", reads / fixed_seconds,
+           fixed_seconds * 1e9 / reads, vhc_error_fixed, sc_error_fixed);
+
+    free(inputs);
+    return 0;
+}
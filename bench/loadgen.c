@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../sclock.h"
+#include "../delay.h"
+#include "../hist.h"
+
+/* Open-loop load generator for the server.
+
+   Simulates `clients` clients that each send v2 queries at `rate` queries
+   per second, independent of how fast replies come back. The clients are
+   multiplexed over a smaller set of sockets and threads: each thread
+   drives its share of the clients as one Poisson stream (or an evenly
+   spaced one with --fixed), sends each query from the next of its
+   sockets, and matches replies to queries by sequence number. Reply
+   latency goes into a log-linear histogram; a query without a reply after
+   --timeout counts as lost. */
+
+#define MAX_THREADS 256
+#define MAX_SOCKETS 4096
+
+/* Queries remembered per thread. The low bits of the sequence number pick
+   the slot, so a slot is reused after this many sends. */
+#define PENDING_BITS 16
+#define PENDING_SIZE (1 << PENDING_BITS)
+
+#define DEFAULT_TIMEOUT 1000000
+
+typedef struct pending_query {
+    uint32_t sequence_number;
+    int in_flight;
+    nanots sent_at;
+} pending_query;
+
+typedef struct load_thread {
+    pthread_t thread;
+    int id;
+    int *fds;
+    int fd_count;
+    /* Aggregate rate of this thread's clients, in queries per second. */
+    double rate;
+    int fixed;
+    uint64_t random_state;
+
+    pending_query *pending;
+    histogram latency;
+    unsigned long sent;
+    unsigned long received;
+    unsigned long late;
+    unsigned long send_errors;
+} load_thread;
+
+static struct sockaddr_in server_addr;
+static nanots runtime_ns;
+static nanots timeout_ns;
+
+static int send_query(load_thread *t, int fd, uint32_t sequence_number) {
+    char request_buffer[MESSAGE_V2_QUERY_SIZE] = {0};
+    *(uint32_t *) request_buffer = htonl(sequence_number);
+    strncpy(request_buffer + SEQ_NUM_SIZE, QUERY_STRING, PAYLOAD_SIZE);
+    *(uint8_t *) (request_buffer + VERSION_OFFSET) = PROTOCOL_VERSION;
+
+    pending_query *p = &t->pending[sequence_number & (PENDING_SIZE - 1)];
+    real_hardware_clock_gettime_ns(&p->sent_at);
+    p->sequence_number = sequence_number;
+    p->in_flight = 1;
+
+    if (sendto(fd, request_buffer, MESSAGE_V2_QUERY_SIZE, MSG_DONTWAIT,
+               (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+        p->in_flight = 0;
+        ++t->send_errors;
+        return -1;
+    }
+    ++t->sent;
+    return 0;
+}
+
+/* Drain the replies queued on fd. */
+static void receive_replies(load_thread *t, int fd) {
+    char receive_buffer[MESSAGE_MAX_SIZE];
+    int length;
+    while ((length = recv(fd, receive_buffer, sizeof(receive_buffer),
+                          MSG_DONTWAIT)) >= 0) {
+        if (length != MESSAGE_SIZE && length != MESSAGE_V2_REPLY_SIZE)
+            continue;
+
+        nanots now;
+        real_hardware_clock_gettime_ns(&now);
+        uint32_t answered = ntohl(*(uint32_t *) receive_buffer) - 1;
+        pending_query *p = &t->pending[answered & (PENDING_SIZE - 1)];
+        if (!p->in_flight || p->sequence_number != answered)
+            continue;
+
+        p->in_flight = 0;
+        if (now - p->sent_at > timeout_ns) {
+            ++t->late;
+            continue;
+        }
+        ++t->received;
+        hist_record(&t->latency, now - p->sent_at);
+    }
+}
+
+static nanots next_interval(load_thread *t) {
+    double mean = 1e9 / t->rate;
+    if (t->fixed)
+        return mean;
+    return -mean * log(random_uniform(&t->random_state));
+}
+
+static void *run_thread(void *arg) {
+    load_thread *t = arg;
+    struct pollfd pfds[MAX_SOCKETS];
+    for (int i = 0; i < t->fd_count; ++i) {
+        pfds[i].fd = t->fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    nanots start, now;
+    real_hardware_clock_gettime_ns(&start);
+    nanots next_send = start + next_interval(t);
+    nanots send_end = start + runtime_ns;
+    nanots drain_end = send_end + timeout_ns;
+    uint32_t sequence_number = (uint32_t) t->id << 24;
+    int next_fd = 0;
+
+    for (now = start; now < drain_end; real_hardware_clock_gettime_ns(&now)) {
+        /* Catch up on every send that is due. Falling behind shows up as
+           bursts, not as a lower offered rate. */
+        while (next_send <= now && next_send < send_end) {
+            send_query(t, t->fds[next_fd], sequence_number++);
+            next_fd = (next_fd + 1) % t->fd_count;
+            next_send += next_interval(t);
+        }
+
+        nanots wake = next_send < send_end ? next_send : drain_end;
+        struct timespec wait = { 0, 0 };
+        if (wake > now) {
+            wait.tv_sec = (wake - now) / 1000000000;
+            wait.tv_nsec = (wake - now) % 1000000000;
+        }
+
+        int ready = ppoll(pfds, t->fd_count, &wait, NULL);
+        if (ready < 0 && errno != EINTR) {
+            printf("FATAL: ppoll failed. %s\n", strerror(errno));
+            exit(1);
+        }
+        for (int i = 0; ready > 0 && i < t->fd_count; ++i) {
+            if (pfds[i].revents & POLLIN) {
+                receive_replies(t, pfds[i].fd);
+                --ready;
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 6) {
+        printf("Usage: loadgen [server IP] [server port] [runtime (seconds)]\n");
+        printf("               [clients] [queries per second per client]\n");
+        printf("               [--sockets N (default min(clients, 256))]\n");
+        printf("               [--threads N (default 1)]\n");
+        printf("               [--timeout USEC (default %d)]\n", DEFAULT_TIMEOUT);
+        printf("               [--fixed (evenly spaced instead of Poisson)]\n");
+        exit(1);
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &server_addr.sin_addr) != 1) {
+        printf("FATAL: Invalid server IP address.\n");
+        exit(1);
+    }
+
+    runtime_ns = atol(argv[3]) * (nanots) 1000000000;
+    const long CLIENTS = atol(argv[4]);
+    const double RATE = atof(argv[5]);
+    int sockets = CLIENTS < 256 ? CLIENTS : 256;
+    int threads = 1;
+    int fixed = 0;
+    timeout_ns = DEFAULT_TIMEOUT * (nanots) 1000;
+
+    for (int i = 6; i < argc; ++i) {
+        if (strcmp(argv[i], "--sockets") == 0 && i + 1 < argc) {
+            sockets = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            timeout_ns = atol(argv[++i]) * (nanots) 1000;
+        } else if (strcmp(argv[i], "--fixed") == 0) {
+            fixed = 1;
+        } else {
+            printf("FATAL: Unrecognized option %s.\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if (CLIENTS < 1 || RATE <= 0 || runtime_ns <= 0 || timeout_ns <= 0) {
+        printf("FATAL: Clients, rate, runtime and timeout must be positive.\n");
+        exit(1);
+    }
+    if (threads < 1 || threads > MAX_THREADS || threads > CLIENTS) {
+        printf("FATAL: Threads must be between 1 and min(clients, %d).\n",
+               MAX_THREADS);
+        exit(1);
+    }
+    if (sockets < threads || sockets > MAX_SOCKETS) {
+        printf("FATAL: Sockets must be between the thread count and %d.\n",
+               MAX_SOCKETS);
+        exit(1);
+    }
+
+    /* The histogram is large, so threads live on the heap. */
+    load_thread *workers = calloc(threads, sizeof(load_thread));
+    int *fds = malloc(sockets * sizeof(int));
+    if (workers == NULL || fds == NULL) {
+        printf("FATAL: Could not allocate the load generator.\n");
+        exit(1);
+    }
+
+    for (int s = 0; s < sockets; ++s) {
+        if ((fds[s] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+            printf("FATAL: Socket creation failed. %s\n", strerror(errno));
+            exit(1);
+        }
+        int rcvbuf = 1 << 20;
+        setsockopt(fds[s], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
+    /* Split sockets and clients as evenly as possible. */
+    int first_fd = 0;
+    for (int i = 0; i < threads; ++i) {
+        load_thread *t = &workers[i];
+        long clients = CLIENTS / threads + (i < CLIENTS % threads);
+        t->id = i;
+        t->fd_count = sockets / threads + (i < sockets % threads);
+        t->fds = fds + first_fd;
+        first_fd += t->fd_count;
+        t->rate = clients * RATE;
+        t->fixed = fixed;
+        t->random_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+        hist_init(&t->latency);
+        if ((t->pending = calloc(PENDING_SIZE, sizeof(pending_query))) == NULL) {
+            printf("FATAL: Could not allocate the load generator.\n");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, run_thread,
+                           &workers[i]) != 0) {
+            printf("FATAL: Load thread creation failed.\n");
+            exit(1);
+        }
+    }
+
+    histogram *latency = malloc(sizeof(histogram));
+    if (latency == NULL) {
+        printf("FATAL: Could not allocate the load generator.\n");
+        exit(1);
+    }
+    hist_init(latency);
+    unsigned long sent = 0, received = 0, late = 0, send_errors = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        hist_merge(latency, &workers[i].latency);
+        sent += workers[i].sent;
+        received += workers[i].received;
+        late += workers[i].late;
+        send_errors += workers[i].send_errors;
+        free(workers[i].pending);
+    }
+
+    double seconds = (double) runtime_ns / 1e9;
+    unsigned long lost = sent - received;
+    printf("Clients: %ld, Rate: %g queries/sec each, Sockets: %d, Threads: %d\n",
+           CLIENTS, RATE, sockets, threads);
+    printf("Runtime: %.2f sec, Offered: %.0f queries/sec (%s)\n", seconds,
+           CLIENTS * RATE, fixed ? "fixed" : "Poisson");
+    printf("Sent: %lu, Received: %lu, Lost: %lu (%.3f%%), Late: %lu, Send errors: %lu\n",
+           sent, received, lost, sent ? 100.0 * lost / sent : 0.0, late,
+           send_errors);
+    printf("Throughput: %.0f replies/sec\n", received / seconds);
+    printf("Latency (usec),min,mean,p50,p90,p99,p99.9,max\n");
+    printf("Latency (usec),%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+           latency->total ? latency->min / 1e3 : 0.0, hist_mean(latency) / 1e3,
+           hist_percentile(latency, 50) / 1e3,
+           hist_percentile(latency, 90) / 1e3,
+           hist_percentile(latency, 99) / 1e3,
+           hist_percentile(latency, 99.9) / 1e3, latency->max / 1e3);
+
+    free(latency);
+    free(workers);
+    free(fds);
+    return 0;
+}
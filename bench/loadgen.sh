@@ -0,0 +1,42 @@
+#!/usr/bin/env bash
+# Step the offered load against a local server until latency degrades.
+# Usage: bench/loadgen.sh [runtime (seconds)] [clients] [server options...]
+# Each step raises the per-client query rate; compare the p99 and server
+# CPU columns across server options, e.g. `bench/loadgen.sh 5 1000 --batch 32`.
+# Server CPU is user plus system time from /proc, per reply sent.
+runtime="${1:-5}"
+clients="${2:-1000}"
+shift $(( $# < 2 ? $# : 2 ))
+port=18081
+
+./server "$port" 0 "$@" > /dev/null &
+server_pid=$!
+sleep 0.5
+
+# CPU time the server has used so far, in clock ticks.
+server_ticks() {
+    awk '{ print $14 + $15 }' "/proc/${server_pid}/stat"
+}
+ticks_per_sec=$(getconf CLK_TCK)
+
+echo "Offered (queries/sec),Throughput,Loss (%),p50 (usec),p99 (usec),p99.9 (usec),Server CPU per reply (usec)"
+for rate in 10 20 50 100 200 500; do
+    before=$(server_ticks)
+    result=$(./bench/loadgen 127.0.0.1 "$port" "$runtime" "$clients" "$rate")
+    after=$(server_ticks)
+    echo "$result" |
+        awk -v offered=$((clients * rate)) -v runtime="$runtime" \
+            -v ticks=$((after - before)) -v hz="$ticks_per_sec" -F'[ ,()%]+' '
+            /^Sent:/ { loss = $7 }
+            /^Throughput:/ { throughput = $2 }
+            /^Latency \(usec\),[0-9]/ { p50 = $5; p99 = $7; p999 = $8 }
+            END {
+                cpu = "n/a"
+                if (throughput > 0)
+                    cpu = sprintf("%.2f", ticks / hz * 1e6 / (throughput * runtime))
+                print offered "," throughput "," loss "," p50 "," p99 "," p999 "," cpu
+            }'
+done
+
+kill "$server_pid"
+wait "$server_pid" 2> /dev/null || true
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../sclock.h"
+
+/* Packets-per-second benchmark for the server.
+   Keeps `window` queries in flight against one server and counts the replies
+   that come back over a fixed runtime. Run it once against `server` and once
+   against `server --batch N` to compare the two receive paths. */
+
+#define MAX_WINDOW 4096
+
+/* If nothing arrives for this long, assume the window was lost and refill it. */
+#define STALL_TIMEOUT_MSEC 100
+
+static void send_query(int fd, struct sockaddr_in *server_addr,
+                       uint32_t sequence_number) {
+    char request_buffer[MESSAGE_SIZE] = {0};
+    *(uint32_t *) request_buffer = htonl(sequence_number);
+    strncpy(request_buffer + SEQ_NUM_SIZE, QUERY_STRING, PAYLOAD_SIZE);
+    sendto(fd, request_buffer, MESSAGE_SIZE, 0,
+           (struct sockaddr *) server_addr, sizeof(*server_addr));
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        printf("Usage: pps [server IP] [server port] [runtime (seconds)]\n");
+        printf("           [queries in flight]\n");
+        exit(1);
+    }
+
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &server_addr.sin_addr) != 1) {
+        printf("FATAL: Invalid server IP address.\n");
+        exit(1);
+    }
+
+    const microts RUNTIME = atol(argv[3]) * MILLION;
+    const int WINDOW = atoi(argv[4]);
+    if (WINDOW < 1 || WINDOW > MAX_WINDOW) {
+        printf("FATAL: Queries in flight must be between 1 and %d.\n",
+               MAX_WINDOW);
+        exit(1);
+    }
+
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        printf("FATAL: Socket creation failed.\n");
+        exit(1);
+    }
+
+    /* Give the socket enough buffer to hold a full window of replies. */
+    int rcvbuf = 1 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    uint32_t sequence_number = 0;
+    unsigned long sent = 0, received = 0, stalls = 0;
+
+    microts start, now;
+    real_hardware_clock_gettime(&start);
+    now = start;
+
+    for (int i = 0; i < WINDOW; ++i, ++sent)
+        send_query(fd, &server_addr, sequence_number++);
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    char receive_buffer[MESSAGE_SIZE];
+    while (now - start < RUNTIME) {
+        int ready = poll(&pfd, 1, STALL_TIMEOUT_MSEC);
+        if (ready < 0 && errno != EINTR) {
+            printf("FATAL: poll failed. %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (ready == 0) {
+            /* The whole window went missing. Start a fresh one. */
+            ++stalls;
+            for (int i = 0; i < WINDOW; ++i, ++sent)
+                send_query(fd, &server_addr, sequence_number++);
+        }
+
+        /* Replace every reply with a new query so the window stays full. */
+        while (recv(fd, receive_buffer, MESSAGE_SIZE, MSG_DONTWAIT)
+               == MESSAGE_SIZE) {
+            ++received;
+            ++sent;
+            send_query(fd, &server_addr, sequence_number++);
+        }
+
+        real_hardware_clock_gettime(&now);
+    }
+
+    double seconds = (double) (now - start) / MILLION;
+    printf("Window: %d, Runtime: %.2f sec\n", WINDOW, seconds);
+    printf("Sent: %lu, Received: %lu, Stalls: %lu\n", sent, received, stalls);
+    printf("Replies per second: %.0f\n", received / seconds);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+# Compare server throughput between the recvfrom/sendto loop and the
+# recvmmsg/sendmmsg batched loop on loopback.
+# Usage: bench/pps.sh [runtime (seconds)] [queries in flight] [batch size]
+runtime="${1:-5}"
+window="${2:-256}"
+batch="${3:-32}"
+port=18080
+
+run() {
+    ./server "$port" 0 "$@" > /dev/null &
+    server_pid=$!
+    sleep 0.5
+    ./bench/pps 127.0.0.1 "$port" "$runtime" "$window"
+    kill "$server_pid"
+    wait "$server_pid" 2> /dev/null || true
+}
+
+echo "== recvfrom/sendto =="
+run
+echo "== recvmmsg/sendmmsg (batch ${batch}) =="
+run --batch "$batch"
@@ -10,11 +10,22 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "sclock.h"
+#include "shmclock.h"
+#include "rapport.h"
+#include "samplelog.h"
+#include "stats.h"
+#include "mac.h"
+#include "metrics.h"
 
 /* Unless otherwise specified, constants are given in microseconds
    (e.g. 1 * 10^6 microseconds = 1000000 = 1 second ) */
@@ -24,6 +35,70 @@
 //#define AMORTIZATION_PERIOD 500000
 #define SERVER_SYNC_ATTEMPTS 50
 
+/* Default and maximum number of sync queries in flight at once. */
+#define SYNC_WINDOW 8
+#define MAX_SYNC_WINDOW SERVER_SYNC_ATTEMPTS
+
+/* Once a majority of servers has answered a rapport, the rest get this
+   many times the slowest RTT so far. */
+#define STRAGGLER_GRACE 4
+
+/* A query that has not been answered yet. */
+typedef struct pending_query {
+    int in_use;
+    uint32_t sequence_number;
+    microts sent_at;
+} pending_query;
+
+/* A server queried at each rapport. */
+typedef struct time_server {
+    struct sockaddr_in addr;
+
+    /* The queries of the current rapport (one, or a burst), how many are
+       unanswered and answered, and the newest answer */
+    pending_query queries[MAX_RAPPORT_BURST];
+    int pending;
+    int answered;
+    server_sample sample;
+    rapport_estimate estimate;
+
+    /* Best-of-N selection over this server's answers, when enabled */
+    int filtering;
+    rapport_filter filter;
+
+    unsigned long replies;
+    unsigned long rejected;
+} time_server;
+
+/* With --key-file, queries carry a tag and only replies with a valid tag
+   count as replies. NULL otherwise. */
+static const mac_key *client_key = NULL;
+
+/* Served with --metrics. Only the main thread writes them, and only after
+   the timestamps of an exchange have been taken. */
+typedef struct client_metrics {
+    uint64_t queries;
+    uint64_t replies;
+    uint64_t timeouts;
+    /* replies whose sequence number matches no query in flight */
+    uint64_t stale;
+    /* datagrams that are not replies, or not authenticated ones */
+    uint64_t invalid;
+    uint64_t rapports;
+    /* M - L at the last rapport, in usec, and the slope that amortizes it
+       and the frequency correction, both in PPM */
+    double offset_correction;
+    double amortization_slope;
+    double frequency;
+    /* usec, excluding server residence */
+    histogram rtt;
+    /* magnitudes per rapport: usec and PPB */
+    histogram correction;
+    histogram slope;
+} client_metrics;
+
+static client_metrics metrics;
+
 void usec_to_timeval(struct timeval *tv, microts usec) {
     tv->tv_sec = usec / MILLION;
     tv->tv_usec = usec % MILLION;
@@ -35,8 +110,10 @@ void usec_to_timespec(struct timespec *tc, microts usec) {
     tc->tv_nsec = (usec % MILLION) * 1000;
 }
 
+/* Seeded randomly in main (see mac_random_sequence). */
+static uint32_t current_sequence_number;
+
 uint32_t next_sequence_number() {
-    static uint32_t current_sequence_number = 0;
     return current_sequence_number++;
 }
 
@@ -52,6 +129,42 @@ int create_client_socket(int *fd) {
     return 0;
 }
 
+/* Create a socket that reaches the server through the agent listening on
+   path (see agent.c). The socket is connected to the agent, so queries on
+   it carry no address: the server's address has family AF_UNSPEC. */
+int create_agent_socket(int *fd, const char *path) {
+    struct sockaddr_un agent_addr = {0};
+    agent_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(agent_addr.sun_path)) {
+        printf("Agent socket path is too long.\n");
+        return -1;
+    }
+    strcpy(agent_addr.sun_path, path);
+
+    int client_fd;
+    if ((client_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+        printf("Client socket creation failed.\n");
+        return -1;
+    }
+
+    /* Binding only the family autobinds a unique abstract address, which
+       the agent answers to. */
+    struct sockaddr_un own_addr = {0};
+    own_addr.sun_family = AF_UNIX;
+    if (bind(client_fd, (struct sockaddr *) &own_addr,
+             sizeof(sa_family_t)) < 0
+        || connect(client_fd, (struct sockaddr *) &agent_addr,
+                   sizeof(agent_addr)) < 0) {
+        printf("Could not connect to the agent at %s. %s\n", path,
+               strerror(errno));
+        close(client_fd);
+        return -1;
+    }
+
+    *fd = client_fd;
+    return 0;
+}
+
 int set_socket_timeout(int fd, microts timeout_usec) {
     struct timeval timeout;
     usec_to_timeval(&timeout, timeout_usec);
@@ -64,6 +177,20 @@ int set_socket_timeout(int fd, microts timeout_usec) {
     return 0;
 }
 
+/* Set once sends are stamped by the kernel too (see send_server_query). */
+static int transmit_stamps;
+
+int set_socket_kernel_timestamps(int fd) {
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt)) < 0
+        || real_hardware_clock_enable_transmit_stamps(fd) != 0) {
+        printf("Client kernel timestamp assignment failed.\n");
+        return -1;
+    }
+    transmit_stamps = 1;
+    return 0;
+}
+
 int build_server_address(struct sockaddr_in *server_addr, char *ip, int port) {
     server_addr->sin_family = AF_INET;
     if (inet_pton(AF_INET, ip, &server_addr->sin_addr) != 1) {
@@ -74,58 +201,273 @@ int build_server_address(struct sockaddr_in *server_addr, char *ip, int port) {
     return 0;
 }
 
-/* Attempt to read the remote clock.
-   If successful, stores the timestamp read in result and returns 0.
-   If unsuccessful, returns -1. */
-int read_server_clock(microts *result, int socket, struct sockaddr_in *server_addr) {
-    /* Construct message: [seq number] [query string] */
-    char request_buffer[MESSAGE_SIZE] = {0};
-    char receive_buffer[MESSAGE_SIZE] = {0};
-
-    /* Assign and increment sequence number */
-    uint32_t sequence_number = next_sequence_number();
+/* Send one query with the given sequence number to the server.
+   Stores the real hardware clock time of the send in sent_at. With kernel
+   timestamps, that is the kernel's transmit stamp, so that both ends of
+   the RTT are taken at the device, as the reply's receive stamp is. */
+int send_server_query(int socket, struct sockaddr_in *server_addr,
+                      uint32_t sequence_number, microts *sent_at) {
+    /* Construct message: [seq number] [query string] [version] */
+    char request_buffer[MESSAGE_AUTH_QUERY_SIZE] = {0};
     *(uint32_t *) request_buffer = htonl(sequence_number);
 
-    /* Insert query string */
+    /* Insert query string and version */
     strncpy(request_buffer + SEQ_NUM_SIZE, QUERY_STRING, PAYLOAD_SIZE);
+    *(uint8_t *) (request_buffer + VERSION_OFFSET) = PROTOCOL_VERSION;
+    int request_len = MESSAGE_V2_QUERY_SIZE;
+    if (client_key != NULL)
+        request_len = mac_sign_query(client_key, request_buffer);
 
     /* Send the request_buffer to the server */
-    int sresult = sendto(socket, request_buffer, MESSAGE_SIZE, MSG_DONTWAIT,
-                         (struct sockaddr *) server_addr, sizeof(*server_addr));
+    if (real_hardware_clock_gettime(sent_at) != 0)
+        return -1;
+    /* A local agent's queue holds only net.unix.max_dgram_qlen datagrams,
+       so wait for room rather than fail when many clients share it. */
+    int connected = server_addr->sin_family == AF_UNSPEC;
+    int sresult = sendto(socket, request_buffer, request_len,
+                         connected ? 0 : MSG_DONTWAIT,
+                         connected ? NULL : (struct sockaddr *) server_addr,
+                         connected ? 0 : sizeof(*server_addr));
 
     if (sresult == -1) {
-        printf("FATAL: sendto failed in read_server_clock. %s\n", strerror(errno));
+        printf("FATAL: sendto failed in send_server_query. %s\n",
+               strerror(errno));
         exit(1);
     }
 
+    /* A stamp outside the send is a late one from an earlier query. */
+    microts after, transmitted;
+    if (transmit_stamps && real_hardware_clock_gettime(&after) == 0
+        && real_hardware_clock_transmit_time(socket, &transmitted) == 0
+        && transmitted >= *sent_at && transmitted <= after)
+        *sent_at = transmitted;
+    metric_add(&metrics.queries, 1);
+    return 0;
+}
+
+/* Receive one reply. flags are passed to recvmsg.
+   Returns 0 and stores the sequence number of the query being answered and
+   the server and arrival timestamps in sample (sent_at is left untouched).
+   Returns 1 if a datagram arrived that is not a reply (with a key, not an
+   authenticated one), and -1 if nothing arrived before the socket timed out
+   or would have blocked. */
+int receive_server_reply(int socket, int flags, uint32_t *sequence_number,
+                         server_sample *sample) {
+    char receive_buffer[MESSAGE_MAX_SIZE] = {0};
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { .iov_base = receive_buffer,
+                         .iov_len = MESSAGE_MAX_SIZE };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int recv_len = recvmsg(socket, &msg, flags);
+
+    /* recv_len == -1 indicates timeout occurred. A transmit stamp queued
+       after its send wakes epoll too; drop it so it does not again. */
+    if (recv_len < 0) {
+        microts late;
+        if (transmit_stamps)
+            real_hardware_clock_transmit_time(socket, &late);
+        return -1;
+    }
+
+    /* Stamp the arrival before checking the tag, which would otherwise
+       count towards the RTT. */
+    if (real_hardware_clock_from_msghdr(&msg, &sample->received_at) != 0
+        && real_hardware_clock_gettime(&sample->received_at) != 0)
+        return 1;
+
+    /* With a key, anything without a valid tag may be spoofed. */
+    if (client_key != NULL
+        ? mac_verify_reply(client_key, receive_buffer, recv_len) != 0
+        : recv_len != MESSAGE_SIZE && recv_len != MESSAGE_V2_REPLY_SIZE) {
+        metric_add(&metrics.invalid, 1);
+        return 1;
+    }
+
+    /* The server answers sequence number n with n + 1. */
+    *sequence_number = ntohl(*(uint32_t *) receive_buffer) - 1;
+    sample->server_transmit =
+        ntohll(*(uint64_t *) (receive_buffer + SEQ_NUM_SIZE));
+    sample->server_receive = sample->server_transmit;
+    if (recv_len >= MESSAGE_V2_REPLY_SIZE)
+        sample->server_receive =
+            ntohll(*(uint64_t *) (receive_buffer + RECEIVE_STAMP_OFFSET));
+    return 0;
+}
+
+/* Attempt to read the remote clock.
+   If successful, stores the four timestamps of the exchange in sample
+   and returns 0.
+   If the socket has kernel timestamps enabled, received_at is the time the
+   kernel queued the reply, so it excludes wake-up and scheduling delay.
+   If unsuccessful, returns -1. */
+int read_server_clock(server_sample *sample, int socket,
+                      struct sockaddr_in *server_addr) {
+    /* Assign and increment sequence number */
+    uint32_t sequence_number = next_sequence_number();
+    if (send_server_query(socket, server_addr, sequence_number,
+                          &sample->sent_at) != 0)
+        return -1;
+
     while (1) {
         /* Listen for incoming messages. Timeout assumes failure.
            If the incoming sequence number is from an old message, keep waiting. */
-        int recv_len = recvfrom(socket, receive_buffer, MESSAGE_SIZE, 0, 0, 0);
-
-        /* recv_len == -1 indicates timeout occurred. */
-        if (recv_len < 0)
+        uint32_t answered;
+        int r = receive_server_reply(socket, 0, &answered, sample);
+        if (r < 0)
             break;
 
-        /* Incorrect sequence numbers are equal to the sent sequence number
-           or less than the sent sequence number. The two conditions are necessary
-           for correct function with unsigned numbers. */
-        if (recv_len != MESSAGE_SIZE ||
-            ntohl(*(uint32_t *) receive_buffer) != sequence_number + 1)
+        /* Replies to older queries carry older sequence numbers. Compare for
+           equality rather than ordering so that wraparound is harmless. */
+        if (r > 0)
+            continue;
+        if (answered != sequence_number) {
+            metric_add(&metrics.stale, 1);
             continue;
+        }
 
         /* Length and sequence number correct. Everything looks good. */
-        *result = ntohll(*(uint64_t *) (receive_buffer + SEQ_NUM_SIZE));
+        microts rtt = sample_rtt(sample);
+        metric_add(&metrics.replies, 1);
+        hist_record_shared(&metrics.rtt, rtt > 0 ? rtt : 0);
         return 0;
     }
 
     /* Message was lost or timed out. */
     printf("WARN: A server response timed out.\n");
+    metric_add(&metrics.timeouts, 1);
     return -1;
 }
 
+/* Send burst queries to every server for one rapport. Returns the number
+   of queries sent. */
+int send_rapport_queries(int socket, time_server *servers, int count,
+                         int burst) {
+    int sent = 0;
+    for (int i = 0; i < count; ++i) {
+        time_server *s = &servers[i];
+        s->answered = 0;
+        s->pending = 0;
+        for (int q = 0; q < burst; ++q) {
+            pending_query *p = &s->queries[q];
+            p->sequence_number = next_sequence_number();
+            p->in_use = send_server_query(socket, &s->addr, p->sequence_number,
+                                          &p->sent_at) == 0;
+            s->pending += p->in_use;
+        }
+        sent += s->pending;
+    }
+    return sent;
+}
+
+/* Match a reply to the server whose rapport query it answers, and estimate
+   the server clock from it. Returns the server, or NULL for a stale reply. */
+time_server *accept_rapport_reply(time_server *servers, int count,
+                                  uint32_t answered, server_sample *sample,
+                                  scspec *soft_clock) {
+    for (int i = 0; i < count; ++i) {
+        time_server *s = &servers[i];
+        for (int q = 0; q < MAX_RAPPORT_BURST; ++q) {
+            pending_query *p = &s->queries[q];
+            if (!p->in_use || p->sequence_number != answered)
+                continue;
+
+            p->in_use = 0;
+            --s->pending;
+            ++s->answered;
+            ++s->replies;
+            s->sample = *sample;
+            s->sample.sent_at = p->sent_at;
+            estimate_rapport(soft_clock, &s->sample,
+                             &s->estimate.est_server_time,
+                             &s->estimate.response_local_time,
+                             &s->estimate.response_local_hardware_time);
+            s->estimate.rtt = sample_rtt(&s->sample);
+            metric_add(&metrics.replies, 1);
+            hist_record_shared(&metrics.rtt, s->estimate.rtt > 0
+                               ? s->estimate.rtt : 0);
+            if (s->filtering)
+                rapport_filter_add(&s->filter, &s->estimate);
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Whether any server has answered any query of the current rapport. */
+int rapport_has_answers(time_server *servers, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (servers[i].answered)
+            return 1;
+    }
+    return 0;
+}
+
+/* Combine the answers to the current rapport (see combine_rapports) and
+   end it. A filtering server contributes the best sample of its window
+   instead of its newest one. If the answers have no majority, the server
+   rejected least often so far is trusted alone. drift_error bounds the
+   error of the frequency correction (see rapport_filter_select). Stores
+   the newest sample of the lowest-RTT survivor in best. Returns the number
+   of survivors, 0 if no server answered. */
+int finish_rapport(time_server *servers, int count, scspec *soft_clock,
+                   double drift_error, rapport_estimate *combined,
+                   server_sample *best) {
+    rapport_estimate estimates[MAX_SERVERS];
+    time_server *answered[MAX_SERVERS];
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        time_server *s = &servers[i];
+        s->pending = 0;
+        for (int q = 0; q < MAX_RAPPORT_BURST; ++q)
+            s->queries[q].in_use = 0;
+        if (!s->answered)
+            continue;
+
+        answered[n] = s;
+        estimates[n] = s->estimate;
+        if (s->filtering)
+            rapport_filter_select(&s->filter, soft_clock,
+                                  s->estimate.response_local_hardware_time,
+                                  drift_error, &estimates[n]);
+        ++n;
+    }
+    if (n == 0)
+        return 0;
+
+    int survivors = combine_rapports(soft_clock, estimates, n, combined);
+    if (survivors == 0) {
+        int trusted = 0;
+        for (int i = 1; i < n; ++i) {
+            double a = (double) answered[i]->rejected / answered[i]->replies;
+            double b = (double) answered[trusted]->rejected
+                / answered[trusted]->replies;
+            if (a < b || (a == b && estimates[i].rtt < estimates[trusted].rtt))
+                trusted = i;
+        }
+        estimates[trusted].survivor = 1;
+        *combined = estimates[trusted];
+        survivors = 1;
+    }
+    microts best_rtt = LLONG_MAX;
+    for (int i = 0; i < n; ++i) {
+        if (!estimates[i].survivor) {
+            ++answered[i]->rejected;
+        } else if (estimates[i].rtt < best_rtt) {
+            best_rtt = estimates[i].rtt;
+            *best = answered[i]->sample;
+        }
+    }
+    return survivors;
+}
+
 int sync_server_clock(vhspec *local, int socket,
-                      struct sockaddr_in *server_addr) {
+                      struct sockaddr_in *server_addr,
+                      int window, microts timeout) {
 
     /* Synchronize the server_clock with the actual server_clock
        as best as possible by assigning an offset. */
@@ -135,44 +477,113 @@ int sync_server_clock(vhspec *local, int socket,
     microts worst_rtt = 0;
 
     microts best_rtt = LLONG_MAX;
-    microts best_request_local_time;
-    microts best_received_server_value;
-
-    for (int i = 0; i < SERVER_SYNC_ATTEMPTS; ++i) {
-        /* Save the current time to request_time[i] */
-        microts request_local_time;
-        virtual_hardware_clock_gettime(local, &request_local_time);
-
-        /* Read the remote clock */
-        microts server_value;
-        if (read_server_clock(&server_value, socket, server_addr) < 0) {
-            /* Assume message was lost. Retry. */
-            --i;
-            continue;
+    microts best_response_local_time = 0;
+    microts best_server_transmit = 0;
+
+    /* Up to `window` queries are in flight at once. Each remembers its own
+       send time, and replies are matched to queries by sequence number, so
+       the burst takes roughly SERVER_SYNC_ATTEMPTS / window round trips.
+       Queries that queue behind each other see inflated RTTs, which the
+       minimum-RTT selection below discards. */
+    pending_query pending[MAX_SYNC_WINDOW] = {0};
+    int in_flight = 0;
+
+    for (int i = 0; i < SERVER_SYNC_ATTEMPTS;) {
+        /* Top up the window */
+        for (int p = 0; p < window
+                 && i + in_flight < SERVER_SYNC_ATTEMPTS; ++p) {
+            if (pending[p].in_use)
+                continue;
+            pending[p].sequence_number = next_sequence_number();
+            if (send_server_query(socket, server_addr,
+                                  pending[p].sequence_number,
+                                  &pending[p].sent_at) != 0)
+                break;
+            pending[p].in_use = 1;
+            ++in_flight;
+        }
+
+        /* Wait until a reply arrives or the oldest query times out. */
+        microts now, oldest = LLONG_MAX;
+        real_hardware_clock_gettime(&now);
+        for (int p = 0; p < window; ++p) {
+            if (pending[p].in_use && pending[p].sent_at < oldest)
+                oldest = pending[p].sent_at;
         }
+        microts wait = oldest + timeout - now;
+        struct pollfd pfd = { .fd = socket, .events = POLLIN };
+        if (wait > 0)
+            poll(&pfd, 1, (wait + 999) / 1000);
+
+        /* Drain every reply that is already queued. */
+        uint32_t answered;
+        server_sample sample;
+        int r;
+        while ((r = receive_server_reply(socket, MSG_DONTWAIT,
+                                         &answered, &sample)) >= 0) {
+            if (r > 0)
+                continue;
 
-        /* Read success. Compute the RTT */
-        microts response_local_time;
-        virtual_hardware_clock_gettime(local, &response_local_time);
-        microts rtt = response_local_time - request_local_time;
+            int p;
+            for (p = 0; p < window; ++p) {
+                if (pending[p].in_use
+                    && pending[p].sequence_number == answered)
+                    break;
+            }
 
-        sum_rtt += rtt;
+            /* A reply to a query that already timed out, or a duplicate. */
+            if (p == window) {
+                metric_add(&metrics.stale, 1);
+                continue;
+            }
 
-        /* If best rtt, save request information */
-        if (rtt < best_rtt) {
-            best_rtt = rtt;
-            best_request_local_time = request_local_time;
-            best_received_server_value = server_value;
-        }
+            pending[p].in_use = 0;
+            --in_flight;
+            sample.sent_at = pending[p].sent_at;
+
+            /* Read success. Compute the network RTT, which excludes the time
+               the query spent inside the server. */
+            microts request_local_time, response_local_time;
+            virtual_hardware_clock_at(local, sample.sent_at,
+                                      &request_local_time);
+            virtual_hardware_clock_at(local, sample.received_at,
+                                      &response_local_time);
+            microts rtt = response_local_time - request_local_time
+                - server_residence(&sample);
+
+            sum_rtt += rtt;
+            metric_add(&metrics.replies, 1);
+            hist_record_shared(&metrics.rtt, rtt > 0 ? rtt : 0);
+
+            /* If best rtt, save request information */
+            if (rtt < best_rtt) {
+                best_rtt = rtt;
+                best_response_local_time = response_local_time;
+                best_server_transmit = sample.server_transmit;
+            }
 
-        /* Keep the worst rtt too, for fun */
-        if (rtt > worst_rtt)
-            worst_rtt = rtt;
+            /* Keep the worst rtt too, for fun */
+            if (rtt > worst_rtt)
+                worst_rtt = rtt;
 
-        if (i % 10 == 0 && i != 0)
-            printf("\n");
+            if (i % 10 == 0 && i != 0)
+                printf("\n");
 
-        printf("[%d/%d] ", i + 1, SERVER_SYNC_ATTEMPTS + 1);
+            printf("[%d/%d] ", i + 1, SERVER_SYNC_ATTEMPTS + 1);
+            ++i;
+        }
+
+        /* Assume unanswered queries past the timeout were lost. Their slots
+           are reused on the next pass, which retries them. */
+        real_hardware_clock_gettime(&now);
+        for (int p = 0; p < window; ++p) {
+            if (pending[p].in_use && now - pending[p].sent_at >= timeout) {
+                printf("WARN: A server response timed out.\n");
+                metric_add(&metrics.timeouts, 1);
+                pending[p].in_use = 0;
+                --in_flight;
+            }
+        }
     }
 
     printf("\n");
@@ -181,14 +592,20 @@ int sync_server_clock(vhspec *local, int socket,
 
     printf("Average RTT: %lf\n", (double) sum_rtt / SERVER_SYNC_ATTEMPTS);
 
-    /* Assuming RTT is evenly divided between server and client,
-       current server time is the received timestamp plus
-       (time elapsed since request) minus RTT/2. */
+    /* Without a single reply there is no offset to assign. */
+    if (best_rtt == LLONG_MAX) {
+        printf("WARN: No server sync sample was received.\n");
+        return -1;
+    }
+
+    /* Assuming the network RTT is evenly divided between the two directions,
+       the server clock read server_transmit RTT/2 before the reply arrived.
+       Current server time is that plus the time elapsed since arrival. */
     microts current_time;
     virtual_hardware_clock_gettime(local, &current_time);
 
-    microts est_server_time = best_received_server_value +
-        (current_time - best_request_local_time) - (best_rtt / 2);
+    microts est_server_time = best_server_transmit + (best_rtt / 2) +
+        (current_time - best_response_local_time);
 
     local->offset = est_server_time - current_time;
     local->error = best_rtt / 2;
@@ -198,9 +615,188 @@ int sync_server_clock(vhspec *local, int socket,
     return 0;
 }
 
+/* Set fd to first expire after initial and then every interval (both in
+   usec). Zero values leave that part disarmed. */
+int arm_timer(int fd, microts initial, microts interval) {
+    struct itimerspec spec;
+    usec_to_timespec(&spec.it_value, initial);
+    usec_to_timespec(&spec.it_interval, interval);
+    return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+/* Create a timerfd armed as by arm_timer.
+   Returns the file descriptor, or -1 on failure. */
+int create_timer(microts initial, microts interval) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (fd < 0 || arm_timer(fd, initial, interval) != 0)
+        return -1;
+    return fd;
+}
+
+/* Acknowledge a timer expiration so epoll stops reporting it. */
+void drain_timer(int fd) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        printf("WARN: Reading a client timer failed. %s\n", strerror(errno));
+}
+
+/* Where output rows go, and the running summary of their Error column.
+   Like processor.py, the summary skips rows before the second rapport,
+   which are still settling from the startup sync. */
+typedef struct sample_output {
+    /* Binary sample log, or NULL to print CSV rows. */
+    FILE *log;
+    int rapports;
+    stream_stats error_stats;
+} sample_output;
+
+/* Read every clock and write one output row. The remote estimate column
+   is only filled for rows printed at a rapport. */
+void print_sample_row(vhspec *server_clock, scspec *soft_clock,
+                      microts simulation_start_time, microts *est_server_time,
+                      sample_output *output) {
+    sample_record record = {0};
+    microts e;
+
+    e = real_hardware_clock_gettime(&record.real_time)
+        | virtual_hardware_clock_gettime(server_clock,
+                                         &record.local_server_time)
+        | virtual_hardware_clock_gettime(soft_clock->vhclock,
+                                         &record.hardware_clock_time)
+        | software_clock_gettime(soft_clock, &record.software_clock_time);
+
+    if (e != 0) {
+        printf("FATAL: A clock read error occurred during runtime.\n");
+        exit(1);
+    }
+
+    record.error = record.software_clock_time - record.local_server_time;
+    if (est_server_time != NULL) {
+        record.flags = SAMPLE_RAPPORT;
+        record.remote_est_time = *est_server_time;
+        ++output->rapports;
+    }
+    if (output->rapports >= 2)
+        stream_stats_add(&output->error_stats, record.error);
+
+    if (output->log != NULL) {
+        if (sample_log_write(output->log, &record) != 0) {
+            printf("FATAL: Writing the sample log failed.\n");
+            exit(1);
+        }
+        return;
+    }
+
+    double real_time_elapsed =
+        (double) (record.real_time - simulation_start_time) / (double) MILLION;
+
+    if (est_server_time == NULL)
+        printf("%ld,%.5f,%ld,%ld,%ld,%ld,,\n",
+               record.real_time, real_time_elapsed,
+               record.local_server_time, record.hardware_clock_time,
+               record.software_clock_time, record.error);
+    else
+        printf("%ld,%.5f,%ld,%ld,%ld,%ld,%ld,\n",
+               record.real_time, real_time_elapsed,
+               record.local_server_time, record.hardware_clock_time,
+               record.software_clock_time, record.error,
+               record.remote_est_time);
+}
+
+/* Print the summary row processor.py would compute from the CSV, with a
+   streaming median, plus the 99th percentile of the absolute error and the
+   number of rapport queries sent. With several servers or the rapport
+   filter, a line per server follows. */
+void print_summary(sample_output *output, double max_drift,
+                   microts rapport_period, microts amortization_period,
+                   unsigned long rapport_queries, time_server *servers,
+                   int server_count) {
+    stream_stats *stats = &output->error_stats;
+    printf("====== SIMULATION SUMMARY      =====\n");
+    printf("Max Drift,Rapport Period,Amortization Period,Avg. Error,Median Error,\
+Max Absolute Error,Error Standard Deviation,P99 Absolute Error,Samples,\
+Rapport Queries\n");
+    printf("%g,%ld,%ld,%g,%g,%ld,%g,%g,%lu,%lu\n", max_drift, rapport_period,
+           amortization_period, stats->mean,
+           quantile_sketch_value(&stats->median), stats->max_abs,
+           stream_stats_stdev(stats), quantile_sketch_value(&stats->p99_abs),
+           stats->count, rapport_queries);
+
+    for (int i = 0; i < server_count; ++i) {
+        time_server *s = &servers[i];
+        char ip[INET_ADDRSTRLEN];
+        if (server_count == 1 && !s->filtering)
+            break;
+        inet_ntop(AF_INET, &s->addr.sin_addr, ip, sizeof(ip));
+        printf("Server %s:%d, Replies: %lu, Rejected: %lu, Too Slow: %lu\n",
+               ip, ntohs(s->addr.sin_port), s->replies, s->rejected,
+               s->filter.rejected);
+    }
+}
+
+/* Record the correction that the rapport just applied to soft_clock. */
+void record_rapport(const scspec *soft_clock) {
+    microts correction = soft_clock->rapport_master - soft_clock->rapport_local;
+    double slope = (double) correction * MILLION
+        / soft_clock->amortization_period;
+
+    metric_add(&metrics.rapports, 1);
+    metric_set(&metrics.offset_correction, correction);
+    metric_set(&metrics.amortization_slope, slope);
+    metric_set(&metrics.frequency, soft_clock->frequency);
+    hist_record_shared(&metrics.correction, llabs(correction));
+    hist_record_shared(&metrics.slope, llrint(fabs(slope) * 1000));
+}
+
+/* Runs on the metrics thread. */
+void write_metrics(FILE *out, void *arg) {
+    histogram *snapshot = malloc(sizeof(histogram));
+    if (snapshot == NULL)
+        return;
+
+    metrics_counter(out, "csync_client_queries_total",
+                    "Queries sent.", metric_read(&metrics.queries));
+    metrics_counter(out, "csync_client_replies_total",
+                    "Replies matched to a query in flight.",
+                    metric_read(&metrics.replies));
+    metrics_counter(out, "csync_client_timeouts_total",
+                    "Queries given up on.", metric_read(&metrics.timeouts));
+    metrics_counter(out, "csync_client_stale_replies_total",
+                    "Replies to no query in flight.",
+                    metric_read(&metrics.stale));
+    metrics_counter(out, "csync_client_invalid_replies_total",
+                    "Datagrams that were not valid replies.",
+                    metric_read(&metrics.invalid));
+    metrics_counter(out, "csync_client_rapports_total",
+                    "Rapports applied to the software clock.",
+                    metric_read(&metrics.rapports));
+    metrics_gauge(out, "csync_client_offset_correction_usec",
+                  "Master minus software clock at the last rapport.",
+                  metric_read_gauge(&metrics.offset_correction));
+    metrics_gauge(out, "csync_client_amortization_slope_ppm",
+                  "Rate at which the last rapport's correction is amortized.",
+                  metric_read_gauge(&metrics.amortization_slope));
+    metrics_gauge(out, "csync_client_frequency_ppm",
+                  "Frequency correction of the software clock.",
+                  metric_read_gauge(&metrics.frequency));
+
+    hist_snapshot(snapshot, &metrics.rtt);
+    metrics_histogram(out, "csync_client_rtt_usec",
+                      "Round trip time less server residence.", snapshot);
+    hist_snapshot(snapshot, &metrics.correction);
+    metrics_histogram(out, "csync_client_offset_correction_abs_usec",
+                      "Magnitude of each rapport's offset correction.",
+                      snapshot);
+    hist_snapshot(snapshot, &metrics.slope);
+    metrics_histogram(out, "csync_client_amortization_slope_abs_ppb",
+                      "Magnitude of each rapport's amortization slope.",
+                      snapshot);
+    free(snapshot);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 10) {
+    if (argc < 11) {
         printf("Usage: client [server IP] [server port]\n");
         printf("              [server simulated drift (PPM)] [client VH drift (PPM)]\n");
         printf("              [client-server RHW relative drift (PPM)]\n");
@@ -209,6 +805,27 @@ int main(int argc, char *argv[])
         printf("              [timeout (usec)]\n");
         printf("              [amortization period (usec)]\n");
         printf("              [print frequency (usec)]\n");
+        printf("              [--kernel-timestamps (SO_TIMESTAMPNS receive times)]\n");
+        printf("              [--sync-window N (sync queries in flight, max %d)]\n",
+               MAX_SYNC_WINDOW);
+        printf("              [--publish NAME (shared memory clock page)]\n");
+        printf("              [--clock-source monotonic|tsc]\n");
+        printf("              [--sample-log FILE (binary rows instead of CSV)]\n");
+        printf("              [--summary (print the summary row at the end)]\n");
+        printf("              [--server IP:PORT (another server, max %d in all)]\n",
+               MAX_SERVERS);
+        printf("              [--rapport-window N (samples the rapport filter keeps, max %d)]\n",
+               MAX_RAPPORT_WINDOW);
+        printf("              [--rapport-burst N (queries per server per rapport, max %d)]\n",
+               MAX_RAPPORT_BURST);
+        printf("              [--frequency-window N (rapports in the frequency fit, max %d)]\n",
+               MAX_FREQUENCY_WINDOW);
+        printf("              [--adaptive-rapport TARGET (usec of predicted error)]\n");
+        printf("              [--min-rapport USEC (default %ld)]\n", RAPPORT_MIN_PERIOD);
+        printf("              [--max-rapport USEC (default %ld)]\n", RAPPORT_MAX_PERIOD);
+        printf("              [--agent PATH (query through a local agent)]\n");
+        printf("              [--key-file FILE (authenticate with this 32 hex digit key)]\n");
+        printf("              [--metrics PATH (Prometheus text on a Unix socket)]\n");
         exit(1);
     }
     char *const SERVER_IP = argv[1];
@@ -225,6 +842,164 @@ int main(int argc, char *argv[])
     const microts AMORTIZATION_PERIOD = atol(argv[9]);
     const microts PRINT_PERIOD = atol(argv[10]);
 
+    int kernel_timestamps = 0;
+    int sync_window = SYNC_WINDOW;
+    const char *publish_name = NULL;
+    const char *agent_path = NULL;
+    const char *metrics_path = NULL;
+    static mac_key key;
+    int clock_source = CLOCK_SOURCE_MONOTONIC_RAW;
+    const char *sample_log_path = NULL;
+    int summary = 0;
+    int frequency_window = 0;
+    int rapport_window = 1;
+    int rapport_burst = 1;
+    microts adaptive_target = 0;
+    time_server servers[MAX_SERVERS] = {{{0}}};
+    int server_count = 1;
+    if (build_server_address(&servers[0].addr, SERVER_IP, SERVER_PORT)) {
+        printf("FATAL: Could not construct server address.\n");
+        exit(1);
+    }
+    microts min_rapport_period = RAPPORT_MIN_PERIOD;
+    microts max_rapport_period = RAPPORT_MAX_PERIOD;
+    for (int i = 11; i < argc; ++i) {
+        if (strcmp(argv[i], "--kernel-timestamps") == 0) {
+            kernel_timestamps = 1;
+        } else if (strcmp(argv[i], "--sync-window") == 0 && i + 1 < argc) {
+            sync_window = atoi(argv[++i]);
+            if (sync_window < 1 || sync_window > MAX_SYNC_WINDOW) {
+                printf("FATAL: Sync window must be between 1 and %d.\n",
+                       MAX_SYNC_WINDOW);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--clock-source") == 0 && i + 1 < argc) {
+            if (real_hardware_clock_parse_source(argv[++i],
+                                                 &clock_source) != 0) {
+                printf("FATAL: Unknown clock source %s.\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--publish") == 0 && i + 1 < argc) {
+            publish_name = argv[++i];
+        } else if (strcmp(argv[i], "--sample-log") == 0 && i + 1 < argc) {
+            sample_log_path = argv[++i];
+            summary = 1;
+        } else if (strcmp(argv[i], "--summary") == 0) {
+            summary = 1;
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            char *address = argv[++i];
+            char *colon = strrchr(address, ':');
+            if (server_count == MAX_SERVERS || colon == NULL) {
+                printf("FATAL: Expected at most %d servers as IP:PORT.\n",
+                       MAX_SERVERS);
+                exit(1);
+            }
+            *colon = '\0';
+            if (build_server_address(&servers[server_count++].addr, address,
+                                     atoi(colon + 1))) {
+                printf("FATAL: Could not construct server address.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--rapport-window") == 0 && i + 1 < argc) {
+            rapport_window = atoi(argv[++i]);
+            if (rapport_window < 1 || rapport_window > MAX_RAPPORT_WINDOW) {
+                printf("FATAL: Rapport window must be between 1 and %d.\n",
+                       MAX_RAPPORT_WINDOW);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--rapport-burst") == 0 && i + 1 < argc) {
+            rapport_burst = atoi(argv[++i]);
+            if (rapport_burst < 1 || rapport_burst > MAX_RAPPORT_BURST) {
+                printf("FATAL: Rapport burst must be between 1 and %d.\n",
+                       MAX_RAPPORT_BURST);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--frequency-window") == 0 && i + 1 < argc) {
+            frequency_window = atoi(argv[++i]);
+            if (frequency_window < MIN_FREQUENCY_RAPPORTS
+                || frequency_window > MAX_FREQUENCY_WINDOW) {
+                printf("FATAL: Frequency window must be between %d and %d.\n",
+                       MIN_FREQUENCY_RAPPORTS, MAX_FREQUENCY_WINDOW);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--adaptive-rapport") == 0 && i + 1 < argc) {
+            adaptive_target = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--min-rapport") == 0 && i + 1 < argc) {
+            min_rapport_period = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-rapport") == 0 && i + 1 < argc) {
+            max_rapport_period = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--agent") == 0 && i + 1 < argc) {
+            agent_path = argv[++i];
+        } else if (strcmp(argv[i], "--key-file") == 0 && i + 1 < argc) {
+            if (mac_load_key(argv[++i], &key) != 0) {
+                printf("FATAL: Could not read a key from %s.\n", argv[i]);
+                exit(1);
+            }
+            client_key = &key;
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else {
+            printf("FATAL: Unrecognized option %s.\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    /* The agent queries its own server, so the server address only names
+       it in the output. */
+    if (agent_path != NULL) {
+        if (server_count > 1) {
+            printf("FATAL: --agent and --server cannot be combined.\n");
+            exit(1);
+        }
+        servers[0].addr.sin_family = AF_UNSPEC;
+    }
+
+    hist_init(&metrics.rtt);
+    hist_init(&metrics.correction);
+    hist_init(&metrics.slope);
+    if (metrics_path != NULL
+        && metrics_serve(metrics_path, write_metrics, NULL) != 0) {
+        printf("FATAL: Could not serve metrics on %s. %s\n", metrics_path,
+               strerror(errno));
+        exit(1);
+    }
+
+    if (mac_random_sequence(&current_sequence_number) != 0) {
+        printf("FATAL: Could not seed the sequence number. %s\n",
+               strerror(errno));
+        exit(1);
+    }
+
+    /* The filter window holds at least one whole burst, and carries its
+       samples forward at the fitted drift. */
+    if ((rapport_window > 1 || rapport_burst > 1) && frequency_window == 0)
+        frequency_window = FILTER_FREQUENCY_WINDOW;
+    for (int i = 0; i < server_count; ++i) {
+        servers[i].filtering = rapport_window > 1 || rapport_burst > 1;
+        rapport_filter_init(&servers[i].filter, rapport_window > rapport_burst
+                            ? rapport_window : rapport_burst);
+    }
+
+    frequency_estimator frequency_fit;
+    frequency_estimator_init(&frequency_fit, frequency_window);
+
+    rapport_scheduler scheduler = {0};
+    scheduler.period = RAPPORT_PERIOD;
+    if (adaptive_target > 0) {
+        if (min_rapport_period <= 0 || max_rapport_period < min_rapport_period) {
+            printf("FATAL: Need 0 < min rapport period <= max rapport period.\n");
+            exit(1);
+        }
+        rapport_scheduler_init(&scheduler, adaptive_target, min_rapport_period,
+                               max_rapport_period, RAPPORT_PERIOD,
+                               AMORTIZATION_PERIOD);
+    }
+
+    if (clock_source != CLOCK_SOURCE_MONOTONIC_RAW
+        && real_hardware_clock_select(clock_source,
+                                      TSC_CALIBRATION_PERIOD) != 0)
+        printf("WARN: TSC unusable, falling back to CLOCK_MONOTONIC_RAW.\n");
+
     vhspec local_hardware_clock = {0};
     local_hardware_clock.drift_rate = LOCAL_VHC_DRIFT;
     if (virtual_hardware_clock_init(&local_hardware_clock) != 0) {
@@ -237,6 +1012,17 @@ int main(int argc, char *argv[])
     soft_clock.amortization_period = AMORTIZATION_PERIOD;
     soft_clock.vhclock = &local_hardware_clock;
 
+    /* Local processes can read the software clock from shared memory. */
+    shmclock_page *published = NULL;
+    if (publish_name != NULL) {
+        if (shmclock_create(publish_name, &published) != 0) {
+            printf("FATAL: Could not create shared memory clock %s.\n",
+                   publish_name);
+            exit(1);
+        }
+        shmclock_publish(published, &soft_clock);
+    }
+
     /* The client's version of the server clock.
        Used for getting offline error measurements.
        The software clock is unaware of this clock (or else the simulation would
@@ -250,36 +1036,35 @@ int main(int argc, char *argv[])
 
     /* Create the client socket for sending/receiving data to the server. */
     int client_fd;
-    if (create_client_socket(&client_fd) < 0
-        || set_socket_timeout(client_fd, NETWORK_TIMEOUT)) {
+    if ((agent_path != NULL ? create_agent_socket(&client_fd, agent_path)
+         : create_client_socket(&client_fd)) < 0
+        || set_socket_timeout(client_fd, NETWORK_TIMEOUT)
+        || (kernel_timestamps && set_socket_kernel_timestamps(client_fd))) {
         printf("FATAL: Could not create client socket.\n");
         exit(1);
     }
 
-    /* Build the server address struct with IP, port */
-    struct sockaddr_in server_addr = {0};
-    uint32_t server_addr_len = sizeof(server_addr);
-    if (build_server_address(&server_addr, SERVER_IP, SERVER_PORT)) {
-        printf("FATAL: Could not construct server address.\n");
-        exit(1);
-    }
-
-    /* Synchronize the local estimated server clock with the server clock */
+    /* Synchronize the local estimated server clock with the first server's
+       clock. Only rapports query the other servers. */
     microts server_clock_value;
     virtual_hardware_clock_gettime(&server_clock, &server_clock_value);
     printf("Server clock before sync: %ld\n", server_clock_value);
-    sync_server_clock(&server_clock, client_fd, &server_addr);
+    microts sync_start, sync_end;
+    real_hardware_clock_gettime(&sync_start);
+    if (sync_server_clock(&server_clock, client_fd, &servers[0].addr,
+                          sync_window, NETWORK_TIMEOUT) != 0) {
+        printf("FATAL: Could not synchronize the server clock.\n");
+        exit(1);
+    }
+    real_hardware_clock_gettime(&sync_end);
+    printf("Sync took %ld usec with %d queries in flight.\n",
+           sync_end - sync_start, sync_window);
     virtual_hardware_clock_gettime(&server_clock, &server_clock_value);
     printf("Server clock after sync: %ld\n", server_clock_value);
 
     /* Use the real time clock to create data points at time intervals.
        Both print and rapport happen immediately. */
-    microts last_rapport = 0;
-    microts last_print = 0;
     microts current_real_time, simulation_start_time, simulation_end_time;
-    microts local_server_time, local_hardware_clock_time,
-        soft_clock_time, remote_est_time, error, e;
-    double real_time_elapsed;
 
     real_hardware_clock_gettime(&current_real_time);
     simulation_start_time = current_real_time;
@@ -287,102 +1072,235 @@ int main(int argc, char *argv[])
 
     printf("\n====== SIMULATION METADATA     =====\n");
     printf("Server IP: %s, Port: %d\n", SERVER_IP, SERVER_PORT);
+    for (int i = 1; i < server_count; ++i) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &servers[i].addr.sin_addr, ip, sizeof(ip));
+        printf("Server IP: %s, Port: %d\n", ip, ntohs(servers[i].addr.sin_port));
+    }
     printf("Server Drift: %.2f PPM, Client VHC Drift: %.2f PPM\n",
            SERVER_DRIFT - RELATIVE_DRIFT, LOCAL_VHC_DRIFT - RELATIVE_DRIFT);
     printf("Relative Drift Weight: %.2f\n", RELATIVE_DRIFT);
     printf("Local Server Time Error: %ld\n", server_clock.error);
     printf("Rapport Period: %ld\n", RAPPORT_PERIOD);
+    if (rapport_window > 1 || rapport_burst > 1)
+        printf("Rapport Filter: window %d, burst %d\n", rapport_window,
+               rapport_burst);
+    if (frequency_window > 0)
+        printf("Frequency Window: %d rapports\n", frequency_window);
+    if (adaptive_target > 0)
+        printf("Adaptive Rapport: target %ld, min %ld, max %ld\n",
+               adaptive_target, scheduler.min_period, scheduler.max_period);
     printf("Amortization Period: %ld\n", AMORTIZATION_PERIOD);
+    printf("Kernel Timestamps: %s\n", kernel_timestamps ? "on" : "off");
+    printf("Real Hardware Clock: %.0f Hz\n", real_hardware_clock_frequency());
     printf("Simulation runtime: %ld seconds\n", SIMULATION_RUNTIME / MILLION);
     printf("Simulation runtime: %ld usec, \n Start: %ld, End: %ld\n",
            SIMULATION_RUNTIME, current_real_time, simulation_end_time);
+    sample_output output = {0};
+    stream_stats_init(&output.error_stats);
+    if (sample_log_path != NULL) {
+        sample_log_header header = {0};
+        header.start_time = simulation_start_time;
+        header.rapport_period = RAPPORT_PERIOD;
+        header.amortization_period = AMORTIZATION_PERIOD;
+        header.print_period = PRINT_PERIOD;
+        header.server_drift = SERVER_DRIFT - RELATIVE_DRIFT;
+        header.local_vhc_drift = LOCAL_VHC_DRIFT - RELATIVE_DRIFT;
+        header.relative_drift = RELATIVE_DRIFT;
+        if ((output.log = sample_log_create(sample_log_path, &header)) == NULL) {
+            printf("FATAL: Could not create sample log %s.\n", sample_log_path);
+            exit(1);
+        }
+        printf("Sample Log: %s\n", sample_log_path);
+    }
     printf("====== SIMULATION OUTPUT START =====\n");
     printf("Current Real Time,Real Time Elapsed (sec),Local Server Time,Hardware Clock Time,\
 Software Clock Time,Error,Remote Est Time,\n");
 
-    struct timespec sleeptime;
-    usec_to_timespec(&sleeptime, PRINT_PERIOD / 2);
+    /* The loop sleeps in epoll_wait until a deadline expires or a reply
+       arrives. Print and rapport deadlines are periodic timerfds; a pending
+       rapport query has its own one-shot timeout timer. The socket is only
+       read with MSG_DONTWAIT here, so output never stalls behind a query. */
+    int epoll_fd = epoll_create1(0);
+    int print_timer = create_timer(1, PRINT_PERIOD);
+    int rapport_timer = create_timer(1, scheduler.period);
+    int timeout_timer = create_timer(0, 0);
+    /* A zero initial value would leave the end timer disarmed, so a
+       runtime of 0 still ends the run after one pass of the loop. */
+    int end_timer = create_timer(SIMULATION_RUNTIME > 0
+                                 ? SIMULATION_RUNTIME : 1, 0);
+    int watched[] = { print_timer, rapport_timer, timeout_timer, end_timer,
+                      client_fd };
+
+    if (epoll_fd < 0 || print_timer < 0 || rapport_timer < 0
+        || timeout_timer < 0 || end_timer < 0) {
+        printf("FATAL: Could not create the client event loop.\n");
+        exit(1);
+    }
 
-    /* Simulation begins, exits when time limit reached */
-    while (current_real_time < simulation_end_time) {
-        e = real_hardware_clock_gettime(&current_real_time)
-            | virtual_hardware_clock_gettime(&server_clock, &local_server_time)
-            | virtual_hardware_clock_gettime(soft_clock.vhclock,
-                                             &local_hardware_clock_time)
-            | software_clock_gettime(&soft_clock, &soft_clock_time);
-
-        if (e != 0) {
-            printf("FATAL: A clock read error occurred during runtime.\n");
+    for (int i = 0; i < sizeof(watched) / sizeof(watched[0]); ++i) {
+        struct epoll_event event = { .events = EPOLLIN,
+                                     .data.fd = watched[i] };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watched[i], &event) != 0) {
+            printf("FATAL: Could not watch client event source.\n");
             exit(1);
         }
+    }
 
-        real_time_elapsed = (double) (current_real_time - simulation_start_time)
-            / (double) MILLION;
-        error = soft_clock_time - local_server_time;
-
-        if (current_real_time - last_print > PRINT_PERIOD) {
-            printf("%ld,%.5f,%ld,%ld,%ld,%ld,,\n",
-                   current_real_time, real_time_elapsed,
-                   local_server_time, local_hardware_clock_time,
-                   soft_clock_time, error);
+    /* The rapport in progress, if any: its queries go to every server at
+       once, and it ends when all have answered. Once a majority has, the
+       stragglers get only as long again as the slowest answer so far. */
+    int rapport_pending = 0;
+    int rapport_ready = 0;
+    int rapport_answers = 0;
+    microts rapport_slowest = 0;
+    unsigned long rapport_queries = 0;
 
-            last_print = current_real_time;
+    /* Simulation begins, exits when time limit reached */
+    int running = 1;
+    while (running) {
+        struct epoll_event events[8];
+        int ready = epoll_wait(epoll_fd, events, 8, -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("FATAL: epoll_wait failed. %s\n", strerror(errno));
+            exit(1);
         }
 
-        if (current_real_time - last_rapport > RAPPORT_PERIOD) {
-            //printf("Attempting rapport...\t");
-
-            /* for now, pretend min = server_clock.error */
-            /* microts min = server_clock.error;*/
-
-            /* If this code is reached, adjustment should have ended already
-               and the software clock will reflect the hardware clock with no
-               adjustments. Thus software_clock_gettime could be replaced with
-               virtual_hardware_clock_gettime with insignificant differences. */
-            microts request_local_time, response_local_time, response_value,
-                response_local_hardware_time;
-            software_clock_gettime(&soft_clock, &request_local_time);
-
-            if (read_server_clock(&response_value, client_fd, &server_addr) != 0) {
-                continue;
+        for (int n = 0; n < ready; ++n) {
+            int fd = events[n].data.fd;
+
+            if (fd == end_timer) {
+                running = 0;
+
+            } else if (fd == print_timer) {
+                drain_timer(print_timer);
+                print_sample_row(&server_clock, &soft_clock,
+                                 simulation_start_time, NULL, &output);
+
+            } else if (fd == rapport_timer || fd == timeout_timer) {
+                drain_timer(fd);
+
+                /* A rapport still in flight is left alone until it is
+                   answered or times out. At the timeout, the answers so
+                   far make the rapport; with none, it is retried right
+                   away. */
+                if (fd == rapport_timer && rapport_pending) {
+                    /* Wait for the answers. */
+                } else if (fd == timeout_timer && !rapport_pending) {
+                    /* Expired as the rapport ended. */
+                } else if (fd == timeout_timer
+                           && rapport_has_answers(servers, server_count)) {
+                    rapport_pending = 0;
+                    rapport_ready = 1;
+                } else {
+                    if (fd == timeout_timer) {
+                        printf("WARN: A server response timed out.\n");
+                        metric_add(&metrics.timeouts, 1);
+                    }
+
+                    int sent = send_rapport_queries(client_fd, servers,
+                                                    server_count,
+                                                    rapport_burst);
+                    if (sent > 0) {
+                        rapport_pending = 1;
+                        rapport_answers = 0;
+                        rapport_slowest = 0;
+                        rapport_queries += sent;
+                        arm_timer(timeout_timer, NETWORK_TIMEOUT, 0);
+                    }
+                }
+
+            } else if (fd == client_fd) {
+                uint32_t answered;
+                server_sample sample;
+                int r;
+                while ((r = receive_server_reply(client_fd, MSG_DONTWAIT,
+                                                 &answered, &sample)) >= 0) {
+                    /* Ignore stale replies to earlier queries. */
+                    time_server *s;
+                    if (r > 0)
+                        continue;
+                    if (!rapport_pending
+                        || (s = accept_rapport_reply(servers, server_count,
+                                                     answered, &sample,
+                                                     &soft_clock)) == NULL) {
+                        metric_add(&metrics.stale, 1);
+                        continue;
+                    }
+
+                    if (s->estimate.rtt > rapport_slowest)
+                        rapport_slowest = s->estimate.rtt;
+                    /* A server has answered once its whole burst has. */
+                    if (s->pending > 0)
+                        continue;
+                    if (++rapport_answers == server_count) {
+                        rapport_pending = 0;
+                        rapport_ready = 1;
+                        arm_timer(timeout_timer, 0, 0);
+                    } else if (2 * rapport_answers > server_count
+                               && 2 * (rapport_answers - 1) <= server_count) {
+                        /* A majority just answered. */
+                        arm_timer(timeout_timer, rapport_slowest > 0
+                                  ? STRAGGLER_GRACE * rapport_slowest : 1, 0);
+                    }
+                }
             }
 
-            software_clock_gettime(&soft_clock, &response_local_time);
-            virtual_hardware_clock_gettime(soft_clock.vhclock,
-                                           &response_local_hardware_time);
-
-            /* server time is in the interval [T + min, T + 2D - min]
-               best estimate (middle of interval) is T + D */
-            microts rtt = response_local_time - request_local_time;
-            microts est_server_time = response_value + rtt/2;
-
-            e = real_hardware_clock_gettime(&current_real_time)
-                | virtual_hardware_clock_gettime(&server_clock, &local_server_time)
-                | virtual_hardware_clock_gettime(soft_clock.vhclock,
-                                                 &local_hardware_clock_time)
-                | software_clock_gettime(&soft_clock, &soft_clock_time);
-
-            if (e != 0) {
-                printf("FATAL: A clock read error occurred during runtime.\n");
-                exit(1);
+            /* Every server has answered the rapport, or its time is up. */
+            if (rapport_ready) {
+                rapport_ready = 0;
+                rapport_answers = 0;
+                server_sample sample;
+                rapport_estimate combined;
+                finish_rapport(servers, server_count, &soft_clock,
+                               frequency_fit.uncertainty, &combined,
+                               &sample);
+                microts est_server_time = combined.est_server_time;
+
+                print_sample_row(&server_clock, &soft_clock,
+                                 simulation_start_time, &est_server_time,
+                                 &output);
+
+                soft_clock.rapport_master = est_server_time;
+                soft_clock.rapport_local = combined.response_local_time;
+                soft_clock.rapport_vhc = combined.response_local_hardware_time;
+
+                double frequency;
+                if (frequency_window > 0
+                    && frequency_estimator_add(&frequency_fit, est_server_time,
+                                               combined.response_local_hardware_time,
+                                               &frequency) == 0)
+                    software_clock_set_frequency(&soft_clock, frequency);
+                if (published != NULL)
+                    shmclock_publish(published, &soft_clock);
+                record_rapport(&soft_clock);
+
+                /* The next rapport is one adapted period from now. */
+                if (adaptive_target > 0) {
+                    double floor = scheduler.floor;
+                    microts period = rapport_scheduler_update(
+                        &scheduler, &sample, est_server_time,
+                        combined.response_local_hardware_time,
+                        soft_clock.frequency);
+                    if (scheduler.floor > 0 && floor == 0)
+                        printf("WARN: Target error is below the predicted "
+                               "floor of %.0f usec; keeping a %ld usec "
+                               "rapport period.\n", scheduler.floor, period);
+                    arm_timer(rapport_timer, period, period);
+                }
             }
-
-            real_time_elapsed = (double) (current_real_time - simulation_start_time)
-                / (double) MILLION;
-            error = soft_clock_time - local_server_time;
-
-            printf("%ld,%.5f,%ld,%ld,%ld,%ld,%ld,\n",
-                   current_real_time, real_time_elapsed,
-                   local_server_time, local_hardware_clock_time,
-                   soft_clock_time, error, est_server_time);
-
-            soft_clock.rapport_master = est_server_time;
-            soft_clock.rapport_local = response_local_time;
-            soft_clock.rapport_vhc = response_local_hardware_time;
-
-            real_hardware_clock_gettime(&last_rapport);
         }
+    }
 
-        nanosleep(&sleeptime, NULL);
+    if (output.log != NULL && fclose(output.log) != 0) {
+        printf("FATAL: Writing the sample log failed.\n");
+        exit(1);
     }
+    if (summary)
+        print_summary(&output, SERVER_DRIFT - RELATIVE_DRIFT,
+                      RAPPORT_PERIOD, AMORTIZATION_PERIOD, rapport_queries,
+                      servers, server_count);
+    return 0;
 }
@@ -0,0 +1,75 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "delay.h"
+
+static const char *KIND_NAMES[] = { "const", "uniform", "normal", "exp" };
+
+int delay_spec_parse(const char *text, delay_spec *spec) {
+    static const int KIND_PARAMETERS[] = { 1, 2, 2, 2 };
+
+    const char *colon = strchr(text, ':');
+    if (colon == NULL)
+        return -1;
+
+    for (int kind = DELAY_CONSTANT; kind <= DELAY_EXPONENTIAL; ++kind) {
+        size_t length = strlen(KIND_NAMES[kind]);
+        if ((size_t) (colon - text) != length
+            || strncmp(text, KIND_NAMES[kind], length) != 0)
+            continue;
+
+        char *end;
+        spec->kind = kind;
+        spec->a = strtod(colon + 1, &end);
+        spec->b = 0;
+        if (KIND_PARAMETERS[kind] == 2) {
+            if (*end != ':')
+                return -1;
+            spec->b = strtod(end + 1, &end);
+        }
+        if (*end != '\0' || spec->a < 0 || spec->b < 0)
+            return -1;
+        if (kind == DELAY_UNIFORM && spec->b < spec->a)
+            return -1;
+        return 0;
+    }
+    return -1;
+}
+
+void delay_spec_format(const delay_spec *spec, char *buffer, size_t size) {
+    if (spec->kind == DELAY_CONSTANT)
+        snprintf(buffer, size, "%s:%g", KIND_NAMES[spec->kind], spec->a);
+    else
+        snprintf(buffer, size, "%s:%g:%g", KIND_NAMES[spec->kind],
+                 spec->a, spec->b);
+}
+
+double random_uniform(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    uint64_t bits = *state * 0x2545F4914F6CDD1DULL;
+    return ((bits >> 11) + 0.5) / 9007199254740992.0;
+}
+
+microts delay_spec_sample(const delay_spec *spec, uint64_t *state) {
+    double delay;
+    switch (spec->kind) {
+    case DELAY_UNIFORM:
+        delay = spec->a + (spec->b - spec->a) * random_uniform(state);
+        break;
+    case DELAY_NORMAL:
+        /* Box-Muller */
+        delay = spec->a + spec->b * sqrt(-2 * log(random_uniform(state)))
+            * cos(2 * M_PI * random_uniform(state));
+        break;
+    case DELAY_EXPONENTIAL:
+        delay = spec->a - spec->b * log(random_uniform(state));
+        break;
+    default:
+        delay = spec->a;
+    }
+    return delay > 0 ? llround(delay) : 0;
+}
@@ -0,0 +1,40 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "sclock.h"
+#ifndef DELAY_H
+#define DELAY_H
+
+/* Network delay distributions shared by the simulator and the netem relay. */
+
+enum delay_kinds {
+    DELAY_CONSTANT = 0,
+    DELAY_UNIFORM,
+    DELAY_NORMAL,
+    DELAY_EXPONENTIAL
+};
+
+/* One-way network delay distribution, in usec:
+   const:D         always D
+   uniform:LO:HI   uniform on [LO, HI]
+   normal:MEAN:SD  normal, clamped at 0
+   exp:MIN:MEAN    MIN plus an exponential tail with mean MEAN */
+typedef struct delay_spec {
+    int kind;
+    double a;
+    double b;
+} delay_spec;
+
+/* Parse a delay distribution as described above. Returns 0 on success. */
+int delay_spec_parse(const char *text, delay_spec *spec);
+
+/* Write the text form of spec to buffer, as delay_spec_parse accepts it. */
+void delay_spec_format(const delay_spec *spec, char *buffer, size_t size);
+
+/* xorshift64* step. Returns a value in (0, 1) and advances state, which
+   must not be 0. Callers keep their own state, so this is thread-safe. */
+double random_uniform(uint64_t *state);
+
+/* Draw one delay from spec, in whole usec. */
+microts delay_spec_sample(const delay_spec *spec, uint64_t *state);
+
+#endif // DELAY_H
@@ -0,0 +1,92 @@
+#include <string.h>
+#include "hist.h"
+
+void hist_init(histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+int hist_bucket(uint64_t value) {
+    if (value < ((uint64_t) 2 << HIST_SUB_BITS))
+        return value;
+
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift << HIST_SUB_BITS) + (int) (value >> shift);
+}
+
+uint64_t hist_bucket_floor(int bucket) {
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    if (shift <= 0)
+        return bucket;
+    return (uint64_t) (bucket - (shift << HIST_SUB_BITS)) << shift;
+}
+
+void hist_record(histogram *h, uint64_t value) {
+    ++h->counts[hist_bucket(value)];
+    ++h->total;
+    h->sum += value;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+/* One writer, so a load and a store stand in for an atomic increment. */
+#define SHARED_ADD(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) \
+                     + (n), __ATOMIC_RELAXED)
+
+void hist_record_shared(histogram *h, uint64_t value) {
+    SHARED_ADD(h->counts[hist_bucket(value)], 1);
+    SHARED_ADD(h->total, 1);
+    double sum = h->sum + value;
+    __atomic_store(&h->sum, &sum, __ATOMIC_RELAXED);
+    if (value < h->min)
+        __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+void hist_snapshot(histogram *into, const histogram *from) {
+    for (int b = 0; b < HIST_BUCKETS; ++b)
+        into->counts[b] = __atomic_load_n(&from->counts[b], __ATOMIC_RELAXED);
+    into->total = __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+    __atomic_load(&from->sum, &into->sum, __ATOMIC_RELAXED);
+    into->min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+    into->max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+}
+
+void hist_merge(histogram *into, const histogram *from) {
+    for (int b = 0; b < HIST_BUCKETS; ++b)
+        into->counts[b] += from->counts[b];
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+uint64_t hist_percentile(const histogram *h, double percentile) {
+    if (h->total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (percentile / 100 * h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t top = b + 1 < HIST_BUCKETS
+                ? hist_bucket_floor(b + 1) - 1 : UINT64_MAX;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const histogram *h) {
+    return h->total ? h->sum / h->total : 0;
+}
@@ -0,0 +1,52 @@
+#include <stdint.h>
+#ifndef HIST_H
+#define HIST_H
+
+/* Log-linear histogram in the style of HdrHistogram.
+
+   Values below 2^(HIST_SUB_BITS + 1) get a bucket each. Above that, every
+   power of two is split into 2^HIST_SUB_BITS equal buckets, so a value is
+   recorded with a relative error below 2^-HIST_SUB_BITS (0.8%) over the
+   whole 64-bit range, in a fixed 58 KB of counters and with no division
+   or floating point on the recording path. */
+
+#define HIST_SUB_BITS 7
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} histogram;
+
+void hist_init(histogram *h);
+
+/* The bucket holding value, and the smallest value in a bucket. */
+int hist_bucket(uint64_t value);
+uint64_t hist_bucket_floor(int bucket);
+
+void hist_record(histogram *h, uint64_t value);
+
+/* hist_record for a histogram that other threads read with hist_snapshot
+   while its one writer keeps recording. Every field is written with a
+   relaxed atomic store, so recording takes no lock and no locked
+   instruction. */
+void hist_record_shared(histogram *h, uint64_t value);
+
+/* Copy a histogram that its writer may be recording into. The copy may
+   catch a record halfway, with its count in but not yet its total. */
+void hist_snapshot(histogram *into, const histogram *from);
+
+/* Add every count of from into into. */
+void hist_merge(histogram *into, const histogram *from);
+
+/* The smallest recorded value v such that percentile % of the recorded
+   values are at most v, rounded up to the top of its bucket and capped at
+   the maximum. Returns 0 for an empty histogram. */
+uint64_t hist_percentile(const histogram *h, double percentile);
+
+double hist_mean(const histogram *h);
+
+#endif // HIST_H
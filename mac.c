@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+#include "mac.h"
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static inline void sipround(siphash_state *s) {
+    s->v0 += s->v1;
+    s->v1 = ROTL(s->v1, 13);
+    s->v1 ^= s->v0;
+    s->v0 = ROTL(s->v0, 32);
+    s->v2 += s->v3;
+    s->v3 = ROTL(s->v3, 16);
+    s->v3 ^= s->v2;
+    s->v0 += s->v3;
+    s->v3 = ROTL(s->v3, 21);
+    s->v3 ^= s->v0;
+    s->v2 += s->v1;
+    s->v1 = ROTL(s->v1, 17);
+    s->v1 ^= s->v2;
+    s->v2 = ROTL(s->v2, 32);
+}
+
+static uint64_t load_le64(const char *p) {
+    const unsigned char *b = (const unsigned char *) p;
+    uint64_t word = 0;
+    for (int i = 7; i >= 0; --i)
+        word = (word << 8) | b[i];
+    return word;
+}
+
+static void store_le64(char *p, uint64_t word) {
+    for (int i = 0; i < 8; ++i)
+        p[i] = (char) (word >> (8 * i));
+}
+
+int mac_load_key(const char *path, mac_key *key) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    char line[128];
+    int ok = fgets(line, sizeof(line), file) != NULL;
+    fclose(file);
+    if (!ok)
+        return -1;
+
+    /* The key's 16 bytes in order, as `xxd -p` prints them, and read into
+       k0 and k1 as little-endian words like the reference implementation. */
+    char bytes[16];
+    for (int i = 0; i < 32; ++i) {
+        unsigned char c = line[i];
+        if (!isxdigit(c))
+            return -1;
+        int digit = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+        bytes[i / 2] = (char) ((i % 2) ? (bytes[i / 2] << 4) | digit : digit);
+    }
+    if (isxdigit((unsigned char) line[32]))
+        return -1;
+
+    key->k0 = load_le64(bytes);
+    key->k1 = load_le64(bytes + 8);
+    return 0;
+}
+
+void siphash_init(siphash_state *state, const mac_key *key) {
+    state->v0 = 0x736f6d6570736575ULL ^ key->k0;
+    state->v1 = 0x646f72616e646f6dULL ^ key->k1;
+    state->v2 = 0x6c7967656e657261ULL ^ key->k0;
+    state->v3 = 0x7465646279746573ULL ^ key->k1;
+    state->length = 0;
+}
+
+void siphash_update(siphash_state *state, const char *word) {
+    uint64_t m = load_le64(word);
+    state->v3 ^= m;
+    sipround(state);
+    sipround(state);
+    state->v0 ^= m;
+    state->length += 8;
+}
+
+uint64_t siphash_final(const siphash_state *state) {
+    /* Messages are whole words, so the last block is just the length. */
+    siphash_state s = *state;
+    uint64_t b = s.length << 56;
+    s.v3 ^= b;
+    sipround(&s);
+    sipround(&s);
+    s.v0 ^= b;
+    s.v2 ^= 0xff;
+    sipround(&s);
+    sipround(&s);
+    sipround(&s);
+    sipround(&s);
+    return s.v0 ^ s.v1 ^ s.v2 ^ s.v3;
+}
+
+static uint64_t query_tag(const mac_key *key, const char *query) {
+    siphash_state state;
+    siphash_init(&state, key);
+    siphash_update(&state, query);
+    siphash_update(&state, query + 8);
+    return siphash_final(&state);
+}
+
+int mac_random_sequence(uint32_t *sequence) {
+    return getrandom(sequence, sizeof(*sequence), 0) == sizeof(*sequence)
+        ? 0 : -1;
+}
+
+int mac_sign_query(const mac_key *key, char *query) {
+    *(uint8_t *) (query + FLAGS_OFFSET) |= MESSAGE_FLAG_MAC;
+    store_le64(query + MESSAGE_V2_QUERY_SIZE, query_tag(key, query));
+    return MESSAGE_AUTH_QUERY_SIZE;
+}
+
+int mac_verify_query(const mac_key *key, const char *query, int recv_len) {
+    if (recv_len < MESSAGE_AUTH_QUERY_SIZE
+        || !(*(uint8_t *) (query + FLAGS_OFFSET) & MESSAGE_FLAG_MAC))
+        return -1;
+    return query_tag(key, query)
+        == load_le64(query + MESSAGE_V2_QUERY_SIZE) ? 0 : -1;
+}
+
+/* The first word of a reply's MAC input: the sequence number followed by
+   the version header, skipping the transmit stamp between them. */
+static void reply_head(const char *reply, char *word) {
+    memcpy(word, reply, SEQ_NUM_SIZE);
+    memcpy(word + SEQ_NUM_SIZE, reply + VERSION_OFFSET,
+           RECEIVE_STAMP_OFFSET - VERSION_OFFSET);
+}
+
+void mac_reply_begin(const mac_key *key, char *reply, siphash_state *state) {
+    char head[8];
+    *(uint8_t *) (reply + FLAGS_OFFSET) |= MESSAGE_FLAG_MAC;
+    reply_head(reply, head);
+    siphash_init(state, key);
+    siphash_update(state, head);
+    siphash_update(state, reply + RECEIVE_STAMP_OFFSET);
+}
+
+int mac_reply_end(const siphash_state *state, char *reply,
+                  microts transmit_time) {
+    siphash_state s = *state;
+    *(uint64_t *) (reply + SEQ_NUM_SIZE) = htonll(transmit_time);
+    siphash_update(&s, reply + SEQ_NUM_SIZE);
+    store_le64(reply + MESSAGE_V2_REPLY_SIZE, siphash_final(&s));
+    return MESSAGE_AUTH_REPLY_SIZE;
+}
+
+int mac_verify_reply(const mac_key *key, const char *reply, int recv_len) {
+    if (recv_len != MESSAGE_AUTH_REPLY_SIZE
+        || !(*(uint8_t *) (reply + FLAGS_OFFSET) & MESSAGE_FLAG_MAC))
+        return -1;
+
+    char head[8];
+    siphash_state state;
+    reply_head(reply, head);
+    siphash_init(&state, key);
+    siphash_update(&state, head);
+    siphash_update(&state, reply + RECEIVE_STAMP_OFFSET);
+    siphash_update(&state, reply + SEQ_NUM_SIZE);
+    return siphash_final(&state)
+        == load_le64(reply + MESSAGE_V2_REPLY_SIZE) ? 0 : -1;
+}
@@ -0,0 +1,63 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "sclock.h"
+#ifndef MAC_H
+#define MAC_H
+
+/* Message authentication with SipHash-2-4 (Aumasson and Bernstein, 2012)
+   under a 128-bit pre-shared key. See sclock.h for the message layout.
+
+   The tag covers every byte before it, but a reply is absorbed in the
+   order [sequence number, version header] [receive stamp] [transmit
+   stamp] rather than in wire order. Everything except the transmit stamp
+   is known before the server reads its clock, so mac_reply_begin absorbs
+   it beforehand. Between the clock read and the send, mac_reply_end only
+   absorbs one word and finalizes: six SipRounds. */
+
+typedef struct mac_key {
+    uint64_t k0;
+    uint64_t k1;
+} mac_key;
+
+/* SipHash state after some number of whole 8-byte words. */
+typedef struct siphash_state {
+    uint64_t v0, v1, v2, v3;
+    uint64_t length;
+} siphash_state;
+
+/* Read a key of 32 hex digits from the first line of path. Returns 0, or
+   -1 if the file cannot be read or holds no such key. */
+int mac_load_key(const char *path, mac_key *key);
+
+void siphash_init(siphash_state *state, const mac_key *key);
+/* Absorb the next 8 bytes of the message, as a little-endian word. */
+void siphash_update(siphash_state *state, const char *word);
+/* The tag of the words absorbed so far. state is left as it was, so more
+   words can still follow. */
+uint64_t siphash_final(const siphash_state *state);
+
+/* A random first sequence number for this process. Sequence numbers
+   would otherwise start at 0 on every run, and an authenticated reply
+   recorded from one run would then carry a valid tag for a query of the
+   next. Returns 0, or -1 if the kernel gives no random bytes. */
+int mac_random_sequence(uint32_t *sequence);
+
+/* Set MESSAGE_FLAG_MAC in a version 2 query and append its tag. Returns
+   the length of the authenticated query. */
+int mac_sign_query(const mac_key *key, char *query);
+
+/* Returns 0 if reply holds an authenticated reply (or query holds an
+   authenticated query) of recv_len bytes with a valid tag, and -1 if not. */
+int mac_verify_query(const mac_key *key, const char *query, int recv_len);
+int mac_verify_reply(const mac_key *key, const char *reply, int recv_len);
+
+/* Set MESSAGE_FLAG_MAC in a version 2 reply and absorb all of it but the
+   transmit stamp. */
+void mac_reply_begin(const mac_key *key, char *reply, siphash_state *state);
+
+/* Write transmit_time into the reply and append the tag. Returns the
+   length of the authenticated reply. */
+int mac_reply_end(const siphash_state *state, char *reply,
+                  microts transmit_time);
+
+#endif // MAC_H
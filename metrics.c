@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Largest finite histogram bound: 10 s in usec. */
+#define HISTOGRAM_CEILING 10000000
+
+/* How long a connection gets to send its request before it is answered
+   as a plain one. */
+#define REQUEST_WAIT_MS 100
+
+typedef struct metrics_server {
+    int fd;
+    metrics_writer writer;
+    void *arg;
+} metrics_server;
+
+static int send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        /* A scraper that hangs up early must not kill the process. */
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+static void answer(metrics_server *server, int fd) {
+    char request[256];
+    ssize_t request_len = 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, REQUEST_WAIT_MS) > 0)
+        request_len = recv(fd, request, sizeof(request), 0);
+    int http = request_len >= 4 && strncmp(request, "GET ", 4) == 0;
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (out == NULL)
+        return;
+    server->writer(out, server->arg);
+    if (fclose(out) != 0) {
+        free(body);
+        return;
+    }
+
+    if (http) {
+        char header[160];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n\r\n", body_len);
+        if (send_all(fd, header, header_len) != 0) {
+            free(body);
+            return;
+        }
+    }
+    send_all(fd, body, body_len);
+    free(body);
+}
+
+static void *serve_thread(void *arg) {
+    metrics_server *server = arg;
+    while (1) {
+        int fd = accept(server->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("WARN: Metrics socket accept failed. %s\n",
+                   strerror(errno));
+            return NULL;
+        }
+        answer(server, fd);
+        close(fd);
+    }
+}
+
+int metrics_serve(const char *path, metrics_writer writer, void *arg) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    metrics_server *server = malloc(sizeof(*server));
+    if (server == NULL)
+        return -1;
+    server->writer = writer;
+    server->arg = arg;
+
+    unlink(path);
+    if ((server->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || bind(server->fd, (struct sockaddr *) &address,
+                sizeof(address)) != 0
+        || listen(server->fd, 8) != 0) {
+        int saved = errno;
+        if (server->fd >= 0)
+            close(server->fd);
+        free(server);
+        errno = saved;
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_thread, server) != 0) {
+        close(server->fd);
+        free(server);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void metrics_counter(FILE *out, const char *name, const char *help,
+                     uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+            name, help, name, name, (unsigned long) value);
+}
+
+void metrics_gauge(FILE *out, const char *name, const char *help,
+                   double value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n",
+            name, help, name, name, value);
+}
+
+void metrics_histogram(FILE *out, const char *name, const char *help,
+                       const histogram *h) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    /* Counts are summed as they are printed, rather than taken from
+       total, so that the +Inf bucket and _count always agree. */
+    uint64_t cumulative = 0;
+    int b = 0;
+    uint64_t le = 1;
+    for (int step = 0; le <= HISTOGRAM_CEILING; step = (step + 1) % 3) {
+        for (int last = hist_bucket(le); b <= last; ++b)
+            cumulative += h->counts[b];
+        fprintf(out, "%s_bucket{le=\"%lu\"} %lu\n", name,
+                (unsigned long) le, (unsigned long) cumulative);
+        /* 1, 2, 5, 10, 20, 50, ... */
+        le = step == 1 ? le / 2 * 5 : le * 2;
+    }
+    for (; b < HIST_BUCKETS; ++b)
+        cumulative += h->counts[b];
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name,
+            (unsigned long) cumulative);
+    fprintf(out, "%s_sum %.17g\n%s_count %lu\n", name, h->sum, name,
+            (unsigned long) cumulative);
+}
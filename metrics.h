@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <stdio.h>
+#include "hist.h"
+#ifndef METRICS_H
+#define METRICS_H
+
+/* Runtime metrics in the Prometheus text exposition format.
+
+   Each counter, gauge and histogram has exactly one writing thread; the
+   server keeps one set per worker. A write is a relaxed atomic load and
+   store, the same instructions as a plain increment, so recording never
+   takes a lock or bounces a cache line between cores. A background
+   thread answers each connection to a Unix stream socket with a fresh
+   rendering, so scrapes cost the timing paths nothing but a core.
+
+       curl --unix-socket PATH http://localhost/metrics
+       socat - UNIX-CONNECT:PATH
+
+   Connections that open with an HTTP request get an HTTP response; any
+   other connection gets the bare text. */
+
+static inline void metric_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metric_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(double *gauge, double value) {
+    __atomic_store(gauge, &value, __ATOMIC_RELAXED);
+}
+
+static inline double metric_read_gauge(const double *gauge) {
+    double value;
+    __atomic_load(gauge, &value, __ATOMIC_RELAXED);
+    return value;
+}
+
+/* Writes the current metrics to out. Called on the metrics thread. */
+typedef void (*metrics_writer)(FILE *out, void *arg);
+
+/* Serve the output of writer on the Unix stream socket path, replacing
+   any socket already there, from a new background thread. Returns 0, or
+   -1 if the socket or thread cannot be created. */
+int metrics_serve(const char *path, metrics_writer writer, void *arg);
+
+/* Render one metric with its HELP and TYPE lines. */
+void metrics_counter(FILE *out, const char *name, const char *help,
+                     uint64_t value);
+void metrics_gauge(FILE *out, const char *name, const char *help,
+                   double value);
+
+/* A histogram of a snapshot (see hist_snapshot). Buckets follow the 1, 2,
+   5, 10, ... series up to 10^7, the same 22 on every scrape, then +Inf.
+   A bucket counts whole log-linear buckets, so its le bound is exact to
+   within their 0.8% width. */
+void metrics_histogram(FILE *out, const char *name, const char *help,
+                       const histogram *h);
+
+#endif // METRICS_H
@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "sclock.h"
+#include "delay.h"
+
+/* A UDP relay that emulates a WAN path between client and server.
+
+   The client sends its queries to the relay's port. Each client address
+   gets its own upstream socket toward the server, so replies find their
+   way back. Every datagram in either direction is dropped, duplicated,
+   delayed or sent early according to the options, then released from a
+   queue ordered by release time. Delays on different packets are drawn
+   independently, so jitter reorders packets on its own. */
+
+/* Largest datagram relayed. Anything longer is truncated. */
+#define RELAY_BUFFER_SIZE 2048
+
+/* Upper bound on distinct client addresses. */
+#define MAX_FLOWS 256
+
+/* Upper bound on RTT trace entries. */
+#define MAX_TRACE_SIZE 1048576
+
+/* Queries per flow whose trace RTT is remembered for the reply. */
+#define MAX_TRACE_PENDING 64
+
+enum directions {
+    UPLINK = 0,
+    DOWNLINK
+};
+
+/* The downlink share of a query's trace RTT, kept for its reply. */
+typedef struct trace_pending {
+    /* Sequence number the reply will carry: the query's plus one. */
+    uint32_t reply_sequence;
+    microts downlink;
+} trace_pending;
+
+typedef struct relay_flow {
+    struct sockaddr_in client;
+    int upstream_fd;
+    /* The last MAX_TRACE_PENDING queries, newest at trace_next - 1.
+       Replies find theirs by sequence number, so loss, duplication and
+       reordering in either direction leave the pairing intact. */
+    trace_pending trace[MAX_TRACE_PENDING];
+    unsigned trace_next;
+} relay_flow;
+
+typedef struct relay_packet {
+    microts release;
+    /* Keeps packets with the same release time in arrival order. */
+    uint64_t order;
+    int flow;
+    int direction;
+    int length;
+    char data[RELAY_BUFFER_SIZE];
+} relay_packet;
+
+typedef struct relay_options {
+    delay_spec delay[2];
+    double loss;
+    double duplicate;
+    double reorder;
+    /* RTT trace replayed instead of the delay distributions, if any. */
+    microts *trace;
+    size_t trace_size;
+    double trace_uplink_share;
+} relay_options;
+
+static relay_options options;
+static uint64_t random_state = 1;
+
+static relay_flow flows[MAX_FLOWS];
+static int flow_count = 0;
+
+/* Binary min-heap on (release, order). */
+static relay_packet **queue = NULL;
+static size_t queued = 0;
+static size_t queue_capacity = 0;
+static uint64_t next_order = 0;
+static size_t next_trace = 0;
+
+static unsigned long relayed[2], dropped[2], duplicated[2];
+
+/* Timers are CLOCK_MONOTONIC, so the queue runs on it too. */
+static microts monotonic_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * (microts) MILLION + now.tv_nsec / 1000;
+}
+
+static int packet_before(const relay_packet *a, const relay_packet *b) {
+    return a->release < b->release
+        || (a->release == b->release && a->order < b->order);
+}
+
+static int enqueue(relay_packet *packet) {
+    if (queued == queue_capacity) {
+        size_t capacity = queue_capacity ? 2 * queue_capacity : 256;
+        relay_packet **grown = realloc(queue, capacity * sizeof(*queue));
+        if (grown == NULL)
+            return -1;
+        queue = grown;
+        queue_capacity = capacity;
+    }
+
+    packet->order = next_order++;
+    size_t i = queued++;
+    while (i > 0 && packet_before(packet, queue[(i - 1) / 2])) {
+        queue[i] = queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue[i] = packet;
+    return 0;
+}
+
+static relay_packet *dequeue() {
+    relay_packet *top = queue[0];
+    relay_packet *last = queue[--queued];
+
+    size_t i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= queued)
+            break;
+        if (child + 1 < queued
+            && packet_before(queue[child + 1], queue[child]))
+            ++child;
+        if (!packet_before(queue[child], last))
+            break;
+        queue[i] = queue[child];
+        i = child;
+    }
+    queue[i] = last;
+    return top;
+}
+
+/* One-way delay from the RTT trace for a datagram of flow f in the given
+   direction. Each query consumes the next RTT of the trace and splits it
+   between itself and its reply. */
+static microts trace_delay(int f, int direction, const char *data,
+                           int length) {
+    relay_flow *flow = &flows[f];
+    int keyed = length >= SEQ_NUM_SIZE;
+    uint32_t sequence = keyed ? ntohl(*(uint32_t *) data) : 0;
+
+    if (direction == DOWNLINK && keyed) {
+        for (unsigned i = 1; i <= MAX_TRACE_PENDING; ++i) {
+            trace_pending *p = &flow->trace[(flow->trace_next - i)
+                                            % MAX_TRACE_PENDING];
+            if (p->reply_sequence == sequence && p->downlink >= 0)
+                return p->downlink;
+        }
+    }
+
+    microts rtt = options.trace[next_trace];
+    next_trace = (next_trace + 1) % options.trace_size;
+    microts uplink = llround(rtt * options.trace_uplink_share);
+
+    /* A reply to no remembered query, such as one to a query pushed out
+       of the ring, gets the downlink share of a fresh RTT. */
+    if (direction == DOWNLINK)
+        return rtt - uplink;
+
+    trace_pending *p = &flow->trace[flow->trace_next++ % MAX_TRACE_PENDING];
+    p->reply_sequence = sequence + 1;
+    p->downlink = keyed ? rtt - uplink : -1;
+    return uplink;
+}
+
+/* Queue a copy of data, or drop it. */
+static int schedule_packet(int f, int direction, char *data, int length,
+                           microts now) {
+    /* The trace is consumed before any packet is lost or duplicated, so
+       every query, and every copy of its reply, has the same RTT. */
+    microts traced = 0;
+    if (options.trace_size > 0)
+        traced = trace_delay(f, direction, data, length);
+
+    if (options.loss > 0 && random_uniform(&random_state) < options.loss) {
+        ++dropped[direction];
+        return 0;
+    }
+
+    int copies = 1;
+    if (options.duplicate > 0
+        && random_uniform(&random_state) < options.duplicate) {
+        ++duplicated[direction];
+        copies = 2;
+    }
+
+    for (int c = 0; c < copies; ++c) {
+        relay_packet *packet = malloc(sizeof(relay_packet));
+        if (packet == NULL)
+            return -1;
+
+        /* As with netem, a reordered packet skips its delay and overtakes
+           whatever is still queued. */
+        packet->release = now;
+        if (options.reorder <= 0
+            || random_uniform(&random_state) >= options.reorder)
+            packet->release += options.trace_size > 0 ? traced
+                : delay_spec_sample(&options.delay[direction], &random_state);
+
+        packet->flow = f;
+        packet->direction = direction;
+        packet->length = length;
+        memcpy(packet->data, data, length);
+        if (enqueue(packet) != 0) {
+            free(packet);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Returns the flow of client, creating it on first sight, or -1. */
+static int find_flow(struct sockaddr_in *client, int epoll_fd) {
+    for (int f = 0; f < flow_count; ++f) {
+        if (flows[f].client.sin_addr.s_addr == client->sin_addr.s_addr
+            && flows[f].client.sin_port == client->sin_port)
+            return f;
+    }
+
+    if (flow_count == MAX_FLOWS)
+        return -1;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+
+    /* Flows are numbered from 1 in epoll data; 0 is the listening socket. */
+    struct epoll_event event = { .events = EPOLLIN,
+                                 .data.u32 = flow_count + 1 };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    flows[flow_count].client = *client;
+    flows[flow_count].upstream_fd = fd;
+    flows[flow_count].trace_next = 0;
+    for (int i = 0; i < MAX_TRACE_PENDING; ++i)
+        flows[flow_count].trace[i].downlink = -1;
+    return flow_count++;
+}
+
+/* Send every packet whose release time has passed. */
+static void release_due(int listen_fd, struct sockaddr_in *server_addr,
+                        microts now) {
+    while (queued > 0 && queue[0]->release <= now) {
+        relay_packet *packet = dequeue();
+        relay_flow *flow = &flows[packet->flow];
+
+        int fd = listen_fd;
+        struct sockaddr_in *to = &flow->client;
+        if (packet->direction == UPLINK) {
+            fd = flow->upstream_fd;
+            to = server_addr;
+        }
+
+        if (sendto(fd, packet->data, packet->length, MSG_DONTWAIT,
+                   (struct sockaddr *) to, sizeof(*to)) < 0)
+            printf("WARN: Relay sendto failed. %s\n", strerror(errno));
+        else
+            ++relayed[packet->direction];
+        free(packet);
+    }
+}
+
+/* Read every datagram queued on fd. Packets from the listening socket are
+   uplink; packets on a flow's upstream socket are that flow's downlink. */
+static void receive_all(int fd, int flow, int epoll_fd) {
+    char buffer[RELAY_BUFFER_SIZE];
+    struct sockaddr_in from;
+    socklen_t from_len;
+    int length;
+
+    while (from_len = sizeof(from),
+           (length = recvfrom(fd, buffer, sizeof(buffer), MSG_DONTWAIT,
+                              (struct sockaddr *) &from, &from_len)) >= 0) {
+        microts now = monotonic_now();
+        int direction = flow < 0 ? UPLINK : DOWNLINK;
+        int f = flow < 0 ? find_flow(&from, epoll_fd) : flow;
+        if (f < 0) {
+            printf("WARN: Relay flow table is full.\n");
+            continue;
+        }
+
+        if (schedule_packet(f, direction, buffer, length, now) != 0) {
+            printf("FATAL: Relay queue allocation failed.\n");
+            exit(1);
+        }
+    }
+}
+
+static void print_counters() {
+    printf("Uplink: %lu relayed, %lu dropped, %lu duplicated\n",
+           relayed[UPLINK], dropped[UPLINK], duplicated[UPLINK]);
+    printf("Downlink: %lu relayed, %lu dropped, %lu duplicated\n",
+           relayed[DOWNLINK], dropped[DOWNLINK], duplicated[DOWNLINK]);
+    printf("Flows: %d\n", flow_count);
+    fflush(stdout);
+}
+
+/* Arm timer_fd for the earliest queued packet, or disarm it. */
+static void arm_release_timer(int timer_fd) {
+    struct itimerspec spec = {{0}};
+    if (queued > 0) {
+        microts release = queue[0]->release;
+        spec.it_value.tv_sec = release / MILLION;
+        spec.it_value.tv_nsec = (release % MILLION) * 1000;
+        /* A zero it_value would disarm the timer. */
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/* Load one RTT in usec per line. Blank lines and lines starting with #
+   are skipped. */
+static int load_trace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    char line[128];
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), file) != NULL
+           && options.trace_size < MAX_TRACE_SIZE) {
+        char *end;
+        long long rtt = strtoll(line, &end, 10);
+        if (line[0] == '#' || end == line)
+            continue;
+        if (rtt < 0)
+            rtt = 0;
+
+        if (options.trace_size == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            microts *grown = realloc(options.trace, capacity * sizeof(microts));
+            if (grown == NULL) {
+                fclose(file);
+                return -1;
+            }
+            options.trace = grown;
+        }
+        options.trace[options.trace_size++] = rtt;
+    }
+
+    fclose(file);
+    return options.trace_size > 0 ? 0 : -1;
+}
+
+static void parse_delay(const char *text, delay_spec *spec) {
+    if (delay_spec_parse(text, spec) != 0) {
+        printf("FATAL: Invalid delay distribution %s.\n", text);
+        exit(1);
+    }
+}
+
+static void parse_probability(const char *text, double *p) {
+    *p = atof(text);
+    if (*p < 0 || *p > 1) {
+        printf("FATAL: Probability %s is not between 0 and 1.\n", text);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        printf("Usage: netem [listen port] [server IP] [server port]\n");
+        printf("             [--delay DIST (both directions)]\n");
+        printf("             [--uplink DIST (client to server)]\n");
+        printf("             [--downlink DIST (server to client)]\n");
+        printf("             [--loss P] [--duplicate P] [--reorder P]\n");
+        printf("             [--trace FILE (RTTs in usec, one per line)]\n");
+        printf("             [--trace-uplink-share F (default 0.5)]\n");
+        printf("             [--seed N]\n");
+        printf("DIST is const:D, uniform:LO:HI, normal:MEAN:SD or exp:MIN:MEAN (usec).\n");
+        exit(1);
+    }
+
+    const int LISTEN_PORT = atoi(argv[1]);
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[3]));
+    if (inet_pton(AF_INET, argv[2], &server_addr.sin_addr) != 1) {
+        printf("FATAL: Invalid server IP address.\n");
+        exit(1);
+    }
+
+    options.delay[UPLINK].kind = DELAY_CONSTANT;
+    options.delay[DOWNLINK].kind = DELAY_CONSTANT;
+    options.trace_uplink_share = 0.5;
+    const char *trace_path = NULL;
+
+    for (int i = 4; i < argc; ++i) {
+        if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &options.delay[UPLINK]);
+            options.delay[DOWNLINK] = options.delay[UPLINK];
+        } else if (strcmp(argv[i], "--uplink") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &options.delay[UPLINK]);
+        } else if (strcmp(argv[i], "--downlink") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &options.delay[DOWNLINK]);
+        } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            parse_probability(argv[++i], &options.loss);
+        } else if (strcmp(argv[i], "--duplicate") == 0 && i + 1 < argc) {
+            parse_probability(argv[++i], &options.duplicate);
+        } else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+            parse_probability(argv[++i], &options.reorder);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-uplink-share") == 0
+                   && i + 1 < argc) {
+            parse_probability(argv[++i], &options.trace_uplink_share);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            random_state = strtoull(argv[++i], NULL, 10);
+            if (random_state == 0)
+                random_state = 1;
+        } else {
+            printf("FATAL: Unrecognized option %s.\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if (trace_path != NULL && load_trace(trace_path) != 0) {
+        printf("FATAL: Could not load RTT trace %s.\n", trace_path);
+        exit(1);
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in listen_addr = {0};
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = INADDR_ANY;
+    listen_addr.sin_port = htons(LISTEN_PORT);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &listen_addr,
+                              sizeof(listen_addr)) < 0) {
+        printf("FATAL: Could not bind the relay to port %d. %s\n",
+               LISTEN_PORT, strerror(errno));
+        exit(1);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = 0 };
+    if (epoll_fd < 0 || timer_fd < 0
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+        printf("FATAL: Could not create the relay event loop.\n");
+        exit(1);
+    }
+    event.data.u32 = MAX_FLOWS + 1;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) != 0) {
+        printf("FATAL: Could not create the relay event loop.\n");
+        exit(1);
+    }
+
+    /* SIGINT and SIGTERM print the packet counters before exiting. */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK);
+    event.data.u32 = MAX_FLOWS + 2;
+    if (signal_fd < 0
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) != 0) {
+        printf("FATAL: Could not create the relay event loop.\n");
+        exit(1);
+    }
+
+    char uplink[64], downlink[64];
+    delay_spec_format(&options.delay[UPLINK], uplink, sizeof(uplink));
+    delay_spec_format(&options.delay[DOWNLINK], downlink, sizeof(downlink));
+    printf("Relaying port %d to %s:%s\n", LISTEN_PORT, argv[2], argv[3]);
+    if (options.trace_size > 0)
+        printf("Replaying %zu RTTs from %s, %.0f%% on the uplink\n",
+               options.trace_size, trace_path,
+               options.trace_uplink_share * 100);
+    else
+        printf("Uplink: %s, Downlink: %s\n", uplink, downlink);
+    printf("Loss: %g, Duplicate: %g, Reorder: %g\n",
+           options.loss, options.duplicate, options.reorder);
+    fflush(stdout);
+
+    while (1) {
+        struct epoll_event events[MAX_FLOWS + 3];
+        int ready = epoll_wait(epoll_fd, events, MAX_FLOWS + 3, -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("FATAL: epoll_wait failed. %s\n", strerror(errno));
+            exit(1);
+        }
+
+        for (int n = 0; n < ready; ++n) {
+            uint32_t source = events[n].data.u32;
+            if (source == MAX_FLOWS + 2) {
+                print_counters();
+                exit(0);
+            } else if (source == MAX_FLOWS + 1) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0
+                    && errno != EAGAIN)
+                    printf("WARN: Reading the relay timer failed. %s\n",
+                           strerror(errno));
+            } else if (source == 0) {
+                receive_all(listen_fd, -1, epoll_fd);
+            } else {
+                receive_all(flows[source - 1].upstream_fd, source - 1,
+                            epoll_fd);
+            }
+        }
+
+        release_due(listen_fd, &server_addr, monotonic_now());
+        arm_release_timer(timer_fd);
+    }
+}
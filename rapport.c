@@ -0,0 +1,339 @@
+#define _XOPEN_SOURCE 600
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include "rapport.h"
+
+/* Weight of the newest rapport in the smoothed drift and RTT. */
+#define SCHEDULER_GAIN 0.25
+
+/* Deviations of RTT noise covered by the predicted error. */
+#define SCHEDULER_RTT_DEVIATIONS 2
+
+/* Mean deviations above the lowest RTT that a sample may reach. */
+#define FILTER_RTT_DEVIATIONS 3
+
+microts server_residence(server_sample *sample) {
+    return sample->server_transmit - sample->server_receive;
+}
+
+void estimate_rapport(scspec *soft_clock, server_sample *sample,
+                      microts *est_server_time, microts *response_local_time,
+                      microts *response_local_hardware_time) {
+    /* for now, pretend min = server_clock.error */
+    /* microts min = server_clock.error;*/
+    microts request_local_time, request_local_hardware_time;
+
+    virtual_hardware_clock_at(soft_clock->vhclock, sample->sent_at,
+                              &request_local_hardware_time);
+    virtual_hardware_clock_at(soft_clock->vhclock, sample->received_at,
+                              response_local_hardware_time);
+    software_clock_at(soft_clock, request_local_hardware_time,
+                      &request_local_time);
+    software_clock_at(soft_clock, *response_local_hardware_time,
+                      response_local_time);
+
+    /* server time is in the interval [T + min, T + 2D - min]
+       best estimate (middle of interval) is T + D, where 2D is the
+       round trip minus the time spent inside the server */
+    microts rtt = *response_local_time - request_local_time
+        - server_residence(sample);
+    *est_server_time = sample->server_transmit + rtt/2;
+}
+
+microts sample_rtt(server_sample *sample) {
+    return sample->received_at - sample->sent_at - server_residence(sample);
+}
+
+/* An end of one answer's offset interval, for Marzullo's sweep. */
+typedef struct interval_edge {
+    double offset;
+    int type; /* +1 opens an interval, -1 closes one */
+} interval_edge;
+
+static int compare_edges(const void *a, const void *b) {
+    const interval_edge *x = a, *y = b;
+    if (x->offset != y->offset)
+        return (x->offset > y->offset) - (x->offset < y->offset);
+    /* Opening before closing counts intervals that only touch. */
+    return y->type - x->type;
+}
+
+int combine_rapports(scspec *soft_clock, rapport_estimate *estimates,
+                     int count, rapport_estimate *combined) {
+    interval_edge edges[2 * MAX_SERVERS];
+    int best = 0;
+    double low = 0, high = 0;
+
+    for (int i = 0; i < count; ++i) {
+        rapport_estimate *e = &estimates[i];
+        double offset = e->est_server_time - e->response_local_hardware_time;
+        double half = e->rtt > 0 ? e->rtt / 2.0 : 0;
+        edges[2 * i] = (interval_edge) { offset - half, +1 };
+        edges[2 * i + 1] = (interval_edge) { offset + half, -1 };
+        e->survivor = 0;
+    }
+    qsort(edges, 2 * count, sizeof(interval_edge), compare_edges);
+
+    /* The first range covered by the most intervals */
+    for (int i = 0, depth = 0; i < 2 * count; ++i) {
+        depth += edges[i].type;
+        if (depth > best) {
+            best = depth;
+            low = edges[i].offset;
+            high = edges[i + 1].offset;
+        }
+    }
+
+    if (2 * best <= count && count > 1)
+        return 0;
+
+    double weights = 0, offset = 0;
+    int newest = -1, survivors = 0;
+    microts survivor_rtt = LLONG_MAX;
+    for (int i = 0; i < count; ++i) {
+        rapport_estimate *e = &estimates[i];
+        double center = e->est_server_time - e->response_local_hardware_time;
+        double half = e->rtt > 0 ? e->rtt / 2.0 : 0;
+        if (center + half < low || center - half > high)
+            continue;
+
+        e->survivor = 1;
+        ++survivors;
+        double rtt = e->rtt > 1 ? e->rtt : 1;
+        if (e->rtt < survivor_rtt)
+            survivor_rtt = e->rtt;
+        weights += 1 / (rtt * rtt);
+        offset += center / (rtt * rtt);
+        if (newest < 0 || e->response_local_hardware_time
+            > estimates[newest].response_local_hardware_time)
+            newest = i;
+    }
+
+    /* A lone survivor is taken as is. */
+    *combined = estimates[newest];
+    if (survivors == 1)
+        return 1;
+
+    combined->est_server_time = combined->response_local_hardware_time
+        + llrint(offset / weights);
+    software_clock_at(soft_clock, combined->response_local_hardware_time,
+                      &combined->response_local_time);
+    combined->rtt = survivor_rtt;
+    return survivors;
+}
+
+void rapport_filter_init(rapport_filter *f, int window) {
+    f->window = window;
+    f->count = 0;
+    f->next = 0;
+    f->offered = 0;
+    f->rejected = 0;
+    f->rtt = 0;
+    f->rtt_deviation = 0;
+}
+
+int rapport_filter_add(rapport_filter *f, rapport_estimate *sample) {
+    if (f->offered++ == 0) {
+        f->rtt = sample->rtt;
+    } else {
+        f->rtt_deviation += SCHEDULER_GAIN
+            * (fabs(sample->rtt - f->rtt) - f->rtt_deviation);
+        f->rtt += SCHEDULER_GAIN * (sample->rtt - f->rtt);
+    }
+
+    /* Only judge samples once a window's worth has been offered, and
+       against the offers rather than the window, so that a lasting rise
+       in delay ages the old low RTTs out. */
+    int full = f->offered > (unsigned long) f->window;
+    microts min_rtt = LLONG_MAX;
+    for (int i = 0; full && i < f->window; ++i) {
+        if (f->offered_rtt[i] < min_rtt)
+            min_rtt = f->offered_rtt[i];
+    }
+    f->offered_rtt[(f->offered - 1) % f->window] = sample->rtt;
+    if (full
+        && sample->rtt > min_rtt + FILTER_RTT_DEVIATIONS * f->rtt_deviation) {
+        ++f->rejected;
+        return 0;
+    }
+
+    f->samples[f->next] = *sample;
+    f->next = (f->next + 1) % f->window;
+    if (f->count < f->window)
+        ++f->count;
+    return 1;
+}
+
+int rapport_filter_select(rapport_filter *f, scspec *soft_clock,
+                          microts vhc_time, double drift_error,
+                          rapport_estimate *selected) {
+    int best = -1;
+    double best_bound = 0;
+    for (int i = 0; i < f->count; ++i) {
+        rapport_estimate *e = &f->samples[i];
+        double bound = e->rtt / 2.0 + (double) (vhc_time
+            - e->response_local_hardware_time) * drift_error / MILLION;
+        if (best < 0 || bound < best_bound) {
+            best = i;
+            best_bound = bound;
+        }
+    }
+    if (best < 0)
+        return -1;
+
+    *selected = f->samples[best];
+    if (selected->response_local_hardware_time == vhc_time)
+        return 0;
+
+    /* Carry the server - VHC offset forward at the corrected frequency. */
+    microts age = vhc_time - selected->response_local_hardware_time;
+    selected->est_server_time += age
+        + llrint(soft_clock->frequency * age / MILLION);
+    selected->response_local_hardware_time = vhc_time;
+    software_clock_at(soft_clock, vhc_time, &selected->response_local_time);
+    return 0;
+}
+
+void frequency_estimator_init(frequency_estimator *f, int window) {
+    f->window = window;
+    f->count = 0;
+    f->next = 0;
+    f->uncertainty = UNKNOWN_DRIFT_PPM;
+}
+
+int frequency_estimator_add(frequency_estimator *f, microts est_server_time,
+                            microts response_local_hardware_time,
+                            double *frequency) {
+    f->vhc[f->next] = response_local_hardware_time;
+    f->offset[f->next] = est_server_time - response_local_hardware_time;
+    f->next = (f->next + 1) % f->window;
+    if (f->count < f->window)
+        ++f->count;
+    if (f->count < MIN_FREQUENCY_RAPPORTS)
+        return -1;
+
+    /* Center on the newest pair so the sums stay small. */
+    double mean_x = 0, mean_y = 0;
+    for (int i = 0; i < f->count; ++i) {
+        mean_x += f->vhc[i] - response_local_hardware_time;
+        mean_y += f->offset[i];
+    }
+    mean_x /= f->count;
+    mean_y /= f->count;
+
+    double sxx = 0, sxy = 0;
+    for (int i = 0; i < f->count; ++i) {
+        double x = f->vhc[i] - response_local_hardware_time - mean_x;
+        sxx += x * x;
+        sxy += x * (f->offset[i] - mean_y);
+    }
+    if (sxx <= 0)
+        return -1;
+    double slope = sxy / sxx;
+    *frequency = slope * MILLION;
+
+    /* Standard error of the slope from the scatter about the line. */
+    double residuals = 0;
+    for (int i = 0; i < f->count; ++i) {
+        double x = f->vhc[i] - response_local_hardware_time - mean_x;
+        double r = f->offset[i] - mean_y - slope * x;
+        residuals += r * r;
+    }
+    f->uncertainty = 2 * sqrt(residuals / (f->count - 2) / sxx) * MILLION;
+    return 0;
+}
+
+void rapport_scheduler_init(rapport_scheduler *r, microts target_error,
+                            microts min_period, microts max_period,
+                            microts initial_period, microts amortization) {
+    r->target_error = target_error;
+    r->min_period = min_period;
+    r->max_period = max_period;
+    r->amortization = amortization;
+    r->floor = 0;
+    r->period = initial_period < min_period ? min_period
+        : initial_period > max_period ? max_period : initial_period;
+    r->rapports = 0;
+    r->drift = 0;
+    r->drift_offset = 0;
+    r->drift_elapsed = 0;
+    r->rtt = 0;
+    r->rtt_deviation = 0;
+    r->correction = 0;
+}
+
+microts rapport_scheduler_update(rapport_scheduler *r, server_sample *sample,
+                                 microts est_server_time,
+                                 microts response_local_hardware_time,
+                                 double frequency) {
+    microts rtt = sample_rtt(sample);
+    microts offset = est_server_time - response_local_hardware_time;
+
+    if (r->rapports == 0) {
+        r->rtt = rtt;
+    } else {
+        r->rtt_deviation += SCHEDULER_GAIN
+            * (fabs(rtt - r->rtt) - r->rtt_deviation);
+        r->rtt += SCHEDULER_GAIN * (rtt - r->rtt);
+
+        /* Offset change over elapsed time, with older intervals fading
+           out. Long intervals weigh more, as their RTT noise is spread
+           over more drift. */
+        microts elapsed = response_local_hardware_time - r->last_vhc;
+        r->drift_offset = (1 - SCHEDULER_GAIN) * r->drift_offset
+            + (offset - r->last_offset);
+        r->drift_elapsed = (1 - SCHEDULER_GAIN) * r->drift_elapsed + elapsed;
+        if (r->drift_elapsed > 0)
+            r->drift = r->drift_offset * MILLION / r->drift_elapsed;
+
+        /* What the frequency correction did not foresee, the rapport
+           corrects, amortized over the following amortization period. */
+        double correction = fabs(offset - r->last_offset
+                                 - frequency * elapsed / MILLION);
+        r->correction += SCHEDULER_GAIN * (correction - r->correction);
+    }
+    r->last_vhc = response_local_hardware_time;
+    r->last_offset = offset;
+    ++r->rapports;
+
+    /* Without a drift estimate yet, keep the current period. */
+    if (r->rapports < 2)
+        return r->period;
+
+    /* Half the RTT noise lands on the offset of each rapport, and on both
+       ends of each drift measurement. Drift is in usec per usec here. */
+    double noise = SCHEDULER_RTT_DEVIATIONS * r->rtt_deviation / 2;
+    double drift = fabs(r->drift - frequency) / MILLION;
+    if (r->drift_elapsed > 0)
+        drift += 2 * noise / r->drift_elapsed;
+
+    /* The error before the next rapport is noise + drift * period, plus
+       correction * (1 - period / amortization) while the last correction
+       is still being amortized. It is least at the shortest period or at
+       the amortization period, whichever is lower. */
+    double floor = noise;
+    if (r->amortization > 0)
+        floor += fmin(r->correction, drift * r->amortization);
+    if (floor > r->target_error) {
+        r->floor = floor;
+        return r->period;
+    }
+    r->floor = 0;
+
+    double budget = r->target_error - noise;
+    double period = drift > 0 ? budget / drift : r->max_period;
+    if (period < r->amortization) {
+        double slope = drift - r->correction / r->amortization;
+        period = slope > 0 ? (budget - r->correction) / slope : 0;
+    }
+
+    if (period > 2 * r->period)
+        period = 2 * r->period;
+    if (period > r->max_period)
+        period = r->max_period;
+    if (period < r->min_period)
+        period = r->min_period;
+    r->period = period;
+    return r->period;
+}
@@ -0,0 +1,205 @@
+#include "sclock.h"
+#ifndef RAPPORT_H
+#define RAPPORT_H
+
+/* One exchange with the server, NTP style.
+   sent_at and received_at are on the real hardware clock timeline;
+   server_receive and server_transmit are on the server's clock.
+   Version 1 servers report a single timestamp, stored in both. */
+typedef struct server_sample {
+    microts sent_at;
+    microts server_receive;
+    microts server_transmit;
+    microts received_at;
+} server_sample;
+
+/* Time the query spent inside the server, which is not network delay. */
+microts server_residence(server_sample *sample);
+
+/* Estimate the server time at the arrival of a rapport reply, along with
+   the software and hardware clock values at that same instant. Shared by
+   the client and the simulator so both follow the same rapport logic. */
+void estimate_rapport(scspec *soft_clock, server_sample *sample,
+                      microts *est_server_time, microts *response_local_time,
+                      microts *response_local_hardware_time);
+
+/* One server's answer to a rapport, as estimate_rapport computes it, with
+   the network RTT of the exchange. */
+typedef struct rapport_estimate {
+    microts est_server_time;
+    microts response_local_time;
+    microts response_local_hardware_time;
+    microts rtt;
+    /* Set by combine_rapports: 1 if the estimate was used */
+    int survivor;
+} rapport_estimate;
+
+/* Servers a client can query at once. */
+#define MAX_SERVERS 8
+
+/* Network RTT of one exchange, on the real hardware clock. */
+microts sample_rtt(server_sample *sample);
+
+/* Combine the answers of several servers to one rapport.
+
+   Each answer bounds the server - VHC offset to within RTT/2 of its
+   estimate. Marzullo's algorithm finds the offset range that the most
+   answers agree on; answers whose bounds miss it are falsetickers. The
+   survivors are averaged with weights 1/RTT^2, so a slow or jittery server
+   counts for little. The result is stated at the VHC time of the newest
+   survivor. Returns the number of survivors, or 0 if no majority of the
+   answers agrees, in which case combined is left alone. */
+int combine_rapports(scspec *soft_clock, rapport_estimate *estimates,
+                     int count, rapport_estimate *combined);
+
+/* Best-of-N rapport filter.
+
+   A single rapport sample is only as good as its RTT: half of any delay
+   asymmetry lands on the offset. The filter keeps the last `window`
+   samples (optionally several per rapport, sent as a burst) and picks the
+   one with the least error bound: RTT/2 plus its age times the
+   uncertainty of the drift estimate, so a slightly older low-delay sample
+   beats a fresh congested one. The chosen offset is carried forward to
+   the present with the software clock's frequency correction, so a window
+   needs the frequency fit (see frequency_estimator) to carry samples
+   forward at the measured drift.
+
+   Samples slower than a learned threshold, the lowest RTT among the last
+   `window` samples offered plus FILTER_RTT_DEVIATIONS mean deviations of
+   RTT, are not let into the window at all. Rejected samples count towards
+   that lowest RTT too, so the threshold follows the network within one
+   window if it settles at a higher delay. */
+#define MAX_RAPPORT_WINDOW 32
+#define MAX_RAPPORT_BURST 8
+
+/* Rapports in the frequency fit when a window turns it on. */
+#define FILTER_FREQUENCY_WINDOW 16
+
+typedef struct rapport_filter {
+    int window;
+    /* Samples held, and the slot of the next one */
+    int count;
+    int next;
+    rapport_estimate samples[MAX_RAPPORT_WINDOW];
+    /* RTTs of the last `window` samples offered, admitted or not */
+    microts offered_rtt[MAX_RAPPORT_WINDOW];
+
+    /* Every sample offered, and those kept out by the threshold */
+    unsigned long offered;
+    unsigned long rejected;
+    /* RTT mean and mean deviation over all samples offered (usec) */
+    double rtt;
+    double rtt_deviation;
+} rapport_filter;
+
+/* window must be between 1 and MAX_RAPPORT_WINDOW. */
+void rapport_filter_init(rapport_filter *f, int window);
+
+/* Offer one sample. Returns 1 if it entered the window, 0 if it was
+   rejected as too slow. */
+int rapport_filter_add(rapport_filter *f, rapport_estimate *sample);
+
+/* Pick the best sample in the window and restate it at VHC time vhc_time
+   (normally that of the newest sample). drift_error is how far, in PPM,
+   the software clock's frequency correction may be from the true drift
+   (see frequency_estimator). Returns -1 if the window is empty. */
+int rapport_filter_select(rapport_filter *f, scspec *soft_clock,
+                          microts vhc_time, double drift_error,
+                          rapport_estimate *selected);
+
+/* Frequency correction for the software clock.
+
+   The offset between the server and the VHC, measured at each rapport,
+   grows at the relative drift of the two clocks. The estimator fits a
+   least-squares line to the last `window` (VHC, offset) pairs; its slope
+   is the frequency correction the software clock should apply between
+   rapports (software_clock_set_frequency). Two standard errors of the
+   slope bound how far the correction may be from the true drift. */
+#define MAX_FREQUENCY_WINDOW 64
+
+/* Rapports the fit needs before it gives an estimate. */
+#define MIN_FREQUENCY_RAPPORTS 4
+
+/* Drift error assumed before the fit has an estimate, in PPM: about the
+   worst relative drift of two crystal oscillators. */
+#define UNKNOWN_DRIFT_PPM 100
+
+typedef struct frequency_estimator {
+    int window;
+    /* Pairs held, and the slot of the next one */
+    int count;
+    int next;
+    microts vhc[MAX_FREQUENCY_WINDOW];
+    microts offset[MAX_FREQUENCY_WINDOW];
+    /* Bound on the error of the last estimate, in PPM */
+    double uncertainty;
+} frequency_estimator;
+
+/* window must be between MIN_FREQUENCY_RAPPORTS and MAX_FREQUENCY_WINDOW. */
+void frequency_estimator_init(frequency_estimator *f, int window);
+
+/* Add the result of one rapport (as from estimate_rapport). Returns 0 and
+   sets *frequency, in PPM, once the fit has enough rapports, -1 before. */
+int frequency_estimator_add(frequency_estimator *f, microts est_server_time,
+                            microts response_local_hardware_time,
+                            double *frequency);
+
+/* Adaptive rapport period.
+
+   Between rapports the software clock drifts from the server at the
+   relative drift of the two clocks, so the error just before a rapport is
+   about |drift| * period on top of the uncertainty of the rapport itself.
+   The scheduler estimates the drift from the offsets measured by
+   successive rapports and the uncertainty from the spread of their RTTs.
+   Only the drift left over after the software clock's frequency
+   correction counts, widened by the noise of the two offsets each drift
+   measurement spans. A period shorter than the amortization period also
+   leaves part of the last correction unapplied, so the prediction adds
+   the typical correction times the fraction of it still to come.
+
+   The scheduler picks the longest period whose predicted error stays
+   within target_error. Periods only double from one rapport to the next
+   but shrink at once, and always stay within [min_period, max_period].
+   If no period can meet the target, the period is left as it is and
+   floor records the least error the scheduler could promise. */
+static const microts RAPPORT_MIN_PERIOD = 100000;
+static const microts RAPPORT_MAX_PERIOD = 64000000;
+
+typedef struct rapport_scheduler {
+    microts target_error;
+    microts min_period;
+    microts max_period;
+    microts amortization;
+    /* The period until the next rapport. */
+    microts period;
+    /* Least predicted error (usec) when it exceeds target_error, else 0 */
+    double floor;
+
+    int rapports;
+    /* VHC time and server - VHC offset at the last rapport */
+    microts last_vhc;
+    microts last_offset;
+    /* Smoothed relative drift (PPM), from decayed sums of offset change
+       and elapsed VHC time, and RTT mean and mean deviation (usec) */
+    double drift;
+    double drift_offset;
+    double drift_elapsed;
+    double rtt;
+    double rtt_deviation;
+    /* Smoothed size of the offset correction each rapport makes (usec) */
+    double correction;
+} rapport_scheduler;
+
+void rapport_scheduler_init(rapport_scheduler *r, microts target_error,
+                            microts min_period, microts max_period,
+                            microts initial_period, microts amortization);
+
+/* Feed the result of one rapport (as from estimate_rapport, with the
+   sample it came from) and the frequency correction of the software clock
+   after it. Returns the new period. */
+microts rapport_scheduler_update(rapport_scheduler *r, server_sample *sample,
+                                 microts est_server_time,
+                                 microts response_local_hardware_time,
+                                 double frequency);
+
+#endif // RAPPORT_H
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include "ratelimit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* Fibonacci hashing: the high half of the product mixes every bit of
+   address and port. */
+static size_t client_slot(const client_table *table, uint32_t address,
+                          uint16_t port) {
+    uint64_t key = ((uint64_t) port << 32) | address;
+    return (size_t) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & table->mask;
+}
+
+int client_table_init(client_table *table, size_t capacity, double rate,
+                      int burst) {
+    memset(table, 0, sizeof(*table));
+    if (rate <= 0 || burst < 1)
+        return -1;
+
+    size_t size = CLIENT_PROBE;
+    while (size < capacity)
+        size <<= 1;
+
+    /* Cache line aligned, so no entry straddles two lines. */
+    void *entries;
+    if (posix_memalign(&entries, 64, size * sizeof(client_entry)) != 0)
+        return -1;
+    memset(entries, 0, size * sizeof(client_entry));
+
+    table->entries = entries;
+    table->mask = size - 1;
+    table->interval = (microts) (1000000 / rate);
+    if (table->interval < 1)
+        table->interval = 1;
+    table->tolerance = (burst - 1) * table->interval;
+    return 0;
+}
+
+void client_table_free(client_table *table) {
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+int client_table_admit(client_table *table, uint32_t address, uint16_t port,
+                       uint32_t sequence_number, microts now) {
+    size_t slot = client_slot(table, address, port);
+    client_entry *entry = NULL;
+    client_entry *oldest = NULL;
+    for (int i = 0; i < CLIENT_PROBE; ++i) {
+        client_entry *e = &table->entries[(slot + i) & table->mask];
+        if (!e->in_use || (e->address == address && e->port == port)) {
+            entry = e;
+            break;
+        }
+        if (oldest == NULL || e->due < oldest->due)
+            oldest = e;
+    }
+
+    if (entry == NULL) {
+        entry = oldest;
+        entry->in_use = 0;
+        ++table->evictions;
+    }
+
+    /* A new client starts with a full bucket. */
+    if (!entry->in_use) {
+        memset(entry, 0, sizeof(*entry));
+        entry->address = address;
+        entry->port = port;
+        entry->in_use = 1;
+        entry->due = now;
+    }
+
+    ++entry->queries;
+    entry->last_sequence = sequence_number;
+
+    /* An idle client's bucket refills up to burst tokens and no further. */
+    if (entry->due < now)
+        entry->due = now;
+    if (entry->due - now > table->tolerance) {
+        ++entry->drops;
+        return 0;
+    }
+    entry->due += table->interval;
+    return 1;
+}
+
+void client_table_dump(const client_table *table, const char *label,
+                       FILE *out) {
+    for (size_t i = 0; i <= table->mask; ++i) {
+        client_entry entry = table->entries[i];
+        if (!entry.in_use)
+            continue;
+
+        char ip[INET_ADDRSTRLEN];
+        struct in_addr address = { .s_addr = entry.address };
+        inet_ntop(AF_INET, &address, ip, sizeof(ip));
+        fprintf(out, "%s,%s,%u,%lu,%u,%u\n", label, ip, ntohs(entry.port),
+                (unsigned long) entry.queries, entry.drops,
+                entry.last_sequence);
+    }
+}
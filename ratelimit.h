@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "sclock.h"
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/* Per-client state for the server: a fixed-size open-addressing hash table
+   keyed by client address and port, holding a token bucket and counters
+   for each client. Every entry is allocated up front, so the hot path
+   never allocates and never takes a lock. A table belongs to one server
+   thread. SO_REUSEPORT sends every datagram of a flow to the same socket,
+   so each client only ever shows up in one thread's table.
+
+   A bucket is kept in its virtual scheduling form (the GCRA of ATM
+   traffic shaping): rather than a token count and a refill time, an entry
+   holds the time `due` at which its bucket would be full again. A query
+   at `now` takes a token if due - now is at most the burst tolerance, and
+   then pushes due one interval later. That is one comparison and one add,
+   with no division and no refill arithmetic.
+
+   A client lives in one of CLIENT_PROBE consecutive slots from its hash.
+   When they are all taken by other clients, the new one replaces the
+   entry with the earliest due, the client idle longest. If that bucket
+   is already full, the eviction forgets nothing but its counters. The
+   bounded window keeps a lookup within a few cache lines however the
+   table fills. */
+
+/* Slots searched per lookup: 256 bytes, four cache lines. */
+#define CLIENT_PROBE 8
+
+/* One client. 32 bytes, so two share a cache line. Address and port are
+   kept in network order, as recvfrom returns them. */
+typedef struct client_entry {
+    /* server clock value at which the bucket is full again */
+    microts due;
+    /* valid queries received, including dropped ones */
+    uint64_t queries;
+    uint32_t address;
+    uint16_t port;
+    uint16_t in_use;
+    /* queries dropped for exceeding the rate */
+    uint32_t drops;
+    /* sequence number of the latest query */
+    uint32_t last_sequence;
+} client_entry;
+
+typedef struct client_table {
+    client_entry *entries;
+    size_t mask;
+    /* server clock time per token, and how far ahead of now due may run */
+    microts interval;
+    microts tolerance;
+    /* clients that replaced another client's entry */
+    unsigned long evictions;
+} client_table;
+
+/* Allocate a table of at least capacity entries (rounded up to a power of
+   two) whose buckets refill at rate tokens per second and hold up to burst
+   tokens. Returns 0, or -1 if the arguments are out of range or the
+   allocation fails. */
+int client_table_init(client_table *table, size_t capacity, double rate,
+                      int burst);
+void client_table_free(client_table *table);
+
+/* Account for a valid query from address:port received at server clock
+   time now. Returns 1 if it should be answered and 0 if it exceeds the
+   client's rate and should be dropped. */
+int client_table_admit(client_table *table, uint32_t address, uint16_t port,
+                       uint32_t sequence_number, microts now);
+
+/* Write one CSV row per client: label, address, port, queries, drops and
+   last sequence number. Rows are read while the owning thread keeps
+   serving, so a row may mix values from before and after a query. */
+void client_table_dump(const client_table *table, const char *label,
+                       FILE *out);
+
+#endif // RATELIMIT_H
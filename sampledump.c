@@ -0,0 +1,49 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "samplelog.h"
+
+/* Print a binary sample log (client --sample-log) as the client's CSV
+   output, starting at the line processor.py looks for. */
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("Usage: sampledump [sample log]\n");
+        exit(1);
+    }
+
+    sample_log_header header;
+    FILE *log = sample_log_open(argv[1], &header);
+    if (log == NULL) {
+        printf("FATAL: %s is not a readable sample log.\n", argv[1]);
+        exit(1);
+    }
+
+    printf("Server Drift: %.2f PPM, Client VHC Drift: %.2f PPM\n",
+           header.server_drift, header.local_vhc_drift);
+    printf("Relative Drift Weight: %.2f\n", header.relative_drift);
+    printf("Rapport Period: %ld\n", header.rapport_period);
+    printf("Amortization Period: %ld\n", header.amortization_period);
+    printf("====== SIMULATION OUTPUT START =====\n");
+    printf("Current Real Time,Real Time Elapsed (sec),Local Server Time,Hardware Clock Time,\
+Software Clock Time,Error,Remote Est Time,\n");
+
+    sample_record r;
+    while (sample_log_read(log, &r) == 0) {
+        double real_time_elapsed =
+            (double) (r.real_time - header.start_time) / (double) MILLION;
+
+        if (!(r.flags & SAMPLE_RAPPORT))
+            printf("%ld,%.5f,%ld,%ld,%ld,%ld,,\n",
+                   r.real_time, real_time_elapsed, r.local_server_time,
+                   r.hardware_clock_time, r.software_clock_time, r.error);
+        else
+            printf("%ld,%.5f,%ld,%ld,%ld,%ld,%ld,\n",
+                   r.real_time, real_time_elapsed, r.local_server_time,
+                   r.hardware_clock_time, r.software_clock_time, r.error,
+                   r.remote_est_time);
+    }
+
+    fclose(log);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include "samplelog.h"
+
+/* Records are small, so a large buffer keeps fwrite from making a
+   syscall per row. */
+#define SAMPLE_LOG_BUFFER_SIZE (1 << 16)
+
+FILE *sample_log_create(const char *path, sample_log_header *header) {
+    FILE *log = fopen(path, "wb");
+    if (log == NULL)
+        return NULL;
+    setvbuf(log, NULL, _IOFBF, SAMPLE_LOG_BUFFER_SIZE);
+
+    header->magic = SAMPLE_LOG_MAGIC;
+    header->version = SAMPLE_LOG_VERSION;
+    header->record_size = sizeof(sample_record);
+    header->reserved = 0;
+    if (fwrite(header, sizeof(*header), 1, log) != 1) {
+        fclose(log);
+        return NULL;
+    }
+    return log;
+}
+
+FILE *sample_log_open(const char *path, sample_log_header *header) {
+    FILE *log = fopen(path, "rb");
+    if (log == NULL)
+        return NULL;
+
+    if (fread(header, sizeof(*header), 1, log) != 1
+        || header->magic != SAMPLE_LOG_MAGIC
+        || header->version != SAMPLE_LOG_VERSION
+        || header->record_size != sizeof(sample_record)) {
+        fclose(log);
+        return NULL;
+    }
+    return log;
+}
+
+int sample_log_write(FILE *log, const sample_record *record) {
+    return fwrite(record, sizeof(*record), 1, log) == 1 ? 0 : -1;
+}
+
+int sample_log_read(FILE *log, sample_record *record) {
+    return fread(record, sizeof(*record), 1, log) == 1 ? 0 : -1;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "sclock.h"
+#ifndef SAMPLELOG_H
+#define SAMPLELOG_H
+
+/* Binary sample log written by the client with --sample-log.
+
+   A header followed by one fixed-size record per output row, both in host
+   byte order. Each record holds exactly the columns of the CSV output;
+   Real Time Elapsed is real_time - header.start_time. sampledump turns a
+   log back into the CSV that processor.py reads. */
+
+#define SAMPLE_LOG_MAGIC 0x43534C47 /* "CSLG" */
+#define SAMPLE_LOG_VERSION 1
+
+/* The row was printed at a rapport and remote_est_time is valid. */
+#define SAMPLE_RAPPORT 0x1
+
+typedef struct sample_log_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    microts start_time;
+    microts rapport_period;
+    microts amortization_period;
+    microts print_period;
+    double server_drift;
+    double local_vhc_drift;
+    double relative_drift;
+} sample_log_header;
+
+typedef struct sample_record {
+    microts real_time;
+    microts local_server_time;
+    microts hardware_clock_time;
+    microts software_clock_time;
+    microts error;
+    microts remote_est_time;
+    uint32_t flags;
+    uint32_t reserved;
+} sample_record;
+
+/* Create the log at path and write header, filling in its magic, version
+   and record size. Returns NULL on failure. */
+FILE *sample_log_create(const char *path, sample_log_header *header);
+
+/* Open the log at path and read its header. Returns NULL if the file
+   cannot be read or is not a sample log of this version. */
+FILE *sample_log_open(const char *path, sample_log_header *header);
+
+/* Returns 0 on success. Writes go through stdio buffering. */
+int sample_log_write(FILE *log, const sample_record *record);
+
+/* Returns 0 and reads the next record, or -1 at the end of the log. */
+int sample_log_read(FILE *log, sample_record *record);
+
+#endif // SAMPLELOG_H
@@ -0,0 +1,36 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include "../shmclock.h"
+
+/* Reads a software clock published by `client --publish NAME` and reports
+   how long one read takes. Build with: cc -std=c99 shm_reader.c -lm -lrt */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: shm_reader [shared memory name]\n");
+        exit(1);
+    }
+
+    const shmclock_page *page;
+    if (shmclock_open(argv[1], &page) != 0) {
+        printf("Could not open published clock %s.\n", argv[1]);
+        exit(1);
+    }
+
+    const int READS = 1000000;
+    microts value;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    for (int i = 0; i < READS; ++i) {
+        if (shmclock_gettime(page, &value) != 0) {
+            printf("Nothing has been published yet.\n");
+            exit(1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) * 1e9
+        + (end.tv_nsec - start.tv_nsec);
+    printf("Software clock: %ld\n", value);
+    printf("Read cost: %.1f nsec\n", elapsed / READS);
+}
@@ -6,45 +6,49 @@
 #include "sclock.h"
 #include <time.h>
 #include <math.h>
+#include <string.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define SCLOCK_HAVE_TSC 1
+#endif
+
+/* Strict XOPEN builds expose SO_TIMESTAMPNS but not its cmsg alias. */
+#ifndef SCM_TIMESTAMPNS
+#define SCM_TIMESTAMPNS SO_TIMESTAMPNS
+#endif
+#ifndef SCM_TIMESTAMPING
+#define SCM_TIMESTAMPING SO_TIMESTAMPING
+#endif
 
 int software_clock_gettime(scspec *s, microts *result) {
     microts vhc_time;
     if (virtual_hardware_clock_gettime(s->vhclock, &vhc_time) != 0)
         return -1;
 
-    double multiplier;
-    microts offset;
-
-    /* If amortization has complete, offset is N = L' - H'
-       where L' is the local time after amortization and
-       H' is the hardware clock value after amortization.
-       L' = M + a, H' = H + a */
-
-    if (s->rapport_vhc + s->amortization_period <= vhc_time) {
-        multiplier = 0.0;
-        offset = (s->rapport_master + s->amortization_period) -
-            (s->rapport_vhc + s->amortization_period);
-
-    } else {
-        /* printf("s->rapport_master: %ld, s->rapport_local: %ld, diff: %lf\n", */
-        /*        s->rapport_master, s->rapport_local, */
-        /*        (double) (s->rapport_master - s->rapport_local)); */
-        // m = (M - L)/a
-        multiplier = ((double) (s->rapport_master - s->rapport_local)) /
-            ((double) s->amortization_period);
-
-        // N = L - (1 + m) * H
-        offset = llrint(s->rapport_local - ((1 + multiplier) * s->rapport_vhc));
-    }
-
-    //printf("Multiplier: %lf, Offset: %ld\n", multiplier, offset);
+    return software_clock_at(s, vhc_time, result);
+}
 
-    // L = H * (1 + m) + N
-    *result = llrint(vhc_time * (1 + multiplier)) + offset;
+/* Compute the software clock value for a given virtual hardware clock value.
+   Lets a caller translate a timestamp taken earlier (e.g. by the kernel)
+   instead of reading the clock now. */
+int software_clock_at(scspec *s, microts vhc_time, microts *result) {
+    *result = software_clock_value(s, vhc_time);
     return 0;
 }
 
+/* Set the frequency correction, in PPM, for both arithmetic paths. Call it
+   right after a rapport, as the correction runs from rapport_vhc on. */
+void software_clock_set_frequency(scspec *s, double frequency) {
+    s->frequency = frequency;
+    s->frequency_fixed = drift_rate_to_fixed(frequency);
+}
+
 /* Read the value of the virtual hardware clock.
    The VHC's value is computed as the real time + drift since initialization.
    Total drift = (time elapsed / 1*10^6) * PPM */
@@ -53,19 +57,12 @@ int virtual_hardware_clock_gettime(vhspec *v, microts *result) {
     if (real_hardware_clock_gettime(&real_time) != 0)
         return -1;
 
-    microts elapsed_time = (real_time) - (v->initial_value);
-
-    /* compute whole_drift as drift expressed in whole numbers */
-    double whole_drift = (((microts) elapsed_time / (microts) MILLION))
-        * (v->drift_rate);
-
-    /* partial_drift is drift that occurs while a second has not fully elapsed.
-       To preserve VHC continuity, we have to account for drift that has occured
-       during the partial second that has elapsed. */
-    double fraction_of_second = ((double) (elapsed_time % MILLION)) / MILLION;
-    double partial_drift = fraction_of_second * v->drift_rate;
+    return virtual_hardware_clock_at(v, real_time, result);
+}
 
-    *result = elapsed_time + llrint((whole_drift + partial_drift)) + v->offset;
+/* Compute the VHC value at a given real hardware clock value. */
+int virtual_hardware_clock_at(vhspec *v, microts real_time, microts *result) {
+    *result = virtual_hardware_clock_value(v, real_time);
     return 0;
 }
 
@@ -73,19 +70,214 @@ int virtual_hardware_clock_init(vhspec *v) {
     microts real_time;
     if (real_hardware_clock_gettime(&real_time) != 0)
         return -1;
-    
+
+    return virtual_hardware_clock_init_at(v, real_time);
+}
+
+/* Start the VHC at the given real time instead of now. Used by the
+   simulator, where real time is virtual. */
+int virtual_hardware_clock_init_at(vhspec *v, microts real_time) {
     v->initial_value = real_time;
+    v->drift_fixed = drift_rate_to_fixed(v->drift_rate);
     return 0;
 }
 
-int real_hardware_clock_gettime(microts *result) {
+/* The real hardware clock reads one of two sources on the same timeline:
+   CLOCK_MONOTONIC_RAW itself, or the CPU's invariant TSC scaled to
+   nanoseconds with a rate calibrated against CLOCK_MONOTONIC_RAW.
+   The source is chosen once at startup, before any other thread runs. */
+static int clock_source = CLOCK_SOURCE_MONOTONIC_RAW;
+
+static const char *CLOCK_SOURCE_NAMES[] = { "monotonic", "tsc" };
+
+/* ns = base_ns + ((tsc - base_tsc) * mult) >> TSC_SHIFT */
+#define TSC_SHIFT 32
+static uint64_t tsc_base = 0;
+static nanots tsc_base_ns = 0;
+static uint64_t tsc_mult = 0;
+
+static int monotonic_raw_gettime_ns(nanots *result) {
     struct timespec monotonic;
     if (clock_gettime(CLOCK_MONOTONIC_RAW, &monotonic) != 0) {
         return -1;
     }
-    
-    unsigned long init_sec = monotonic.tv_sec * MILLION;
-    unsigned long init_microsec = monotonic.tv_nsec / 1000;
-    *result = init_sec + init_microsec;
+
+    *result = monotonic.tv_sec * (nanots) 1000000000 + monotonic.tv_nsec;
+    return 0;
+}
+
+#ifdef SCLOCK_HAVE_TSC
+/* The TSC only keeps a constant rate across P-states and sleep states when
+   CPUID reports it as invariant. */
+static int tsc_is_invariant() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return 0;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx >> 8) & 1;
+}
+
+/* Read the TSC between two CLOCK_MONOTONIC_RAW reads. The tightest of
+   several tries pins the pair down to a few dozen nanoseconds. */
+static int tsc_sample(uint64_t *tsc, nanots *ns) {
+    nanots best_width = INT64_MAX;
+    for (int i = 0; i < 16; ++i) {
+        nanots before, after;
+        if (monotonic_raw_gettime_ns(&before) != 0)
+            return -1;
+        uint64_t value = __rdtsc();
+        if (monotonic_raw_gettime_ns(&after) != 0)
+            return -1;
+
+        if (after - before < best_width) {
+            best_width = after - before;
+            *tsc = value;
+            *ns = before + best_width / 2;
+        }
+    }
     return 0;
 }
+#endif
+
+int real_hardware_clock_parse_source(const char *name, int *source) {
+    for (int i = CLOCK_SOURCE_MONOTONIC_RAW; i <= CLOCK_SOURCE_TSC; ++i) {
+        if (strcmp(name, CLOCK_SOURCE_NAMES[i]) == 0) {
+            *source = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Select the source behind real_hardware_clock_gettime. The TSC source is
+   calibrated over calibration_period usec; its rate error is roughly the
+   sampling uncertainty (tens of nanoseconds) divided by that period.
+   Returns -1 and keeps CLOCK_MONOTONIC_RAW if the TSC is unusable. */
+int real_hardware_clock_select(int source, microts calibration_period) {
+    if (source == CLOCK_SOURCE_MONOTONIC_RAW) {
+        clock_source = source;
+        return 0;
+    }
+
+#ifdef SCLOCK_HAVE_TSC
+    if (source != CLOCK_SOURCE_TSC || !tsc_is_invariant())
+        return -1;
+
+    uint64_t start_tsc, end_tsc;
+    nanots start_ns, end_ns;
+    struct timespec wait = { calibration_period / MILLION,
+                             (calibration_period % MILLION) * 1000 };
+    if (tsc_sample(&start_tsc, &start_ns) != 0
+        || nanosleep(&wait, NULL) != 0
+        || tsc_sample(&end_tsc, &end_ns) != 0
+        || end_tsc <= start_tsc || end_ns <= start_ns)
+        return -1;
+
+    tsc_mult = (uint64_t) ((((unsigned __int128) (end_ns - start_ns))
+                            << TSC_SHIFT) / (end_tsc - start_tsc));
+    tsc_base = end_tsc;
+    tsc_base_ns = end_ns;
+    clock_source = CLOCK_SOURCE_TSC;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Ticks per second of the selected source. */
+double real_hardware_clock_frequency() {
+    if (clock_source == CLOCK_SOURCE_TSC)
+        return 1e9 * ((double) ((uint64_t) 1 << TSC_SHIFT) / tsc_mult);
+    return 1e9;
+}
+
+int real_hardware_clock_gettime_ns(nanots *result) {
+#ifdef SCLOCK_HAVE_TSC
+    if (clock_source == CLOCK_SOURCE_TSC) {
+        int64_t ticks = (int64_t) (__rdtsc() - tsc_base);
+        *result = tsc_base_ns + (nanots) (((__int128) ticks * tsc_mult)
+                                          >> TSC_SHIFT);
+        return 0;
+    }
+#endif
+    return monotonic_raw_gettime_ns(result);
+}
+
+int real_hardware_clock_gettime(microts *result) {
+    nanots nanoseconds;
+    if (real_hardware_clock_gettime_ns(&nanoseconds) != 0)
+        return -1;
+
+    *result = nanoseconds / 1000;
+    return 0;
+}
+
+/* Convert a CLOCK_REALTIME timestamp, such as the SO_TIMESTAMPNS receive time
+   the kernel attaches to a datagram, to the real hardware clock timeline.
+   The distance between realtime "now" and the timestamp is subtracted from
+   monotonic "now"; over the few microseconds involved, NTP slewing of the
+   realtime clock is negligible. */
+int real_hardware_clock_from_realtime(const struct timespec *realtime,
+                                      microts *result) {
+    struct timespec now;
+    microts monotonic_now;
+    if (real_hardware_clock_gettime(&monotonic_now) != 0
+        || clock_gettime(CLOCK_REALTIME, &now) != 0)
+        return -1;
+
+    microts age = (now.tv_sec - realtime->tv_sec) * (microts) MILLION
+        + (now.tv_nsec - realtime->tv_nsec) / 1000;
+    *result = monotonic_now - age;
+    return 0;
+}
+
+int real_hardware_clock_enable_transmit_stamps(int fd) {
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+        | SOF_TIMESTAMPING_OPT_TSONLY;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                      sizeof(flags)) == 0 ? 0 : -1;
+}
+
+int real_hardware_clock_transmit_time(int fd, microts *result) {
+    int found = 0;
+    while (1) {
+        char control[256];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET
+                || cmsg->cmsg_type != SCM_TIMESTAMPING)
+                continue;
+            /* The software stamp is the first of the three. */
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            if (real_hardware_clock_from_realtime(&stamps.ts[0],
+                                                  result) == 0)
+                found = 1;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+/* Find the SO_TIMESTAMPNS receive time attached to msg by recvmsg and
+   convert it to the real hardware clock timeline.
+   Returns -1 if msg carries no timestamp. */
+int real_hardware_clock_from_msghdr(struct msghdr *msg, microts *result) {
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec realtime;
+            memcpy(&realtime, CMSG_DATA(cmsg), sizeof(realtime));
+            return real_hardware_clock_from_realtime(&realtime, result);
+        }
+    }
+    return -1;
+}
@@ -1,4 +1,6 @@
 #include <stdint.h>
+#include <time.h>
+#include <math.h>
 #ifndef SCLOCK_H
 #define SCLOCK_H
 
@@ -18,6 +20,33 @@
 static const uint32_t SEQ_NUM_SIZE = 4;
 static const uint32_t PAYLOAD_SIZE = 8;
 
+/* Version 2 messages extend version 1 without moving any of its fields, so
+   either side can talk to an older peer. A version 1 server truncates a
+   version 2 query to its first 12 bytes and answers it as version 1; a
+   version 2 server answers 12-byte queries with 12-byte replies.
+   Query: [4 byte sequence number] [8 byte query string]
+          [1 byte version] [3 bytes reserved]
+   Reply: [4 byte sequence number] [8 byte server transmit timestamp]
+          [1 byte version] [3 bytes reserved]
+          [8 byte server receive timestamp] */
+#define MESSAGE_V2_QUERY_SIZE 16
+#define MESSAGE_V2_REPLY_SIZE 24
+static const uint32_t VERSION_OFFSET = 12;
+static const uint32_t RECEIVE_STAMP_OFFSET = 16;
+static const uint8_t PROTOCOL_VERSION = 2;
+
+/* An authenticated version 2 message sets MESSAGE_FLAG_MAC in the first
+   reserved byte and appends an 8-byte SipHash-2-4 tag under a pre-shared
+   key (see mac.h), so each message grows by exactly MAC_SIZE bytes.
+   Query: [16 byte version 2 query] [8 byte tag]
+   Reply: [24 byte version 2 reply] [8 byte tag] */
+#define MAC_SIZE 8
+#define MESSAGE_AUTH_QUERY_SIZE (MESSAGE_V2_QUERY_SIZE + MAC_SIZE)
+#define MESSAGE_AUTH_REPLY_SIZE (MESSAGE_V2_REPLY_SIZE + MAC_SIZE)
+#define MESSAGE_MAX_SIZE MESSAGE_AUTH_REPLY_SIZE
+static const uint32_t FLAGS_OFFSET = 13;
+static const uint8_t MESSAGE_FLAG_MAC = 0x01;
+
 static const uint32_t MILLION = 1000000;
 static const char *QUERY_STRING = "time = ?";
 
@@ -25,6 +54,18 @@ static const char *QUERY_STRING = "time = ?";
    1 microts = 1 microsecond. */
 typedef int64_t microts;
 
+/* Timestamp supporting nanosecond precision, on the same timeline. */
+typedef int64_t nanots;
+
+/* Sources for the real hardware clock. */
+enum clock_sources {
+    CLOCK_SOURCE_MONOTONIC_RAW = 0,
+    CLOCK_SOURCE_TSC
+};
+
+/* Default TSC calibration period, in usec. */
+#define TSC_CALIBRATION_PERIOD 200000
+
 /* Specification for a hardware clock.
    Initialize with a drift_rate and then calling
    virtual_hardware_clock_init to assign the initial_value. */
@@ -42,6 +83,10 @@ typedef struct vhspec {
     /* drift_rate is given in parts per million, PPM.
        +1 PPM = +1 microsecond of drift per second (1*10^6 microseconds) */
     double drift_rate;
+
+    /* drift_rate as drift per microsecond in units of 2^-SCLOCK_FIXED_SHIFT.
+       Assigned by virtual_hardware_clock_init. */
+    int64_t drift_fixed;
 } vhspec;
 
 /* Specification for a software clock. */
@@ -52,11 +97,153 @@ typedef struct scspec {
     microts rapport_local;
     microts rapport_vhc;
     vhspec *vhclock;
+
+    /* Frequency correction in PPM, applied continuously from rapport_vhc
+       on: +1 PPM makes the clock gain 1 usec per second of VHC time.
+       Zero (the default) corrects offset only.
+       Assign with software_clock_set_frequency. */
+    double frequency;
+    /* frequency in units of 2^-SCLOCK_FIXED_SHIFT per usec */
+    int64_t frequency_fixed;
 } scspec;
 
+/* The clock arithmetic is kept inline here so that processes reading a
+   published clock (see shmclock.h) evaluate exactly what sclock.c does. */
+
+/* L = H * (1 + m) + N + f * (H - H'), where m and N amortize the last
+   rapport and f is the frequency correction. */
+static inline microts software_clock_value_double(const scspec *s,
+                                                  microts vhc_time) {
+    double multiplier;
+    microts offset;
+
+    /* If amortization has complete, offset is N = L' - H'
+       where L' is the local time after amortization and
+       H' is the hardware clock value after amortization.
+       L' = M + a, H' = H + a */
+
+    if (s->rapport_vhc + s->amortization_period <= vhc_time) {
+        multiplier = 0.0;
+        offset = (s->rapport_master + s->amortization_period) -
+            (s->rapport_vhc + s->amortization_period);
+
+    } else {
+        // m = (M - L)/a
+        multiplier = ((double) (s->rapport_master - s->rapport_local)) /
+            ((double) s->amortization_period);
+
+        // N = L - (1 + m) * H
+        offset = llrint(s->rapport_local - ((1 + multiplier) * s->rapport_vhc));
+    }
+
+    // L = H * (1 + m) + N + f * (H - H')
+    return llrint(vhc_time * (1 + multiplier)) + offset
+        + llrint(s->frequency * (vhc_time - s->rapport_vhc) / MILLION);
+}
+
+/* The VHC's value is computed as the real time + drift since initialization.
+   Total drift = (time elapsed / 1*10^6) * PPM */
+static inline microts virtual_hardware_clock_value_double(const vhspec *v,
+                                                          microts real_time) {
+    microts elapsed_time = (real_time) - (v->initial_value);
+
+    /* compute whole_drift as drift expressed in whole numbers */
+    double whole_drift = (((microts) elapsed_time / (microts) MILLION))
+        * (v->drift_rate);
+
+    /* partial_drift is drift that occurs while a second has not fully elapsed.
+       To preserve VHC continuity, we have to account for drift that has occured
+       during the partial second that has elapsed. */
+    double fraction_of_second = ((double) (elapsed_time % MILLION)) / MILLION;
+    double partial_drift = fraction_of_second * v->drift_rate;
+
+    return elapsed_time + llrint((whole_drift + partial_drift)) + v->offset;
+}
+
+/* Integer-only versions of the two functions above. They use no floating
+   point and no division on the VHC path, and give the same result on every
+   machine. Drift is applied as a fixed-point rate with SCLOCK_FIXED_SHIFT
+   fractional bits; with 48 bits the quantization adds at most 0.06 usec
+   after a year of uptime. */
+#define SCLOCK_FIXED_SHIFT 48
+
+static inline int64_t drift_rate_to_fixed(double drift_rate) {
+    return llrint(ldexp(drift_rate / MILLION, SCLOCK_FIXED_SHIFT));
+}
+
+static inline microts virtual_hardware_clock_value_fixed(const vhspec *v,
+                                                         microts real_time) {
+    microts elapsed_time = real_time - v->initial_value;
+
+    /* drift = elapsed * rate, rounded to the nearest microsecond */
+    __int128 drift = (__int128) elapsed_time * v->drift_fixed
+        + ((__int128) 1 << (SCLOCK_FIXED_SHIFT - 1));
+
+    return elapsed_time + (microts) (drift >> SCLOCK_FIXED_SHIFT) + v->offset;
+}
+
+static inline microts software_clock_value_fixed(const scspec *s,
+                                                 microts vhc_time) {
+    microts since = vhc_time - s->rapport_vhc;
+    __int128 one = (__int128) 1 << SCLOCK_FIXED_SHIFT;
+
+    /* After amortization, L = H + (M - H') + f * (H - H'), with the
+       frequency term rounded to the nearest microsecond. */
+    if (s->rapport_vhc + s->amortization_period <= vhc_time
+        || s->amortization_period <= 0)
+        return vhc_time + (s->rapport_master - s->rapport_vhc)
+            + (microts) (((__int128) since * s->frequency_fixed + one / 2)
+                         >> SCLOCK_FIXED_SHIFT);
+
+    /* During amortization, L = L' + (H - H') * (1 + (M - L') / a + f),
+       evaluated as one exact rational and rounded half away from zero. */
+    __int128 correction = (__int128) since
+        * (s->rapport_master - s->rapport_local) * one
+        + (__int128) since * s->frequency_fixed * s->amortization_period;
+    __int128 divisor = s->amortization_period * one;
+    correction = (correction >= 0 ? correction + divisor / 2
+                  : correction - divisor / 2) / divisor;
+
+    return s->rapport_local + since + (microts) correction;
+}
+
+/* Builds with -DSCLOCK_FIXED_POINT (make FIXED_POINT=1) read every clock
+   through the integer path. */
+#ifdef SCLOCK_FIXED_POINT
+#define software_clock_value software_clock_value_fixed
+#define virtual_hardware_clock_value virtual_hardware_clock_value_fixed
+#else
+#define software_clock_value software_clock_value_double
+#define virtual_hardware_clock_value virtual_hardware_clock_value_double
+#endif
+
 int software_clock_gettime(scspec *v, microts *result);
+int software_clock_at(scspec *s, microts vhc_time, microts *result);
+void software_clock_set_frequency(scspec *s, double frequency);
 int virtual_hardware_clock_gettime(vhspec *v, microts *result);
+int virtual_hardware_clock_at(vhspec *v, microts real_time, microts *result);
 int virtual_hardware_clock_init(vhspec *v);
+int virtual_hardware_clock_init_at(vhspec *v, microts real_time);
 int real_hardware_clock_gettime(microts *result);
+int real_hardware_clock_gettime_ns(nanots *result);
+int real_hardware_clock_parse_source(const char *name, int *source);
+int real_hardware_clock_select(int source, microts calibration_period);
+double real_hardware_clock_frequency();
+struct timespec;
+int real_hardware_clock_from_realtime(const struct timespec *realtime,
+                                      microts *result);
+
+struct msghdr;
+int real_hardware_clock_from_msghdr(struct msghdr *msg, microts *result);
+
+/* Kernel transmit timestamps, the counterpart of SO_TIMESTAMPNS on the
+   sending side. Once enabled on fd, the kernel stamps each datagram as the
+   device takes it and queues the stamp on the socket's error queue.
+   transmit_time drains the queue and stores the latest stamp on the real
+   hardware clock timeline; it returns -1 if none was queued. The queue
+   carries no payload, so a caller pairs a stamp with its send by checking
+   that it falls between clock reads taken around the send. */
+int real_hardware_clock_enable_transmit_stamps(int fd);
+int real_hardware_clock_transmit_time(int fd, microts *result);
 
 #endif // SCLOCK_H
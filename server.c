@@ -1,96 +1,1170 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/socket.h>
 #include <stdlib.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <math.h>
 #include "sclock.h"
+#include "slog.h"
+#include "uring.h"
+#include "mac.h"
+#include "ratelimit.h"
+#include "metrics.h"
 
-int main(int argc, char const *argv[]) {
-    if (argc < 3) {
-        printf("Usage: server [port] [master drift (PPM)]\n");
+/* Upper bound on the number of datagrams drained by one recvmmsg call. */
+#define MAX_BATCH_SIZE 64
+
+/* Default number of records held by the trace ring. */
+#define TRACE_CAPACITY 65536
+
+/* Upper bound on the number of SO_REUSEPORT sockets/threads. */
+#define MAX_THREADS 256
+
+/* Receive buffers and reply slots of each io_uring worker. */
+#define URING_BUFFERS 256
+#define URING_SEND_SLOTS 512
+
+/* The multishot receive's user_data. A send carries its slot + 1. */
+#define URING_RECEIVE 0
+#define URING_BUFFER_GROUP 0
+
+/* Default per-thread client table size and bucket depth. The depth covers
+   a client's startup burst of synchronization queries. */
+#define CLIENT_TABLE_SIZE 4096
+#define RATE_BURST 64
+
+/* What one worker has done. Only that worker writes it. */
+typedef struct server_metrics {
+    uint64_t queries;
+    uint64_t replies;
+    uint64_t rejected;
+    uint64_t limited;
+    /* replies the socket refused */
+    uint64_t unsent;
+    /* usec from a query's receive time to its reply's transmit time */
+    histogram residence;
+    /* replies sent per sendto, sendmmsg or io_uring_enter */
+    histogram batch;
+} server_metrics;
+
+/* One serving thread with its own socket bound to the shared port.
+   Every worker points at the same server_clock. */
+typedef struct server_worker {
+    pthread_t thread;
+    int server_fd;
+    int batch_size;
+    int io_uring;
+    int cpu;
+    int kernel_timestamps;
+    vhspec *server_clock;
+    /* With a key, only authenticated queries are answered. */
+    const mac_key *key;
+    /* With a key, smoothed usec per reply spent tagging a batch after its
+       clock read (see batch_transmit_time). */
+    double finish_cost;
+    /* With kernel timestamps outside io_uring: smoothed usec from the
+       transmit clock read to the kernel's transmit stamp (see
+       learn_send_latency). */
+    int transmit_stamps;
+    double send_latency;
+    /* With a table, queries over a client's rate are dropped. */
+    client_table *clients;
+    /* NULL unless metrics are served. */
+    server_metrics *metrics;
+} server_worker;
+
+/* Room for one SCM_TIMESTAMPNS control message. */
+#define CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+
+/* A multishot recvmsg lays out each datagram in its buffer as a header,
+   the sender's address, the control messages and then the payload. Longer
+   payloads are truncated, which parse_query does not mind. */
+#define URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) \
+                           + sizeof(struct sockaddr_in) + CONTROL_SIZE \
+                           + MESSAGE_MAX_SIZE)
+
+/* A reply from its query until its IORING_OP_SENDMSG completes. */
+typedef struct uring_reply {
+    char buffer[MESSAGE_MAX_SIZE];
+    struct sockaddr_in client;
+    struct iovec iov;
+    struct msghdr msg;
+    uint32_t sequence_number;
+    int recv_len;
+    microts receive_time;
+    siphash_state mac;
+} uring_reply;
+
+/* Returns 0 and stores the sequence number and protocol version if buffer
+   holds a valid query. Queries without a version byte are version 1. With
+   a key, only authenticated version 2 queries with a valid tag are valid. */
+int parse_query(char *buffer, int recv_len, const mac_key *key,
+                uint32_t *sequence_number, uint8_t *version) {
+    if (recv_len < MESSAGE_SIZE
+        || strncmp(QUERY_STRING, buffer + SEQ_NUM_SIZE, PAYLOAD_SIZE) != 0)
+        return -1;
+
+    *sequence_number = ntohl(*(uint32_t *) buffer);
+    *version = 1;
+    if (recv_len >= MESSAGE_V2_QUERY_SIZE
+        && *(uint8_t *) (buffer + VERSION_OFFSET) >= PROTOCOL_VERSION)
+        *version = PROTOCOL_VERSION;
+
+    if (key != NULL && (*version < PROTOCOL_VERSION
+                        || mac_verify_query(key, buffer, recv_len) != 0))
+        return -1;
+    return 0;
+}
+
+/* Write the reply to sequence_number into buffer and return its length.
+   Version 1 replies carry only the transmit time. */
+int encode_reply(char *buffer, uint32_t sequence_number, uint8_t version,
+                 microts receive_time, microts transmit_time) {
+    /* Increment sequence number */
+    *(uint32_t *) buffer = htonl(sequence_number + 1);
+
+    /* Attach real_time value */
+    *(uint64_t *) (buffer + SEQ_NUM_SIZE) = htonll(transmit_time);
+
+    if (version < PROTOCOL_VERSION)
+        return MESSAGE_SIZE;
+
+    memset(buffer + VERSION_OFFSET, 0, RECEIVE_STAMP_OFFSET - VERSION_OFFSET);
+    *(uint8_t *) (buffer + VERSION_OFFSET) = PROTOCOL_VERSION;
+    *(uint64_t *) (buffer + RECEIVE_STAMP_OFFSET) = htonll(receive_time);
+    return MESSAGE_V2_REPLY_SIZE;
+}
+
+/* Write all of a reply but its transmit time and return its length. With a
+   key, the reply is authenticated and mac holds its tag up to the transmit
+   time. Everything here happens before the transmit clock read. */
+int begin_reply(char *buffer, uint32_t sequence_number, uint8_t version,
+                microts receive_time, const mac_key *key,
+                siphash_state *mac) {
+    int reply_len = encode_reply(buffer, sequence_number, version,
+                                 receive_time, 0);
+    if (key == NULL)
+        return reply_len;
+
+    mac_reply_begin(key, buffer, mac);
+    return MESSAGE_AUTH_REPLY_SIZE;
+}
+
+/* Add the transmit time to a reply from begin_reply, and its tag if it is
+   authenticated. This is all that sits between the clock read and the
+   send: a store, or one SipHash word and the finalization. */
+static inline void finish_reply(char *buffer, const mac_key *key,
+                                const siphash_state *mac,
+                                microts transmit_time) {
+    if (key != NULL)
+        mac_reply_end(mac, buffer, transmit_time);
+    else
+        *(uint64_t *) (buffer + SEQ_NUM_SIZE) = htonll(transmit_time);
+}
+
+/* Weight of the newest batch in the smoothed tagging cost. */
+#define FINISH_COST_GAIN 0.125
+
+/* Every reply of a batch shares one clock read, now. Unkeyed, the replies
+   take a store each after it and leave with the next send, so now is their
+   transmit time. Keyed, each tag is finalized after the read, about 40 ns
+   a reply (bench/clocks, "sign reply after clock read"), so a batch of 64
+   leaves some 2.5 usec after the read. The transmit time is then moved
+   forward by the batch size times the cost measured on earlier batches. */
+static inline microts batch_transmit_time(const server_worker *worker,
+                                          microts now, int count) {
+    if (worker->transmit_stamps)
+        return now + llround(worker->send_latency);
+    if (worker->key == NULL)
+        return now;
+    return now + llround(worker->finish_cost * count);
+}
+
+/* Time the tagging of a batch of count replies whose clock read was now. */
+static inline void measure_finish_cost(server_worker *worker, microts now,
+                                       int count) {
+    microts done;
+    if (worker->key == NULL || worker->transmit_stamps
+        || virtual_hardware_clock_gettime(worker->server_clock, &done) != 0)
+        return;
+    worker->finish_cost += FINISH_COST_GAIN
+        * ((double) (done - now) / count - worker->finish_cost);
+}
+
+/* Weight of the newest send in the smoothed send latency. */
+#define SEND_LATENCY_GAIN 0.125
+
+/* With kernel timestamps, a query's receive time is taken by the kernel
+   but its reply's transmit time is a clock read before the send, so the
+   two ends of the exchange would be taken at different layers. The
+   kernel's transmit stamp arrives only after the reply has left, so the
+   worker learns the usec from its clock read to that stamp on each send
+   and moves later transmit times forward by it (batch_transmit_time),
+   just as the client uses its own transmit stamps directly. */
+static void learn_send_latency(server_worker *worker, microts clock_time) {
+    microts transmitted, stamp, after;
+    if (!worker->transmit_stamps
+        || real_hardware_clock_transmit_time(worker->server_fd,
+                                             &transmitted) != 0
+        || virtual_hardware_clock_at(worker->server_clock, transmitted,
+                                     &stamp) != 0
+        || virtual_hardware_clock_gettime(worker->server_clock, &after) != 0)
+        return;
+    /* A stamp outside the send is a late one from an earlier reply. */
+    if (stamp < clock_time || stamp > after)
+        return;
+    worker->send_latency += SEND_LATENCY_GAIN
+        * ((stamp - clock_time) - worker->send_latency);
+}
+
+/* Turn on kernel transmit stamps for a worker with kernel timestamps. */
+static void enable_transmit_stamps(server_worker *worker) {
+    if (!worker->kernel_timestamps)
+        return;
+    if (real_hardware_clock_enable_transmit_stamps(worker->server_fd) == 0)
+        worker->transmit_stamps = 1;
+    else
+        slog(SLOG_WARN, "No kernel transmit stamps; replies are stamped "
+             "before the send.\n");
+}
+
+/* Returns 1 if the query from client at now is within its rate limit, or
+   if the worker has none. */
+static inline int admit_query(server_worker *worker,
+                              struct sockaddr_in *client,
+                              uint32_t sequence_number, microts now) {
+    return worker->clients == NULL
+        || client_table_admit(worker->clients, client->sin_addr.s_addr,
+                              client->sin_port, sequence_number, now);
+}
+
+/* Count one wakeup's queries. Called once its replies have left, so it
+   never sits between a clock read and a send. */
+static void record_wakeup(server_metrics *metrics, int received, int replied,
+                          int unsent, int rejected, int limited) {
+    metric_add(&metrics->queries, received);
+    metric_add(&metrics->replies, replied);
+    metric_add(&metrics->unsent, unsent);
+    metric_add(&metrics->rejected, rejected);
+    metric_add(&metrics->limited, limited);
+    if (replied > 0)
+        hist_record_shared(&metrics->batch, replied);
+}
+
+static void record_residence(server_metrics *metrics, microts receive_time,
+                             microts transmit_time) {
+    microts residence = transmit_time - receive_time;
+    hist_record_shared(&metrics->residence, residence > 0 ? residence : 0);
+}
+
+/* Read the server clock value at which the query in msg was received.
+   If msg carries a kernel receive timestamp, the result is the clock value
+   when the query reached the socket, not when the server got to it. */
+int receive_timestamp(vhspec *server_clock, struct msghdr *msg,
+                      microts *result) {
+    microts real_time;
+    if (msg->msg_controllen > 0
+        && real_hardware_clock_from_msghdr(msg, &real_time) == 0)
+        return virtual_hardware_clock_at(server_clock, real_time, result);
+
+    return virtual_hardware_clock_gettime(server_clock, result);
+}
+
+/* Answer one query per recvmsg/sendto pair. */
+void serve_single(server_worker *worker) {
+    int server_fd = worker->server_fd;
+    vhspec *server_clock = worker->server_clock;
+    char buffer[MESSAGE_MAX_SIZE] = {0};
+    char control[CONTROL_SIZE];
+    struct sockaddr_in client;
+    socklen_t slen = sizeof(client);
+    struct iovec iov = { .iov_base = buffer, .iov_len = MESSAGE_MAX_SIZE };
+    struct msghdr msg = {0};
+    msg.msg_name = &client;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    enable_transmit_stamps(worker);
+    while (1) {
+        msg.msg_namelen = slen;
+        msg.msg_control = worker->kernel_timestamps ? control : NULL;
+        msg.msg_controllen = worker->kernel_timestamps ? sizeof(control) : 0;
+
+        /* recvmsg is a blocking call. It stores sender information in `client`
+           and the received datagram in `buffer` with size `recv_len`. */
+        int recv_len;
+        if ((recv_len = recvmsg(server_fd, &msg, 0)) < 0) {
+            printf("recvmsg failed. Exiting.\n");
+            exit(1);
+        }
+
+        char return_buffer[MESSAGE_MAX_SIZE] = {0};
+
+        /* Read the sequence number from the incoming buffer. */
+        uint32_t sequence_number = 0;
+        uint8_t version;
+        microts receive_time = 0, transmit_time = 0;
+        int event = SLOG_EVENT_REJECTED;
+        int stamped = 0;
+        siphash_state mac;
+        int reply_len = 0;
+        /* Version 1 replies need no receive time, but the rate limit does. */
+        if (parse_query(buffer, recv_len, worker->key, &sequence_number,
+                        &version) == 0
+            && ((version < PROTOCOL_VERSION && worker->clients == NULL)
+                || (stamped = receive_timestamp(server_clock, &msg,
+                                                &receive_time) == 0))) {
+            if (admit_query(worker, &client, sequence_number, receive_time))
+                reply_len = begin_reply(return_buffer, sequence_number,
+                                        version, receive_time, worker->key,
+                                        &mac);
+            else
+                event = SLOG_EVENT_LIMITED;
+        }
+
+        microts clock_time;
+        if (reply_len > 0
+            && virtual_hardware_clock_gettime(server_clock, &clock_time) == 0) {
+            transmit_time = batch_transmit_time(worker, clock_time, 1);
+            finish_reply(return_buffer, worker->key, &mac, transmit_time);
+            if (sendto(server_fd, return_buffer, reply_len,
+                       0, (struct sockaddr *) &client, slen) >= 0)
+                event = SLOG_EVENT_REPLIED;
+            else
+                event = SLOG_EVENT_UNSENT;
+            learn_send_latency(worker, clock_time);
+        }
+
+        /* Tracing happens after the reply has left, so it never sits between
+           the clock read and sendto. */
+        if (SLOG_TRACING())
+            slog_trace_packet(event, client.sin_addr.s_addr, client.sin_port,
+                              sequence_number, recv_len, transmit_time);
+
+        if (worker->metrics != NULL) {
+            record_wakeup(worker->metrics, 1, event == SLOG_EVENT_REPLIED,
+                          event == SLOG_EVENT_UNSENT,
+                          event == SLOG_EVENT_REJECTED,
+                          event == SLOG_EVENT_LIMITED);
+            if (event == SLOG_EVENT_REPLIED && stamped)
+                record_residence(worker->metrics, receive_time,
+                                 transmit_time);
+        }
+    }
+}
+
+/* Send count replies with sendmmsg and return how many the socket took.
+   sendmmsg stops at the first reply it cannot send, usually one whose
+   client has gone away, so skip that one and carry on with the rest, as
+   the agent's fan_out does. A sent reply is left with a nonzero msg_len. */
+static int send_replies(int fd, struct mmsghdr *replies, int count) {
+    for (int i = 0; i < count; ++i)
+        replies[i].msg_len = 0;
+
+    int done = 0, sent = 0;
+    while (done < count) {
+        int n = sendmmsg(fd, replies + done, count - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ++done;
+            continue;
+        }
+        done += n;
+        sent += n;
+    }
+    return sent;
+}
+
+/* Drain up to batch_size queued queries with one recvmmsg and answer all of
+   them with one sendmmsg. */
+void serve_batch(server_worker *worker) {
+    int server_fd = worker->server_fd;
+    vhspec *server_clock = worker->server_clock;
+    int batch_size = worker->batch_size;
+    int kernel_timestamps = worker->kernel_timestamps;
+    char buffers[MAX_BATCH_SIZE][MESSAGE_MAX_SIZE];
+    char controls[MAX_BATCH_SIZE][CONTROL_SIZE];
+    char return_buffers[MAX_BATCH_SIZE][MESSAGE_MAX_SIZE];
+    struct sockaddr_in clients[MAX_BATCH_SIZE];
+    struct iovec request_iov[MAX_BATCH_SIZE];
+    struct iovec reply_iov[MAX_BATCH_SIZE];
+    struct mmsghdr requests[MAX_BATCH_SIZE] = {0};
+    struct mmsghdr replies[MAX_BATCH_SIZE] = {0};
+    uint32_t sequence_numbers[MAX_BATCH_SIZE];
+    siphash_state macs[MAX_BATCH_SIZE];
+    microts receive_times[MAX_BATCH_SIZE];
+    int sources[MAX_BATCH_SIZE];
+
+    for (int i = 0; i < batch_size; ++i) {
+        request_iov[i].iov_base = buffers[i];
+        request_iov[i].iov_len = MESSAGE_MAX_SIZE;
+        requests[i].msg_hdr.msg_iov = &request_iov[i];
+        requests[i].msg_hdr.msg_iovlen = 1;
+        requests[i].msg_hdr.msg_name = &clients[i];
+
+        reply_iov[i].iov_base = return_buffers[i];
+        replies[i].msg_hdr.msg_iov = &reply_iov[i];
+        replies[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    slog(SLOG_INFO, "Serving in batches of up to %d queries.\n", batch_size);
+    enable_transmit_stamps(worker);
+
+    while (1) {
+        for (int i = 0; i < batch_size; ++i) {
+            requests[i].msg_hdr.msg_namelen = sizeof(clients[i]);
+            requests[i].msg_hdr.msg_control =
+                kernel_timestamps ? controls[i] : NULL;
+            requests[i].msg_hdr.msg_controllen =
+                kernel_timestamps ? sizeof(controls[i]) : 0;
+        }
+
+        /* Block for the first datagram, then take whatever else is queued. */
+        int received = recvmmsg(server_fd, requests, batch_size,
+                                MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("recvmmsg failed. Exiting.\n");
+            exit(1);
+        }
+
+        /* Without kernel timestamps, the whole batch was received by the
+           time recvmmsg returned. */
+        microts batch_receive_time;
+        if (virtual_hardware_clock_gettime(server_clock,
+                                           &batch_receive_time) != 0)
+            continue;
+
+        int reply_count = 0;
+        int rejected = 0, limited = 0;
+        for (int i = 0; i < received; ++i) {
+            uint8_t version;
+            if (parse_query(buffers[i], requests[i].msg_len, worker->key,
+                            &sequence_numbers[reply_count], &version) != 0) {
+                ++rejected;
+                if (SLOG_TRACING())
+                    slog_trace_packet(SLOG_EVENT_REJECTED,
+                                      clients[i].sin_addr.s_addr,
+                                      clients[i].sin_port, 0,
+                                      requests[i].msg_len, 0);
+                continue;
+            }
+
+            /* Each query may carry the time it reached the socket. */
+            microts receive_time = batch_receive_time;
+            if (kernel_timestamps)
+                receive_timestamp(server_clock, &requests[i].msg_hdr,
+                                  &receive_time);
+            if (!admit_query(worker, &clients[i],
+                             sequence_numbers[reply_count], receive_time)) {
+                ++limited;
+                if (SLOG_TRACING())
+                    slog_trace_packet(SLOG_EVENT_LIMITED,
+                                      clients[i].sin_addr.s_addr,
+                                      clients[i].sin_port,
+                                      sequence_numbers[reply_count],
+                                      requests[i].msg_len, 0);
+                continue;
+            }
+            reply_iov[reply_count].iov_len =
+                begin_reply(return_buffers[reply_count],
+                            sequence_numbers[reply_count], version,
+                            receive_time, worker->key, &macs[reply_count]);
+            receive_times[reply_count] = receive_time;
+
+            replies[reply_count].msg_hdr.msg_name = &clients[i];
+            replies[reply_count].msg_hdr.msg_namelen =
+                requests[i].msg_hdr.msg_namelen;
+            sources[reply_count] = i;
+            ++reply_count;
+        }
+
+        if (reply_count == 0) {
+            if (worker->metrics != NULL)
+                record_wakeup(worker->metrics, received, 0, 0, rejected,
+                              limited);
+            continue;
+        }
+
+        /* Every reply in the batch leaves with the same sendmmsg call, so a
+           single clock read taken just before it is the closest estimate of
+           the transmit time for all of them. */
+        microts clock_time;
+        if (virtual_hardware_clock_gettime(server_clock, &clock_time) != 0)
+            continue;
+        microts transmit_time = batch_transmit_time(worker, clock_time,
+                                                    reply_count);
+
+        for (int i = 0; i < reply_count; ++i)
+            finish_reply(return_buffers[i], worker->key, &macs[i],
+                         transmit_time);
+        measure_finish_cost(worker, clock_time, reply_count);
+
+        int sent = send_replies(server_fd, replies, reply_count);
+        learn_send_latency(worker, clock_time);
+
+        if (SLOG_TRACING()) {
+            for (int i = 0; i < reply_count; ++i) {
+                struct sockaddr_in *client = replies[i].msg_hdr.msg_name;
+                slog_trace_packet(replies[i].msg_len > 0 ? SLOG_EVENT_REPLIED
+                                  : SLOG_EVENT_UNSENT,
+                                  client->sin_addr.s_addr,
+                                  client->sin_port, sequence_numbers[i],
+                                  requests[sources[i]].msg_len,
+                                  transmit_time);
+            }
+        }
+
+        if (worker->metrics != NULL) {
+            record_wakeup(worker->metrics, received, sent, reply_count - sent,
+                          rejected, limited);
+            for (int i = 0; i < reply_count; ++i)
+                if (replies[i].msg_len > 0)
+                    record_residence(worker->metrics, receive_times[i],
+                                 transmit_time);
+        }
+    }
+}
+
+/* The next free SQE, submitting what is queued to make room if needed. */
+static struct io_uring_sqe *next_sqe(uring *ring) {
+    struct io_uring_sqe *sqe;
+    while ((sqe = uring_get_sqe(ring)) == NULL)
+        uring_submit_and_wait(ring, 0);
+    return sqe;
+}
+
+/* One multishot recvmsg keeps producing a CQE per datagram, each in a
+   buffer the kernel takes from the provided ring, until it runs out of
+   buffers or fails. */
+static void arm_uring_receive(uring *ring, int server_fd,
+                              struct msghdr *receive_msg) {
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = server_fd;
+    sqe->addr = (uintptr_t) receive_msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECEIVE;
+}
+
+/* Serve through io_uring. A multishot receive fills registered buffers
+   without a system call per datagram, and the replies to every query that
+   completed since the last wakeup are queued as SQEs and submitted by the
+   same io_uring_enter that waits for the next queries. */
+void serve_uring(server_worker *worker) {
+    int server_fd = worker->server_fd;
+    vhspec *server_clock = worker->server_clock;
+    int kernel_timestamps = worker->kernel_timestamps;
+    uring ring;
+    uring_buffers buffers;
+    if (uring_init(&ring, URING_SEND_SLOTS) != 0
+        || uring_buffers_init(&ring, &buffers, URING_BUFFER_GROUP,
+                              URING_BUFFERS, URING_BUFFER_SIZE) != 0) {
+        printf("FATAL: io_uring setup failed. %s\n", strerror(errno));
         exit(1);
     }
 
-    vhspec server_clock;
-    server_clock.drift_rate = atoi(argv[2]);
-    if (virtual_hardware_clock_init(&server_clock) != 0) {
-        printf("FATAL: Failed to initialize server virtual hardware clock.\n");
+    uring_reply *slots = calloc(URING_SEND_SLOTS, sizeof(uring_reply));
+    int *free_slots = malloc(URING_SEND_SLOTS * sizeof(int));
+    int *queued = malloc(URING_SEND_SLOTS * sizeof(int));
+    if (slots == NULL || free_slots == NULL || queued == NULL) {
+        printf("FATAL: Could not allocate io_uring reply slots.\n");
         exit(1);
     }
+    int free_count = 0;
+    for (int i = URING_SEND_SLOTS - 1; i >= 0; --i) {
+        slots[i].iov.iov_base = slots[i].buffer;
+        slots[i].msg.msg_name = &slots[i].client;
+        slots[i].msg.msg_namelen = sizeof(slots[i].client);
+        slots[i].msg.msg_iov = &slots[i].iov;
+        slots[i].msg.msg_iovlen = 1;
+        free_slots[free_count++] = i;
+    }
+
+    /* Only the name and control lengths of the receive's msghdr are used:
+       they fix the layout of every buffer. */
+    struct msghdr receive_msg = {0};
+    receive_msg.msg_namelen = sizeof(struct sockaddr_in);
+    receive_msg.msg_controllen = kernel_timestamps ? CONTROL_SIZE : 0;
+    size_t header_size = sizeof(struct io_uring_recvmsg_out)
+        + receive_msg.msg_namelen + receive_msg.msg_controllen;
+
+    arm_uring_receive(&ring, server_fd, &receive_msg);
+    slog(SLOG_INFO, "Serving through io_uring with %d receive buffers.\n",
+         URING_BUFFERS);
+
+    /* What the last wakeup received and queued. */
+    int queued_count = 0;
+    int received = 0, rejected = 0, limited = 0;
+    /* Send completions since the last wakeup was recorded. */
+    int sent = 0, unsent = 0;
+    microts transmit_time = 0;
+
+    while (1) {
+        if (uring_submit_and_wait(&ring, 1) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            printf("io_uring_enter failed. Exiting.\n");
+            exit(1);
+        }
+
+        /* The last wakeup's replies were submitted by that call. Their
+           slots are only freed by the completions below, so they still
+           hold each reply's receive time. Replies are counted as their
+           sends complete, so they trail by a wakeup. */
+        if (worker->metrics != NULL
+            && (received > 0 || sent > 0 || unsent > 0)) {
+            record_wakeup(worker->metrics, received, sent, unsent, rejected,
+                          limited);
+            for (int i = 0; i < queued_count; ++i)
+                record_residence(worker->metrics,
+                                 slots[queued[i]].receive_time,
+                                 transmit_time);
+        }
+        queued_count = 0;
+        received = rejected = limited = 0;
+        sent = unsent = 0;
+
+        /* Without kernel timestamps, every query in this batch had been
+           received by the time the wait returned. */
+        microts batch_receive_time;
+        int clock_ok = virtual_hardware_clock_gettime(server_clock,
+                                                      &batch_receive_time) == 0;
+        int rearm = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            if (cqe->user_data != URING_RECEIVE) {
+                if (cqe->res < 0)
+                    ++unsent;
+                else
+                    ++sent;
+                free_slots[free_count++] = cqe->user_data - 1;
+                uring_cqe_seen(&ring);
+                continue;
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                rearm = 1;
+            if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+                /* -ENOBUFS only means every buffer was in use. They are
+                   all recycled by the end of this batch. */
+                if (cqe->res != -ENOBUFS)
+                    slog(SLOG_WARN, "io_uring receive failed. %s\n",
+                         strerror(-cqe->res));
+                uring_cqe_seen(&ring);
+                continue;
+            }
+
+            ++received;
+            unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buffer = uring_buffer(&buffers, id);
+            struct io_uring_recvmsg_out *out = (void *) buffer;
+            struct sockaddr_in *client =
+                (void *) (buffer + sizeof(struct io_uring_recvmsg_out));
+            char *control = (char *) client + receive_msg.msg_namelen;
+            char *payload = buffer + header_size;
+            int recv_len = 0;
+            if ((size_t) cqe->res >= header_size)
+                recv_len = cqe->res - header_size;
+
+            uint32_t sequence_number = 0;
+            uint8_t version;
+            int event = SLOG_EVENT_REJECTED;
+            if (clock_ok && free_count > 0
+                && parse_query(payload, recv_len, worker->key,
+                               &sequence_number, &version) == 0) {
+                /* Each query may carry the time it reached the socket. */
+                microts receive_time = batch_receive_time;
+                if (kernel_timestamps && out->controllen > 0) {
+                    struct msghdr msg = {0};
+                    msg.msg_control = control;
+                    msg.msg_controllen = out->controllen;
+                    receive_timestamp(server_clock, &msg, &receive_time);
+                }
+
+                event = SLOG_EVENT_LIMITED;
+                if (admit_query(worker, client, sequence_number,
+                                receive_time)) {
+                    int slot = free_slots[--free_count];
+                    uring_reply *reply = &slots[slot];
+                    reply->client = *client;
+                    reply->sequence_number = sequence_number;
+                    reply->recv_len = out->payloadlen;
+                    reply->receive_time = receive_time;
+                    reply->iov.iov_len =
+                        begin_reply(reply->buffer, sequence_number, version,
+                                    receive_time, worker->key, &reply->mac);
+                    queued[queued_count++] = slot;
+                    event = 0;
+                }
+            }
+
+            rejected += event == SLOG_EVENT_REJECTED;
+            limited += event == SLOG_EVENT_LIMITED;
+            /* Replies are traced once they have been submitted. */
+            if (event != 0 && SLOG_TRACING())
+                slog_trace_packet(event, client->sin_addr.s_addr,
+                                  client->sin_port, sequence_number,
+                                  out->payloadlen, 0);
+
+            uring_buffer_recycle(&buffers, id);
+            uring_cqe_seen(&ring);
+        }
+
+        /* The replies leave with the next io_uring_enter, so a single
+           clock read taken now is the closest estimate of their transmit
+           time, as in serve_batch. */
+        microts clock_time = 0;
+        if (queued_count > 0
+            && virtual_hardware_clock_gettime(server_clock,
+                                              &clock_time) != 0) {
+            for (int i = 0; i < queued_count; ++i)
+                free_slots[free_count++] = queued[i];
+            rejected += queued_count;
+            queued_count = 0;
+        }
+        transmit_time = batch_transmit_time(worker, clock_time, queued_count);
+
+        for (int i = 0; i < queued_count; ++i) {
+            uring_reply *reply = &slots[queued[i]];
+            finish_reply(reply->buffer, worker->key, &reply->mac,
+                         transmit_time);
+
+            struct io_uring_sqe *sqe = next_sqe(&ring);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = server_fd;
+            sqe->addr = (uintptr_t) &reply->msg;
+            sqe->len = 1;
+            sqe->user_data = queued[i] + 1;
+        }
+        if (queued_count > 0)
+            measure_finish_cost(worker, clock_time, queued_count);
+
+        if (rearm)
+            arm_uring_receive(&ring, server_fd, &receive_msg);
+
+        /* Tracing costs one extra io_uring_enter, so that the replies have
+           left before it starts. A slot is not reused until its send
+           completes, so it still holds the reply here. */
+        if (SLOG_TRACING() && queued_count > 0) {
+            uring_submit_and_wait(&ring, 0);
+            for (int i = 0; i < queued_count; ++i) {
+                uring_reply *reply = &slots[queued[i]];
+                slog_trace_packet(SLOG_EVENT_REPLIED,
+                                  reply->client.sin_addr.s_addr,
+                                  reply->client.sin_port,
+                                  reply->sequence_number, reply->recv_len,
+                                  transmit_time);
+            }
+        }
+    }
+}
 
-    int server_fd, new_socket;
+/* Create a UDP socket bound to port. SO_REUSEPORT lets several sockets
+   bind the same port, and the kernel spreads incoming flows across them. */
+int create_server_socket(int *fd, int port, int kernel_timestamps) {
+    int server_fd;
 
     struct sockaddr_in address;
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(atoi(argv[1]));
+    address.sin_port = htons(port);
 
     int opt = 1;
-    char buffer[MESSAGE_SIZE] = {0};
 
     // Create socket file descriptor. 0 indicates failure.
     if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) <= 0) {
-        printf("FATAL: Socket creation failed.\n");
-        exit(1);
+        printf("Socket creation failed.\n");
+        return -1;
     }
 
     // Allow reuse of local addresses and ports
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
-                   &opt, sizeof(opt))) {
-        printf("FATAL: Socket option assignment failed.\n");
-        exit(1);
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))
+        || setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT,
+                      &opt, sizeof(opt))) {
+        printf("Socket option assignment failed.\n");
+        return -1;
+    }
+
+    // Ask the kernel to stamp every datagram on arrival
+    if (kernel_timestamps
+        && setsockopt(server_fd, SOL_SOCKET, SO_TIMESTAMPNS,
+                      &opt, sizeof(opt))) {
+        printf("Kernel timestamp assignment failed.\n");
+        return -1;
     }
 
     // Bind the socket to a port
     if (bind(server_fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
-        printf("FATAL: Socket binding failed.\n");
-        exit(1);
+        printf("Socket binding failed.\n");
+        return -1;
     }
 
-    struct sockaddr_in client;
-    socklen_t slen = sizeof(client);
-    while (1) {
-        memset(buffer, 0, MESSAGE_SIZE);
-        printf("Waiting for data...\n");
+    *fd = server_fd;
+    return 0;
+}
+
+/* The workers whose client tables SIGUSR2 dumps. */
+typedef struct client_dump {
+    server_worker *workers;
+    int count;
+    sigset_t signals;
+} client_dump;
+
+/* Waits for SIGUSR2 and prints every worker's client table as CSV. */
+static void *dump_thread(void *arg) {
+    client_dump *dump = arg;
+    int signal;
+
+    while (sigwait(&dump->signals, &signal) == 0) {
+        unsigned long evictions = 0;
+        printf("====== CLIENT TABLE =====\n");
+        printf("Thread,Address,Port,Queries,Drops,Last sequence\n");
+        for (int i = 0; i < dump->count; ++i) {
+            char label[16];
+            snprintf(label, sizeof(label), "%d", i);
+            client_table_dump(dump->workers[i].clients, label, stdout);
+            evictions += dump->workers[i].clients->evictions;
+        }
+        printf("====== CLIENT TABLE END (%lu evictions) =====\n", evictions);
         fflush(stdout);
+    }
+    return NULL;
+}
 
-        /* recvfrom is a blocking call. It stores sender information in `client`
-           and the received datagram in `buffer` with size `recv_len`. */
-        int recv_len;
-        if ((recv_len = recvfrom(server_fd, buffer, MESSAGE_SIZE, 0,
-                                 (struct sockaddr *) &client, &slen)) < 0) {
-            printf("recvfrom failed. Exiting.\n");
+/* The workers whose metrics are served. */
+typedef struct worker_group {
+    server_worker *workers;
+    int count;
+} worker_group;
+
+/* Sum every worker's metrics. Runs on the metrics thread. */
+static void write_metrics(FILE *out, void *arg) {
+    worker_group *group = arg;
+    uint64_t queries = 0, replies = 0, rejected = 0, limited = 0, unsent = 0;
+    histogram *snapshot = malloc(sizeof(histogram));
+    histogram *residence = malloc(sizeof(histogram));
+    histogram *batch = malloc(sizeof(histogram));
+    if (snapshot == NULL || residence == NULL || batch == NULL) {
+        free(snapshot);
+        free(residence);
+        free(batch);
+        return;
+    }
+    hist_init(residence);
+    hist_init(batch);
+
+    for (int i = 0; i < group->count; ++i) {
+        server_metrics *m = group->workers[i].metrics;
+        queries += metric_read(&m->queries);
+        replies += metric_read(&m->replies);
+        rejected += metric_read(&m->rejected);
+        limited += metric_read(&m->limited);
+        unsent += metric_read(&m->unsent);
+        hist_snapshot(snapshot, &m->residence);
+        hist_merge(residence, snapshot);
+        hist_snapshot(snapshot, &m->batch);
+        hist_merge(batch, snapshot);
+    }
+
+    metrics_counter(out, "csync_server_queries_total",
+                    "Datagrams received.", queries);
+    metrics_counter(out, "csync_server_replies_total",
+                    "Replies sent.", replies);
+    metrics_counter(out, "csync_server_rejected_total",
+                    "Datagrams that were not valid queries.", rejected);
+    metrics_counter(out, "csync_server_limited_total",
+                    "Valid queries dropped by the rate limit.", limited);
+    metrics_counter(out, "csync_server_unsent_total",
+                    "Replies the socket refused to send.", unsent);
+    metrics_histogram(out, "csync_server_residence_usec",
+                      "Server clock time from a query's receive time to "
+                      "its reply's transmit time.", residence);
+    metrics_histogram(out, "csync_server_batch_replies",
+                      "Replies sent per send call or io_uring wakeup.",
+                      batch);
+    free(snapshot);
+    free(residence);
+    free(batch);
+}
+
+void *run_worker(void *arg) {
+    server_worker *worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            slog(SLOG_WARN, "Could not pin server thread to CPU %d.\n",
+                 worker->cpu);
+    }
+
+    if (worker->io_uring)
+        serve_uring(worker);
+    else if (worker->batch_size > 0)
+        serve_batch(worker);
+    else
+        serve_single(worker);
+    return NULL;
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc < 3) {
+        printf("Usage: server [port] [master drift (PPM)]\n");
+        printf("              [--batch N (queries per recvmmsg, max %d)]\n",
+               MAX_BATCH_SIZE);
+        printf("              [--io-uring (multishot receive, batched sends)]\n");
+        printf("              [--threads N (sockets on the port, max %d)]\n",
+               MAX_THREADS);
+        printf("              [--pin (one thread per core)]\n");
+        printf("              [--kernel-timestamps (stamp at socket arrival)]\n");
+        printf("              [--clock-source monotonic|tsc]\n");
+        printf("              [--log-level error|warn|info|trace]\n");
+        printf("              [--trace-file FILE (binary per-packet records)]\n");
+        printf("              [--trace-size N (records kept in memory)]\n");
+        printf("              [--epoch USEC (real hardware clock time at which the\n");
+        printf("                             master reads 0, default now)]\n");
+        printf("              [--offset USEC (added to the master clock)]\n");
+        printf("              [--key-file FILE (answer only queries authenticated\n");
+        printf("                                with this 32 hex digit key)]\n");
+        printf("              [--rate-limit QPS (per client address and port)]\n");
+        printf("              [--rate-burst N (queries, default %d)]\n",
+               RATE_BURST);
+        printf("              [--client-table N (clients tracked per thread,\n");
+        printf("                                 default %d)]\n",
+               CLIENT_TABLE_SIZE);
+        printf("              [--metrics PATH (Prometheus text on a Unix socket)]\n");
+        exit(1);
+    }
+
+    int batch_size = 0;
+    int use_io_uring = 0;
+    int thread_count = 1;
+    int pin_threads = 0;
+    int kernel_timestamps = 0;
+    int clock_source = CLOCK_SOURCE_MONOTONIC_RAW;
+    const char *trace_path = NULL;
+    long trace_capacity = TRACE_CAPACITY;
+    int epoch_set = 0;
+    microts epoch = 0;
+    microts master_offset = 0;
+    static mac_key key;
+    const mac_key *worker_key = NULL;
+    double rate_limit = 0;
+    int rate_burst = RATE_BURST;
+    long client_table_size = CLIENT_TABLE_SIZE;
+    const char *metrics_path = NULL;
+    for (int i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_size = atoi(argv[++i]);
+            if (batch_size < 1 || batch_size > MAX_BATCH_SIZE) {
+                printf("FATAL: Batch size must be between 1 and %d.\n",
+                       MAX_BATCH_SIZE);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            use_io_uring = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+            if (thread_count < 1 || thread_count > MAX_THREADS) {
+                printf("FATAL: Thread count must be between 1 and %d.\n",
+                       MAX_THREADS);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pin_threads = 1;
+        } else if (strcmp(argv[i], "--kernel-timestamps") == 0) {
+            kernel_timestamps = 1;
+        } else if (strcmp(argv[i], "--clock-source") == 0 && i + 1 < argc) {
+            if (real_hardware_clock_parse_source(argv[++i],
+                                                 &clock_source) != 0) {
+                printf("FATAL: Unknown clock source %s.\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            if (slog_parse_level(argv[++i], &slog_level) != 0) {
+                printf("FATAL: Unknown log level %s.\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-size") == 0 && i + 1 < argc) {
+            trace_capacity = atol(argv[++i]);
+            if (trace_capacity < 1) {
+                printf("FATAL: Trace size must be positive.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--epoch") == 0 && i + 1 < argc) {
+            epoch = atol(argv[++i]);
+            epoch_set = 1;
+        } else if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc) {
+            master_offset = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--key-file") == 0 && i + 1 < argc) {
+            if (mac_load_key(argv[++i], &key) != 0) {
+                printf("FATAL: Could not read a key from %s.\n", argv[i]);
+                exit(1);
+            }
+            worker_key = &key;
+        } else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            rate_limit = atof(argv[++i]);
+            if (rate_limit <= 0) {
+                printf("FATAL: Rate limit must be positive.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--rate-burst") == 0 && i + 1 < argc) {
+            rate_burst = atoi(argv[++i]);
+            if (rate_burst < 1) {
+                printf("FATAL: Rate burst must be positive.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--client-table") == 0 && i + 1 < argc) {
+            client_table_size = atol(argv[++i]);
+            if (client_table_size < 1) {
+                printf("FATAL: Client table size must be positive.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else {
+            printf("FATAL: Unrecognized option %s.\n", argv[i]);
             exit(1);
         }
+    }
+
+    if (use_io_uring && batch_size > 0) {
+        printf("FATAL: --batch and --io-uring are different backends.\n");
+        exit(1);
+    }
 
-        printf("Packet received of length %d.\n", recv_len);
-        printf("Received packet from %s:%d\n", inet_ntoa(client.sin_addr),
-               ntohs(client.sin_port));
+    /* A trace file needs packets traced, whatever --log-level says and
+       wherever it comes. */
+    if (trace_path != NULL)
+        slog_level = SLOG_TRACE;
 
-        char return_buffer[MESSAGE_SIZE] = {0};
+    if (clock_source != CLOCK_SOURCE_MONOTONIC_RAW
+        && real_hardware_clock_select(clock_source,
+                                      TSC_CALIBRATION_PERIOD) != 0)
+        slog(SLOG_WARN, "TSC unusable, falling back to CLOCK_MONOTONIC_RAW.\n");
+    slog(SLOG_INFO, "Real hardware clock runs at %.0f Hz.\n",
+         real_hardware_clock_frequency());
 
-        /* Read the sequence number from the incoming buffer. */
-        uint32_t sequence_number;
-        sequence_number = ntohl(*(uint32_t *) buffer);
-        printf("Received sequence number: %d\n", sequence_number);
+    /* A single clock is shared by every thread. It is only written here,
+       before any worker starts, and every read derives from the same
+       system-wide CLOCK_MONOTONIC_RAW, so all threads agree on it.
+       Servers on one host started with the same --epoch serve the same
+       master clock, which lets a client compare them. */
+    vhspec server_clock = {0};
+    server_clock.drift_rate = atoi(argv[2]);
+    server_clock.offset = master_offset;
+    if ((epoch_set ? virtual_hardware_clock_init_at(&server_clock, epoch)
+         : virtual_hardware_clock_init(&server_clock)) != 0) {
+        printf("FATAL: Failed to initialize server virtual hardware clock.\n");
+        exit(1);
+    }
 
-        microts server_time;
-        if (strncmp(QUERY_STRING, buffer + SEQ_NUM_SIZE, PAYLOAD_SIZE) == 0
-            && virtual_hardware_clock_gettime(&server_clock, 
-                                              &server_time) == 0) {
+    /* Every thread, the trace threads included, must inherit the blocked
+       SIGUSR2, so that only the client table dump thread receives it. */
+    static client_dump dump;
+    sigemptyset(&dump.signals);
+    sigaddset(&dump.signals, SIGUSR2);
+    if (rate_limit > 0
+        && pthread_sigmask(SIG_BLOCK, &dump.signals, NULL) != 0) {
+        printf("FATAL: Signal mask assignment failed.\n");
+        exit(1);
+    }
 
-            /* Increment sequence number */
-            *(uint32_t *) return_buffer = htonl(sequence_number + 1);
+    /* Trace threads must exist before the workers so that the workers
+       inherit their signal mask. */
+    if (SLOG_TRACING() && slog_trace_init(trace_capacity, trace_path) != 0) {
+        printf("FATAL: Could not start packet tracing.\n");
+        exit(1);
+    }
 
-            /* Attach real_time value */
-            *(uint64_t *) (return_buffer + SEQ_NUM_SIZE) = htonll(server_time);
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    static server_worker workers[MAX_THREADS];
+    static client_table tables[MAX_THREADS];
+    for (int i = 0; i < thread_count; ++i) {
+        workers[i].batch_size = batch_size;
+        workers[i].io_uring = use_io_uring;
+        workers[i].key = worker_key;
+        workers[i].server_clock = &server_clock;
+        workers[i].cpu = (pin_threads && cpu_count > 0) ? i % cpu_count : -1;
+        workers[i].kernel_timestamps = kernel_timestamps;
 
-            printf("Sending: [%d] [%ld]\n", sequence_number + 1, server_time);
-            
-            sendto(server_fd, return_buffer, MESSAGE_SIZE,
-                   0, (struct sockaddr *) &client, slen);
+        if (rate_limit > 0) {
+            if (client_table_init(&tables[i], client_table_size, rate_limit,
+                                  rate_burst) != 0) {
+                printf("FATAL: Could not allocate the client table.\n");
+                exit(1);
+            }
+            workers[i].clients = &tables[i];
+        }
+
+        if (metrics_path != NULL) {
+            workers[i].metrics = calloc(1, sizeof(server_metrics));
+            if (workers[i].metrics == NULL) {
+                printf("FATAL: Could not allocate server metrics.\n");
+                exit(1);
+            }
+            hist_init(&workers[i].metrics->residence);
+            hist_init(&workers[i].metrics->batch);
+        }
 
+        if (create_server_socket(&workers[i].server_fd, atoi(argv[1]),
+                                 kernel_timestamps) != 0) {
+            printf("FATAL: Could not create server socket.\n");
+            exit(1);
         }
     }
+
+    if (rate_limit > 0) {
+        dump.workers = workers;
+        dump.count = thread_count;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, dump_thread, &dump) != 0) {
+            printf("FATAL: Could not start the client table dump thread.\n");
+            exit(1);
+        }
+        slog(SLOG_INFO, "Limiting each client to %g queries/sec in bursts "
+             "of up to %d.\n", rate_limit, rate_burst);
+    }
+
+    static worker_group group;
+    group.workers = workers;
+    group.count = thread_count;
+    if (metrics_path != NULL
+        && metrics_serve(metrics_path, write_metrics, &group) != 0) {
+        printf("FATAL: Could not serve metrics on %s. %s\n", metrics_path,
+               strerror(errno));
+        exit(1);
+    }
+
+    /* With a single socket, serve on the main thread as before. */
+    if (thread_count == 1)
+        run_worker(&workers[0]);
+
+    for (int i = 0; i < thread_count; ++i) {
+        if (pthread_create(&workers[i].thread, NULL,
+                           run_worker, &workers[i]) != 0) {
+            printf("FATAL: Could not start server thread.\n");
+            exit(1);
+        }
+    }
+
+    slog(SLOG_INFO, "Serving on %d sockets%s.\n", thread_count,
+         pin_threads ? ", one thread per core" : "");
+
+    for (int i = 0; i < thread_count; ++i)
+        pthread_join(workers[i].thread, NULL);
 }
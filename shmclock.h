@@ -0,0 +1,162 @@
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sclock.h"
+#ifndef SHMCLOCK_H
+#define SHMCLOCK_H
+
+/* Shared-memory publication of a software clock.
+
+   The client publishes its rapport parameters and the drift/offset of its
+   virtual hardware clock to a POSIX shared memory page. Any process on the
+   host can then include this header, map the page read-only and evaluate the
+   same software clock locally, without a socket and without a syscall on
+   kernels where CLOCK_MONOTONIC_RAW is served by the vDSO.
+
+   The page is protected by a seqlock: the writer makes `sequence` odd,
+   updates the fields and makes it even again. A reader copies the fields and
+   retries if the sequence was odd or changed during the copy, so readers
+   never block the writer and never take a lock.
+
+   Readers link nothing but libm (and librt on older glibc):
+
+       const shmclock_page *page;
+       microts now;
+       if (shmclock_open("/csync", &page) == 0
+           && shmclock_gettime(page, &now) == 0)
+           ...
+*/
+
+#define SHMCLOCK_MAGIC 0x43535943 /* "CSYC" */
+#define SHMCLOCK_VERSION 3
+
+typedef struct shmclock_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t reserved;
+
+    /* scspec without its vhclock pointer */
+    microts amortization_period;
+    microts rapport_master;
+    microts rapport_local;
+    microts rapport_vhc;
+    double frequency;
+    int64_t frequency_fixed;
+
+    /* vhspec of the clock under the software clock */
+    microts vhc_initial_value;
+    microts vhc_offset;
+    double vhc_drift_rate;
+    int64_t vhc_drift_fixed;
+} shmclock_page;
+
+/* Create (or reopen) the page called name for writing. */
+static inline int shmclock_create(const char *name, shmclock_page **page) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, sizeof(shmclock_page)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, sizeof(shmclock_page), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    *page = map;
+    return 0;
+}
+
+/* Publish the current parameters of s. Single writer only. */
+static inline void shmclock_publish(shmclock_page *page, const scspec *s) {
+    uint32_t sequence = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    page->magic = SHMCLOCK_MAGIC;
+    page->version = SHMCLOCK_VERSION;
+    page->amortization_period = s->amortization_period;
+    page->rapport_master = s->rapport_master;
+    page->rapport_local = s->rapport_local;
+    page->rapport_vhc = s->rapport_vhc;
+    page->frequency = s->frequency;
+    page->frequency_fixed = s->frequency_fixed;
+    page->vhc_initial_value = s->vhclock->initial_value;
+    page->vhc_offset = s->vhclock->offset;
+    page->vhc_drift_rate = s->vhclock->drift_rate;
+    page->vhc_drift_fixed = s->vhclock->drift_fixed;
+
+    __atomic_store_n(&page->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Map the page called name for reading. */
+static inline int shmclock_open(const char *name, const shmclock_page **page) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    void *map = mmap(NULL, sizeof(shmclock_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    *page = map;
+    return 0;
+}
+
+/* Take a consistent copy of the published clock.
+   Returns -1 if nothing has been published yet. */
+static inline int shmclock_snapshot(const shmclock_page *page,
+                                    scspec *s, vhspec *v) {
+    shmclock_page copy;
+    uint32_t before, after;
+    do {
+        before = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        memcpy(&copy, page, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    if (copy.magic != SHMCLOCK_MAGIC || copy.version != SHMCLOCK_VERSION)
+        return -1;
+
+    memset(v, 0, sizeof(*v));
+    v->initial_value = copy.vhc_initial_value;
+    v->offset = copy.vhc_offset;
+    v->drift_rate = copy.vhc_drift_rate;
+    v->drift_fixed = copy.vhc_drift_fixed;
+
+    s->amortization_period = copy.amortization_period;
+    s->rapport_master = copy.rapport_master;
+    s->rapport_local = copy.rapport_local;
+    s->rapport_vhc = copy.rapport_vhc;
+    s->frequency = copy.frequency;
+    s->frequency_fixed = copy.frequency_fixed;
+    s->vhclock = v;
+    return 0;
+}
+
+/* Read the published software clock. */
+static inline int shmclock_gettime(const shmclock_page *page, microts *result) {
+    scspec s;
+    vhspec v;
+    struct timespec monotonic;
+    if (shmclock_snapshot(page, &s, &v) != 0
+        || clock_gettime(CLOCK_MONOTONIC_RAW, &monotonic) != 0)
+        return -1;
+
+    microts real_time = monotonic.tv_sec * (microts) MILLION
+        + monotonic.tv_nsec / 1000;
+    *result = software_clock_value(&s, virtual_hardware_clock_value(&v,
+                                                                   real_time));
+    return 0;
+}
+
+#endif // SHMCLOCK_H
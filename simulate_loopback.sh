@@ -0,0 +1,28 @@
+#!/usr/bin/env bash
+# Run the same configuration against a local server twice: once with
+# user-space send and receive times and once with kernel SO_TIMESTAMPNS
+# receive and SO_TIMESTAMPING transmit times on both ends.
+drift="$1"
+rapport="$2"
+amort="$3"
+runtime="${4:-1800}"
+port=18090
+
+for mode in user kernel; do
+    mkdir -p "results/loopback/${mode}"
+    output="results/loopback/${mode}/${drift}_${rapport}_${amort}.txt"
+    flags=""
+    if [ "$mode" = "kernel" ]; then
+        flags="--kernel-timestamps"
+    fi
+
+    ./server "$port" "$drift" $flags > /dev/null &
+    server_pid=$!
+    sleep 0.5
+
+    echo "Generating ${output}"
+    ./client 127.0.0.1 "$port" "$drift" "-${drift}" 0 "$runtime" "$rapport" 1000000 "$amort" 50000 $flags > "$output"
+
+    kill "$server_pid"
+    wait "$server_pid" 2> /dev/null || true
+done
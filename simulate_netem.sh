@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+# Run one configuration against a local server through the netem relay.
+# Usage: simulate_netem.sh [drift] [rapport] [amort] [runtime] [netem options...]
+# e.g.   simulate_netem.sh 20 1000000 500000 60 --uplink exp:20000:5000 --loss 0.01
+drift="$1"
+rapport="$2"
+amort="$3"
+runtime="${4:-1800}"
+shift $(( $# < 4 ? $# : 4 ))
+server_port=18091
+relay_port=18092
+
+./server "$server_port" "$drift" > /dev/null &
+server_pid=$!
+./netem "$relay_port" 127.0.0.1 "$server_port" "$@" > /dev/null &
+relay_pid=$!
+sleep 0.5
+
+mkdir -p "results/netem"
+output="results/netem/${drift}_${rapport}_${amort}.txt"
+echo "Generating ${output}"
+./client 127.0.0.1 "$relay_port" "$drift" "-${drift}" 0 "$runtime" "$rapport" 4000000 "$amort" 50000 > "$output"
+
+kill "$relay_pid" "$server_pid"
+wait "$relay_pid" "$server_pid" 2> /dev/null || true
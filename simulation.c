@@ -0,0 +1,635 @@
+#define _XOPEN_SOURCE 600
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "simulation.h"
+#include "rapport.h"
+
+/* Must match the client. */
+#define SERVER_SYNC_ATTEMPTS 50
+#define MAX_SYNC_WINDOW SERVER_SYNC_ATTEMPTS
+
+/* The virtual real hardware clock of the client starts an hour after the
+   server's, so server and client clock values look like the uptimes of
+   two live hosts. */
+#define SIMULATION_START (3600 * (microts) MILLION)
+
+enum event_types {
+    EVENT_END = 0,
+    EVENT_PRINT,
+    EVENT_RAPPORT,
+    EVENT_TIMEOUT,
+    EVENT_SERVER_RECEIVE,
+    EVENT_CLIENT_RECEIVE
+};
+
+typedef struct event {
+    microts time;
+    /* Breaks ties between events at the same time in scheduling order. */
+    uint64_t order;
+    int type;
+    uint32_t sequence_number;
+    server_sample sample;
+} event;
+
+/* A query of the sync burst that has not been answered yet. */
+typedef struct pending_query {
+    int in_use;
+    uint32_t sequence_number;
+    microts sent_at;
+} pending_query;
+
+typedef struct simulation {
+    const simulation_config *config;
+    FILE *output;
+    simulation_errors *errors;
+    uint64_t random_state;
+
+    /* The event queue, a binary min-heap on (time, order). */
+    event *events;
+    size_t event_count;
+    size_t event_capacity;
+    uint64_t next_order;
+
+    /* Virtual real time, on the client's real hardware clock timeline. */
+    microts now;
+    uint32_t next_sequence_number;
+
+    /* The server's own clock, which the client only sees through replies. */
+    vhspec server_master;
+
+    /* The client's clocks, as in client.c. */
+    vhspec server_clock;
+    vhspec local_hardware_clock;
+    scspec soft_clock;
+    microts simulation_start_time;
+
+    /* Startup sync */
+    int syncing;
+    int sync_received;
+    pending_query pending[MAX_SYNC_WINDOW];
+    microts sum_rtt;
+    microts worst_rtt;
+    microts best_rtt;
+    microts best_response_local_time;
+    microts best_server_transmit;
+
+    /* The queries of the rapport in progress (one, or a burst) and the
+       replies to them so far. rapport_pending counts those outstanding. */
+    int rapport_pending;
+    pending_query rapport_queries[MAX_RAPPORT_BURST];
+    int rapport_replies;
+    rapport_estimate rapport_last;
+    server_sample rapport_sample;
+    rapport_filter filter;
+    int rapports;
+
+    /* Adaptive rapport period. Rapport events carry the generation they
+       were scheduled in, so a rescheduled rapport cancels the old one. */
+    rapport_scheduler scheduler;
+    uint32_t rapport_generation;
+
+    frequency_estimator frequency;
+    /* config->frequency_window, or the filter's default */
+    int frequency_window;
+} simulation;
+
+/* fprintf to the simulation's output, if it has one. */
+static void emit(simulation *sim, const char *format, ...) {
+    if (sim->output == NULL)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(sim->output, format, args);
+    va_end(args);
+}
+
+void simulation_defaults(simulation_config *config) {
+    memset(config, 0, sizeof(*config));
+    config->sync_window = 8;
+    config->rapport_window = 1;
+    config->rapport_burst = 1;
+    config->uplink.kind = DELAY_EXPONENTIAL;
+    config->uplink.a = 100;
+    config->uplink.b = 50;
+    config->downlink = config->uplink;
+    config->residence = 10;
+    config->min_rapport_period = RAPPORT_MIN_PERIOD;
+    config->max_rapport_period = RAPPORT_MAX_PERIOD;
+    config->seed = 1;
+}
+
+static int dropped(simulation *sim) {
+    return sim->config->loss > 0
+        && random_uniform(&sim->random_state) < sim->config->loss;
+}
+
+static int event_before(const event *a, const event *b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static int schedule(simulation *sim, event *e) {
+    if (sim->event_count == sim->event_capacity) {
+        size_t capacity = sim->event_capacity ? 2 * sim->event_capacity : 64;
+        event *grown = realloc(sim->events, capacity * sizeof(event));
+        if (grown == NULL)
+            return -1;
+        sim->events = grown;
+        sim->event_capacity = capacity;
+    }
+
+    e->order = sim->next_order++;
+    size_t i = sim->event_count++;
+    while (i > 0 && event_before(e, &sim->events[(i - 1) / 2])) {
+        sim->events[i] = sim->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->events[i] = *e;
+    return 0;
+}
+
+static int schedule_at(simulation *sim, microts time, int type,
+                       uint32_t sequence_number) {
+    event e = {0};
+    e.time = time;
+    e.type = type;
+    e.sequence_number = sequence_number;
+    return schedule(sim, &e);
+}
+
+static void next_event(simulation *sim, event *out) {
+    *out = sim->events[0];
+    event last = sim->events[--sim->event_count];
+
+    size_t i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= sim->event_count)
+            break;
+        if (child + 1 < sim->event_count
+            && event_before(&sim->events[child + 1], &sim->events[child]))
+            ++child;
+        if (!event_before(&sim->events[child], &last))
+            break;
+        sim->events[i] = sim->events[child];
+        i = child;
+    }
+    sim->events[i] = last;
+}
+
+/* Send a query now. Its arrival at the server is scheduled unless the
+   network drops it; a timeout for it is always scheduled. */
+static int send_query(simulation *sim, uint32_t sequence_number) {
+    if (schedule_at(sim, sim->now + sim->config->timeout, EVENT_TIMEOUT,
+                    sequence_number) != 0)
+        return -1;
+    if (dropped(sim))
+        return 0;
+
+    event e = {0};
+    e.time = sim->now
+        + delay_spec_sample(&sim->config->uplink, &sim->random_state);
+    e.type = EVENT_SERVER_RECEIVE;
+    e.sequence_number = sequence_number;
+    e.sample.sent_at = sim->now;
+    return schedule(sim, &e);
+}
+
+/* The server stamps the query on arrival and again on transmit, and the
+   reply heads back to the client. */
+static int serve_query(simulation *sim, event *query) {
+    event reply = *query;
+    microts transmit_time = sim->now + sim->config->residence;
+    virtual_hardware_clock_at(&sim->server_master, sim->now,
+                              &reply.sample.server_receive);
+    virtual_hardware_clock_at(&sim->server_master, transmit_time,
+                              &reply.sample.server_transmit);
+
+    if (dropped(sim))
+        return 0;
+    reply.time = transmit_time
+        + delay_spec_sample(&sim->config->downlink, &sim->random_state);
+    reply.type = EVENT_CLIENT_RECEIVE;
+    reply.sample.received_at = reply.time;
+    return schedule(sim, &reply);
+}
+
+/* Read every clock and print one output row, as print_sample_row does. */
+static int print_sample_row(simulation *sim, microts *est_server_time) {
+    microts local_server_time, local_hardware_clock_time, soft_clock_time;
+    virtual_hardware_clock_at(&sim->server_clock, sim->now, &local_server_time);
+    virtual_hardware_clock_at(&sim->local_hardware_clock, sim->now,
+                              &local_hardware_clock_time);
+    software_clock_at(&sim->soft_clock, local_hardware_clock_time,
+                      &soft_clock_time);
+
+    double real_time_elapsed = (double) (sim->now - sim->simulation_start_time)
+        / (double) MILLION;
+    microts error = soft_clock_time - local_server_time;
+
+    /* Rows before the second rapport are still settling from the sync. */
+    if (est_server_time != NULL)
+        ++sim->rapports;
+    if (sim->errors != NULL && sim->rapports >= 2
+        && simulation_errors_add(sim->errors, error) != 0)
+        return -1;
+
+    if (est_server_time == NULL)
+        emit(sim, "%ld,%.5f,%ld,%ld,%ld,%ld,,\n",
+             sim->now, real_time_elapsed, local_server_time,
+             local_hardware_clock_time, soft_clock_time, error);
+    else
+        emit(sim, "%ld,%.5f,%ld,%ld,%ld,%ld,%ld,\n",
+             sim->now, real_time_elapsed, local_server_time,
+             local_hardware_clock_time, soft_clock_time, error,
+             *est_server_time);
+    return 0;
+}
+
+static void print_metadata(simulation *sim) {
+    const simulation_config *c = sim->config;
+    char uplink[64], downlink[64];
+    delay_spec_format(&c->uplink, uplink, sizeof(uplink));
+    delay_spec_format(&c->downlink, downlink, sizeof(downlink));
+
+    emit(sim, "\n====== SIMULATION METADATA     =====\n");
+    emit(sim, "Server: simulated, Seed: %lu\n", c->seed);
+    emit(sim, "Uplink: %s, Downlink: %s, Loss: %g\n", uplink, downlink,
+         c->loss);
+    emit(sim, "Server Drift: %.2f PPM, Client VHC Drift: %.2f PPM\n",
+         c->server_drift, c->local_vhc_drift);
+    emit(sim, "Relative Drift Weight: %.2f\n", c->relative_drift);
+    emit(sim, "Local Server Time Error: %ld\n",
+         sim->server_clock.error);
+    emit(sim, "Rapport Period: %ld\n", c->rapport_period);
+    if (c->rapport_window > 1 || c->rapport_burst > 1)
+        emit(sim, "Rapport Filter: window %d, burst %d\n", c->rapport_window,
+             c->rapport_burst);
+    if (sim->frequency_window > 0)
+        emit(sim, "Frequency Window: %d rapports\n", sim->frequency_window);
+    if (c->adaptive_target > 0)
+        emit(sim, "Adaptive Rapport: target %ld, min %ld, max %ld\n",
+             c->adaptive_target, sim->scheduler.min_period,
+             sim->scheduler.max_period);
+    emit(sim, "Amortization Period: %ld\n", c->amortization_period);
+    emit(sim, "Simulation runtime: %ld seconds\n",
+         c->runtime / MILLION);
+    emit(sim, "Simulation runtime: %ld usec, \n Start: %ld, End: %ld\n",
+         c->runtime, sim->now, sim->now + c->runtime);
+    emit(sim, "====== SIMULATION OUTPUT START =====\n");
+    emit(sim, "Current Real Time,Real Time Elapsed (sec),Local Server Time,Hardware Clock Time,\
+Software Clock Time,Error,Remote Est Time,\n");
+}
+
+/* Keep the sync window full. */
+static int top_up_sync(simulation *sim) {
+    int in_flight = 0;
+    for (int p = 0; p < sim->config->sync_window; ++p)
+        in_flight += sim->pending[p].in_use;
+
+    for (int p = 0; p < sim->config->sync_window
+             && sim->sync_received + in_flight < SERVER_SYNC_ATTEMPTS; ++p) {
+        if (sim->pending[p].in_use)
+            continue;
+        sim->pending[p].in_use = 1;
+        sim->pending[p].sequence_number = sim->next_sequence_number++;
+        sim->pending[p].sent_at = sim->now;
+        if (send_query(sim, sim->pending[p].sequence_number) != 0)
+            return -1;
+        ++in_flight;
+    }
+    return 0;
+}
+
+/* Finish the sync burst exactly as sync_server_clock does and start the
+   print and rapport schedules. */
+static int finish_sync(simulation *sim) {
+    emit(sim, "\n");
+    emit(sim, "Best Server Sync RTT: %ld, Worst Server Sync RTT: %ld\n",
+         sim->best_rtt, sim->worst_rtt);
+    emit(sim, "Average RTT: %lf\n",
+         (double) sim->sum_rtt / SERVER_SYNC_ATTEMPTS);
+
+    microts current_time;
+    virtual_hardware_clock_at(&sim->server_clock, sim->now, &current_time);
+    microts est_server_time = sim->best_server_transmit + (sim->best_rtt / 2)
+        + (current_time - sim->best_response_local_time);
+    sim->server_clock.offset = est_server_time - current_time;
+    sim->server_clock.error = sim->best_rtt / 2;
+
+    emit(sim, "Est Server Time: %ld, Computed Server Time offset: %ld\n",
+         est_server_time, sim->server_clock.offset);
+    virtual_hardware_clock_at(&sim->server_clock, sim->now, &current_time);
+    emit(sim, "Server clock after sync: %ld\n", current_time);
+
+    sim->syncing = 0;
+    sim->simulation_start_time = sim->now;
+    print_metadata(sim);
+
+    /* Both print and rapport happen immediately. */
+    if (schedule_at(sim, sim->now + sim->config->runtime, EVENT_END, 0) != 0
+        || schedule_at(sim, sim->now + 1, EVENT_PRINT, 0) != 0
+        || schedule_at(sim, sim->now + 1, EVENT_RAPPORT, 0) != 0)
+        return -1;
+    return 0;
+}
+
+static int sync_reply(simulation *sim, event *reply) {
+    int p;
+    for (p = 0; p < sim->config->sync_window; ++p) {
+        if (sim->pending[p].in_use
+            && sim->pending[p].sequence_number == reply->sequence_number)
+            break;
+    }
+
+    /* A reply to a query that already timed out. */
+    if (p == sim->config->sync_window)
+        return 0;
+    sim->pending[p].in_use = 0;
+
+    microts request_local_time, response_local_time;
+    virtual_hardware_clock_at(&sim->server_clock, reply->sample.sent_at,
+                              &request_local_time);
+    virtual_hardware_clock_at(&sim->server_clock, reply->sample.received_at,
+                              &response_local_time);
+    microts rtt = response_local_time - request_local_time
+        - server_residence(&reply->sample);
+
+    sim->sum_rtt += rtt;
+    if (rtt < sim->best_rtt) {
+        sim->best_rtt = rtt;
+        sim->best_response_local_time = response_local_time;
+        sim->best_server_transmit = reply->sample.server_transmit;
+    }
+    if (rtt > sim->worst_rtt)
+        sim->worst_rtt = rtt;
+
+    if (sim->sync_received % 10 == 0 && sim->sync_received != 0)
+        emit(sim, "\n");
+    emit(sim, "[%d/%d] ", sim->sync_received + 1,
+         SERVER_SYNC_ATTEMPTS + 1);
+
+    if (++sim->sync_received == SERVER_SYNC_ATTEMPTS)
+        return finish_sync(sim);
+    return top_up_sync(sim);
+}
+
+static int sync_timeout(simulation *sim, uint32_t sequence_number) {
+    for (int p = 0; p < sim->config->sync_window; ++p) {
+        if (sim->pending[p].in_use
+            && sim->pending[p].sequence_number == sequence_number) {
+            emit(sim, "WARN: A server response timed out.\n");
+            sim->pending[p].in_use = 0;
+            return top_up_sync(sim);
+        }
+    }
+    return 0;
+}
+
+static int send_rapport(simulation *sim) {
+    sim->rapport_replies = 0;
+    for (int q = 0; q < sim->config->rapport_burst; ++q) {
+        pending_query *p = &sim->rapport_queries[q];
+        p->sequence_number = sim->next_sequence_number++;
+        p->sent_at = sim->now;
+        p->in_use = 1;
+        ++sim->rapport_pending;
+        if (sim->errors != NULL)
+            ++sim->errors->rapport_queries;
+        if (send_query(sim, p->sequence_number) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* The rapport query with this sequence number, if it is still pending. */
+static pending_query *find_rapport_query(simulation *sim,
+                                         uint32_t sequence_number) {
+    for (int q = 0; q < sim->config->rapport_burst; ++q) {
+        pending_query *p = &sim->rapport_queries[q];
+        if (p->in_use && p->sequence_number == sequence_number)
+            return p;
+    }
+    return NULL;
+}
+
+/* Every query of the rapport is answered or timed out, and at least one
+   was answered. */
+static int finish_rapport(simulation *sim) {
+    const simulation_config *c = sim->config;
+    rapport_estimate chosen = sim->rapport_last;
+    if ((c->rapport_window > 1 || c->rapport_burst > 1)
+        && rapport_filter_select(&sim->filter, &sim->soft_clock,
+                                 sim->rapport_last.response_local_hardware_time,
+                                 sim->frequency.uncertainty, &chosen) != 0)
+        chosen = sim->rapport_last;
+
+    microts est_server_time = chosen.est_server_time;
+    microts response_local_time = chosen.response_local_time;
+    microts response_local_hardware_time = chosen.response_local_hardware_time;
+
+    if (print_sample_row(sim, &est_server_time) != 0)
+        return -1;
+
+    sim->soft_clock.rapport_master = est_server_time;
+    sim->soft_clock.rapport_local = response_local_time;
+    sim->soft_clock.rapport_vhc = response_local_hardware_time;
+
+    double frequency;
+    if (sim->frequency_window > 0
+        && frequency_estimator_add(&sim->frequency, est_server_time,
+                                   response_local_hardware_time,
+                                   &frequency) == 0)
+        software_clock_set_frequency(&sim->soft_clock, frequency);
+
+    if (sim->config->adaptive_target <= 0)
+        return 0;
+    double floor = sim->scheduler.floor;
+    microts period = rapport_scheduler_update(&sim->scheduler,
+                                              &sim->rapport_sample,
+                                              est_server_time,
+                                              response_local_hardware_time,
+                                              sim->soft_clock.frequency);
+    if (sim->scheduler.floor > 0 && floor == 0)
+        emit(sim, "WARN: Target error is below the predicted floor of %.0f "
+             "usec; keeping a %ld usec rapport period.\n",
+             sim->scheduler.floor, period);
+    return schedule_at(sim, sim->now + period, EVENT_RAPPORT,
+                       ++sim->rapport_generation);
+}
+
+static int rapport_reply(simulation *sim, event *reply) {
+    /* Ignore stale replies to earlier queries. */
+    pending_query *p = find_rapport_query(sim, reply->sequence_number);
+    if (p == NULL)
+        return 0;
+    p->in_use = 0;
+    --sim->rapport_pending;
+    ++sim->rapport_replies;
+
+    rapport_estimate *e = &sim->rapport_last;
+    estimate_rapport(&sim->soft_clock, &reply->sample, &e->est_server_time,
+                     &e->response_local_time, &e->response_local_hardware_time);
+    e->rtt = sample_rtt(&reply->sample);
+    sim->rapport_sample = reply->sample;
+    if (sim->config->rapport_window > 1 || sim->config->rapport_burst > 1)
+        rapport_filter_add(&sim->filter, e);
+
+    return sim->rapport_pending ? 0 : finish_rapport(sim);
+}
+
+static int dispatch(simulation *sim, event *e, int *running) {
+    const simulation_config *c = sim->config;
+
+    switch (e->type) {
+    case EVENT_END:
+        *running = 0;
+        return 0;
+
+    case EVENT_PRINT:
+        if (print_sample_row(sim, NULL) != 0)
+            return -1;
+        return schedule_at(sim, sim->now + c->print_period, EVENT_PRINT, 0);
+
+    case EVENT_RAPPORT:
+        if (e->sequence_number != sim->rapport_generation)
+            return 0;
+        if (schedule_at(sim, sim->now + sim->scheduler.period,
+                        EVENT_RAPPORT, sim->rapport_generation) != 0)
+            return -1;
+        /* A rapport still in flight is left alone until it is answered or
+           times out. */
+        return sim->rapport_pending ? 0 : send_rapport(sim);
+
+    case EVENT_TIMEOUT:
+        if (sim->syncing)
+            return sync_timeout(sim, e->sequence_number);
+        pending_query *p = find_rapport_query(sim, e->sequence_number);
+        if (p == NULL)
+            return 0;
+        p->in_use = 0;
+        if (--sim->rapport_pending > 0)
+            return 0;
+        /* A burst with any reply goes ahead without the rest. A timed out
+           rapport is retried right away. */
+        if (sim->rapport_replies > 0)
+            return finish_rapport(sim);
+        emit(sim, "WARN: A server response timed out.\n");
+        return send_rapport(sim);
+
+    case EVENT_SERVER_RECEIVE:
+        return serve_query(sim, e);
+
+    case EVENT_CLIENT_RECEIVE:
+        if (sim->syncing)
+            return sync_reply(sim, e);
+        return rapport_reply(sim, e);
+    }
+    return 0;
+}
+
+int simulation_errors_add(simulation_errors *errors, microts error) {
+    if (errors->count == errors->capacity) {
+        size_t capacity = errors->capacity ? 2 * errors->capacity : 1024;
+        microts *grown = realloc(errors->values, capacity * sizeof(microts));
+        if (grown == NULL)
+            return -1;
+        errors->values = grown;
+        errors->capacity = capacity;
+    }
+    errors->values[errors->count++] = error;
+    return 0;
+}
+
+void simulation_errors_free(simulation_errors *errors) {
+    free(errors->values);
+    memset(errors, 0, sizeof(*errors));
+}
+
+int simulation_run(const simulation_config *config, FILE *output,
+                   simulation_errors *errors) {
+    if (config->sync_window < 1 || config->sync_window > MAX_SYNC_WINDOW
+        || config->rapport_period <= 0 || config->print_period <= 0
+        || config->timeout <= 0 || config->runtime < 0
+        || config->loss < 0 || config->loss >= 1
+        || config->rapport_window < 1
+        || config->rapport_window > MAX_RAPPORT_WINDOW
+        || config->rapport_burst < 1
+        || config->rapport_burst > MAX_RAPPORT_BURST
+        || (config->frequency_window != 0
+            && (config->frequency_window < MIN_FREQUENCY_RAPPORTS
+                || config->frequency_window > MAX_FREQUENCY_WINDOW))
+        || (config->adaptive_target > 0
+            && (config->min_rapport_period <= 0
+                || config->max_rapport_period < config->min_rapport_period)))
+        return -1;
+
+    simulation *sim = calloc(1, sizeof(simulation));
+    if (sim == NULL)
+        return -1;
+    sim->config = config;
+    sim->output = output;
+    sim->errors = errors;
+    sim->random_state = config->seed ? config->seed : 1;
+    sim->now = SIMULATION_START;
+    sim->best_rtt = LLONG_MAX;
+
+    /* A fixed period is an adaptive one that never adapts. */
+    if (config->adaptive_target > 0)
+        rapport_scheduler_init(&sim->scheduler, config->adaptive_target,
+                               config->min_rapport_period,
+                               config->max_rapport_period,
+                               config->rapport_period,
+                               config->amortization_period);
+    else
+        sim->scheduler.period = config->rapport_period;
+    /* The window holds at least one whole burst. */
+    rapport_filter_init(&sim->filter,
+                        config->rapport_window > config->rapport_burst
+                        ? config->rapport_window : config->rapport_burst);
+    /* A window carries its samples forward at the fitted drift. */
+    sim->frequency_window = config->frequency_window;
+    if ((config->rapport_window > 1 || config->rapport_burst > 1)
+        && sim->frequency_window == 0)
+        sim->frequency_window = FILTER_FREQUENCY_WINDOW;
+    if (sim->frequency_window > 0)
+        frequency_estimator_init(&sim->frequency, sim->frequency_window);
+
+    /* Weigh server, local VHC drift by relative drift as the client does.
+       The simulated server runs at exactly the drift the client assumes. */
+    sim->server_master.drift_rate = config->server_drift + config->relative_drift;
+    virtual_hardware_clock_init_at(&sim->server_master, 0);
+
+    sim->local_hardware_clock.drift_rate =
+        config->local_vhc_drift + config->relative_drift;
+    virtual_hardware_clock_init_at(&sim->local_hardware_clock, sim->now);
+
+    sim->soft_clock.amortization_period = config->amortization_period;
+    sim->soft_clock.vhclock = &sim->local_hardware_clock;
+
+    sim->server_clock.drift_rate = config->server_drift + config->relative_drift;
+    virtual_hardware_clock_init_at(&sim->server_clock, sim->now);
+
+    microts server_clock_value;
+    virtual_hardware_clock_at(&sim->server_clock, sim->now, &server_clock_value);
+    emit(sim, "Server clock before sync: %ld\n", server_clock_value);
+    emit(sim, "Synchronizing server_clock...\n");
+
+    sim->syncing = 1;
+    int result = top_up_sync(sim);
+
+    int running = 1;
+    while (result == 0 && running && sim->event_count > 0) {
+        event e;
+        next_event(sim, &e);
+        sim->now = e.time;
+        result = dispatch(sim, &e, &running);
+    }
+
+    free(sim->events);
+    free(sim);
+    return result;
+}
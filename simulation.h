@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "sclock.h"
+#include "delay.h"
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+/* Discrete-event simulation of one client against one server.
+
+   Real time is virtual: it only advances from one scheduled event to the
+   next, so an 1800 second run finishes in milliseconds. The client's VHC,
+   its software clock and its model of the server clock are ordinary
+   vhspec/scspec values read through the *_at functions of sclock.h, and
+   rapports go through the same estimate_rapport as the live client. The
+   server is a vhspec on the same virtual timeline, and each packet is
+   delayed (or dropped) according to the configured distributions.
+
+   A simulation keeps all of its state in its own struct and touches no
+   globals, so several can run on different threads at once. */
+
+typedef struct simulation_config {
+    /* Same meaning as the client's positional arguments. */
+    double server_drift;
+    double local_vhc_drift;
+    double relative_drift;
+    microts runtime;
+    microts rapport_period;
+    microts timeout;
+    microts amortization_period;
+    microts print_period;
+
+    /* With adaptive_target > 0, the rapport period adapts to keep the
+       predicted error within adaptive_target (see rapport_scheduler),
+       starting from rapport_period. */
+    microts adaptive_target;
+    microts min_rapport_period;
+    microts max_rapport_period;
+
+    /* With frequency_window > 0, the software clock corrects its frequency
+       by a least-squares fit over that many rapports. */
+    int frequency_window;
+
+    /* Each rapport sends rapport_burst queries and uses the best sample
+       of the last rapport_window (see rapport_filter). 1 and 1 take every
+       rapport's single sample as is. */
+    int rapport_window;
+    int rapport_burst;
+
+    /* Sync queries in flight at startup, as --sync-window. */
+    int sync_window;
+
+    delay_spec uplink;
+    delay_spec downlink;
+    /* Probability that any one packet is dropped. */
+    double loss;
+    /* Time between the server's receive and transmit stamps. */
+    microts residence;
+    uint64_t seed;
+} simulation_config;
+
+/* Fill config with the defaults used by the simulator command line. */
+void simulation_defaults(simulation_config *config);
+
+/* The Error column of one run, from the second rapport on (the rows
+   processor.py keeps), and the number of rapport queries it sent,
+   retries included. Start zeroed. */
+typedef struct simulation_errors {
+    microts *values;
+    size_t count;
+    size_t capacity;
+    unsigned long rapport_queries;
+} simulation_errors;
+
+int simulation_errors_add(simulation_errors *errors, microts error);
+void simulation_errors_free(simulation_errors *errors);
+
+/* Run one simulation, writing the client's metadata and CSV output to
+   output and appending to errors. Either may be NULL. Returns 0 on success
+   and -1 if the configuration is invalid or memory runs out. */
+int simulation_run(const simulation_config *config, FILE *output,
+                   simulation_errors *errors);
+
+#endif // SIMULATION_H
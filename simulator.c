@@ -0,0 +1,93 @@
+#define _XOPEN_SOURCE 600
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "simulation.h"
+#include "rapport.h"
+
+/* Command line front end for simulation.c. Takes the client's arguments,
+   minus the server address, and prints the same output in virtual time. */
+
+static void parse_delay(const char *text, delay_spec *spec) {
+    if (delay_spec_parse(text, spec) != 0) {
+        printf("FATAL: Invalid delay distribution %s.\n", text);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 9) {
+        printf("Usage: simulator [server simulated drift (PPM)] [client VH drift (PPM)]\n");
+        printf("                 [client-server RHW relative drift (PPM)]\n");
+        printf("                 [simulation runtime (seconds)]\n");
+        printf("                 [rapport period (usec)]\n");
+        printf("                 [timeout (usec)]\n");
+        printf("                 [amortization period (usec)]\n");
+        printf("                 [print frequency (usec)]\n");
+        printf("                 [--sync-window N (sync queries in flight)]\n");
+        printf("                 [--uplink DIST] [--downlink DIST] [--delay DIST]\n");
+        printf("                 [--loss P (drop probability per packet)]\n");
+        printf("                 [--residence USEC (server receive to transmit)]\n");
+        printf("                 [--seed N]\n");
+        printf("                 [--rapport-window N (samples the rapport filter keeps)]\n");
+        printf("                 [--rapport-burst N (queries per rapport)]\n");
+        printf("                 [--frequency-window N (rapports in the frequency fit)]\n");
+        printf("                 [--adaptive-rapport TARGET (usec of predicted error)]\n");
+        printf("                 [--min-rapport USEC (default %ld)]\n", RAPPORT_MIN_PERIOD);
+        printf("                 [--max-rapport USEC (default %ld)]\n", RAPPORT_MAX_PERIOD);
+        printf("DIST is const:D, uniform:LO:HI, normal:MEAN:SD or exp:MIN:MEAN (usec).\n");
+        exit(1);
+    }
+
+    simulation_config config;
+    simulation_defaults(&config);
+    config.server_drift = atof(argv[1]);
+    config.local_vhc_drift = atof(argv[2]);
+    config.relative_drift = atof(argv[3]);
+    config.runtime = atol(argv[4]) * MILLION;
+    config.rapport_period = atol(argv[5]);
+    config.timeout = atol(argv[6]);
+    config.amortization_period = atol(argv[7]);
+    config.print_period = atol(argv[8]);
+
+    for (int i = 9; i < argc; ++i) {
+        if (strcmp(argv[i], "--sync-window") == 0 && i + 1 < argc) {
+            config.sync_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--uplink") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &config.uplink);
+        } else if (strcmp(argv[i], "--downlink") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &config.downlink);
+        } else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &config.uplink);
+            config.downlink = config.uplink;
+        } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            config.loss = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--residence") == 0 && i + 1 < argc) {
+            config.residence = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            config.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--rapport-window") == 0 && i + 1 < argc) {
+            config.rapport_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rapport-burst") == 0 && i + 1 < argc) {
+            config.rapport_burst = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frequency-window") == 0 && i + 1 < argc) {
+            config.frequency_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--adaptive-rapport") == 0 && i + 1 < argc) {
+            config.adaptive_target = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--min-rapport") == 0 && i + 1 < argc) {
+            config.min_rapport_period = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-rapport") == 0 && i + 1 < argc) {
+            config.max_rapport_period = atol(argv[++i]);
+        } else {
+            printf("FATAL: Unrecognized option %s.\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if (simulation_run(&config, stdout, NULL) != 0) {
+        printf("FATAL: Simulation failed. Check the periods, sync window and loss.\n");
+        exit(1);
+    }
+    return 0;
+}
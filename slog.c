@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include "slog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+/* How often the drain thread empties the ring into the trace file. */
+#define SLOG_DRAIN_PERIOD_NSEC 100000000
+
+int slog_level = SLOG_INFO;
+
+static const char *LEVEL_NAMES[] = { "error", "warn", "info", "trace" };
+static const char *LEVEL_PREFIXES[] = { "ERROR: ", "WARN: ", "", "" };
+
+/* The trace ring. Producers claim a position with one atomic increment and
+   publish a slot by storing its position last. A slot whose position is 0
+   is being written. Readers copy a slot and check that its position did not
+   change during the copy, so a reader never blocks a producer. */
+static slog_record *ring = NULL;
+static uint64_t ring_mask = 0;
+static uint64_t ring_head = 0;
+static FILE *trace_file = NULL;
+
+int slog_parse_level(const char *name, int *level) {
+    for (int i = SLOG_ERROR; i <= SLOG_TRACE; ++i) {
+        if (strcmp(name, LEVEL_NAMES[i]) == 0) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void slog(int level, const char *format, ...) {
+    if (level > slog_level)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    fputs(LEVEL_PREFIXES[level], stdout);
+    vprintf(format, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+void slog_trace_packet(uint16_t event, uint32_t address, uint16_t port,
+                       uint32_t sequence_number, int32_t length,
+                       microts server_time) {
+    uint64_t position = __atomic_add_fetch(&ring_head, 1, __ATOMIC_RELAXED);
+    slog_record *slot = &ring[(position - 1) & ring_mask];
+
+    __atomic_store_n(&slot->position, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->server_time = server_time;
+    slot->address = address;
+    slot->port = port;
+    slot->event = event;
+    slot->sequence_number = sequence_number;
+    slot->length = length;
+
+    __atomic_store_n(&slot->position, position, __ATOMIC_RELEASE);
+}
+
+/* Copy the record at position into out.
+   Returns 0 on success, 1 if the slot has not been published yet and
+   -1 if it was already overwritten by a newer record. */
+static int read_record(uint64_t position, slog_record *out) {
+    slog_record *slot = &ring[(position - 1) & ring_mask];
+
+    uint64_t before = __atomic_load_n(&slot->position, __ATOMIC_ACQUIRE);
+    memcpy(out, slot, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t after = __atomic_load_n(&slot->position, __ATOMIC_RELAXED);
+
+    if (before == position && after == position)
+        return 0;
+    if (before > position || after > position)
+        return -1;
+    return 1;
+}
+
+static const char *event_name(uint16_t event) {
+    switch (event) {
+    case SLOG_EVENT_REPLIED:
+        return "REPLIED";
+    case SLOG_EVENT_LIMITED:
+        return "LIMITED";
+    case SLOG_EVENT_UNSENT:
+        return "UNSENT";
+    default:
+        return "REJECTED";
+    }
+}
+
+static void print_record(slog_record *record) {
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &record->address, address, sizeof(address));
+
+    printf("%lu %s %s:%d seq=%u len=%d server_time=%ld\n",
+           record->position,
+           event_name(record->event),
+           address, ntohs(record->port), record->sequence_number,
+           record->length, record->server_time);
+}
+
+/* Append every published record since tail to the trace file.
+   Returns the new tail. */
+static uint64_t drain(uint64_t tail, unsigned long *lost) {
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    if (head - tail > ring_mask + 1) {
+        *lost += head - tail - (ring_mask + 1);
+        tail = head - (ring_mask + 1);
+    }
+
+    slog_record record;
+    for (; tail < head; ++tail) {
+        int r = read_record(tail + 1, &record);
+        if (r > 0)
+            break;
+        if (r < 0) {
+            ++*lost;
+            continue;
+        }
+        fwrite(&record, sizeof(record), 1, trace_file);
+    }
+
+    fflush(trace_file);
+    return tail;
+}
+
+static void *drain_thread(void *arg) {
+    uint64_t tail = 0;
+    unsigned long lost = 0, reported_lost = 0;
+    struct timespec period = { 0, SLOG_DRAIN_PERIOD_NSEC };
+
+    while (1) {
+        nanosleep(&period, NULL);
+        tail = drain(tail, &lost);
+
+        if (lost != reported_lost) {
+            slog(SLOG_WARN, "Trace ring overflowed, %lu records lost.\n",
+                 lost - reported_lost);
+            reported_lost = lost;
+        }
+    }
+    return NULL;
+}
+
+/* Waits for SIGUSR1 and prints whatever the ring currently holds. */
+static void *dump_thread(void *arg) {
+    sigset_t *signals = arg;
+    int signal;
+
+    while (sigwait(signals, &signal) == 0) {
+        uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        uint64_t position = head > ring_mask ? head - ring_mask : 1;
+
+        printf("====== TRACE DUMP (%lu records) =====\n", head - position + 1);
+        slog_record record;
+        for (; position <= head; ++position) {
+            if (read_record(position, &record) == 0)
+                print_record(&record);
+        }
+        printf("====== TRACE DUMP END =====\n");
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+int slog_trace_init(size_t capacity, const char *path) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    if ((ring = calloc(size, sizeof(slog_record))) == NULL) {
+        printf("Trace ring allocation failed.\n");
+        return -1;
+    }
+    ring_mask = size - 1;
+
+    /* Every thread created after this point inherits the blocked signal,
+       so only dump_thread ever receives it. */
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        printf("Signal mask assignment failed.\n");
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dump_thread, &signals) != 0) {
+        printf("Trace dump thread creation failed.\n");
+        return -1;
+    }
+
+    if (path == NULL)
+        return 0;
+
+    if ((trace_file = fopen(path, "wb")) == NULL) {
+        printf("Could not open trace file %s.\n", path);
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, drain_thread, NULL) != 0) {
+        printf("Trace drain thread creation failed.\n");
+        return -1;
+    }
+    return 0;
+}
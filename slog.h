@@ -0,0 +1,65 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "sclock.h"
+#ifndef SLOG_H
+#define SLOG_H
+
+/* Log levels, from least to most verbose. Messages above slog_level are
+   dropped before any formatting happens. SLOG_TRACE enables per-packet
+   records, which never go through stdio: they are written as fixed-size
+   binary records into a lock-free in-memory ring buffer. */
+enum slog_levels {
+    SLOG_ERROR = 0,
+    SLOG_WARN,
+    SLOG_INFO,
+    SLOG_TRACE
+};
+
+extern int slog_level;
+
+/* Per-packet trace events. */
+enum slog_events {
+    SLOG_EVENT_REPLIED = 1,
+    SLOG_EVENT_REJECTED,
+    /* a valid query dropped for exceeding its client's rate */
+    SLOG_EVENT_LIMITED,
+    /* a reply the socket refused to send */
+    SLOG_EVENT_UNSENT
+};
+
+/* One traced packet. 32 bytes, stored in host order except for address and
+   port, which are kept in network order exactly as recvfrom returned them.
+   Trace files written by the drain thread are a plain array of these. */
+typedef struct slog_record {
+    /* position in the trace stream, starting at 1 */
+    uint64_t position;
+    /* server clock value sent in the reply, 0 if none was sent */
+    microts server_time;
+    uint32_t address;
+    uint16_t port;
+    uint16_t event;
+    uint32_t sequence_number;
+    int32_t length;
+} slog_record;
+
+/* Returns 0 and stores the level named by name (error, warn, info, trace). */
+int slog_parse_level(const char *name, int *level);
+
+/* printf-style logging, prefixed with the level name when below SLOG_INFO. */
+void slog(int level, const char *format, ...);
+
+/* Allocate a ring of capacity records (rounded up to a power of two).
+   If path is not NULL, a background thread appends drained records to it.
+   SIGUSR1 dumps the ring contents as text to stdout. Must be called before
+   any other thread is created so that they all inherit the blocked SIGUSR1. */
+int slog_trace_init(size_t capacity, const char *path);
+
+/* Record one packet. Lock-free and safe to call from any thread.
+   Never blocks; when the ring is full the oldest records are overwritten. */
+void slog_trace_packet(uint16_t event, uint32_t address, uint16_t port,
+                       uint32_t sequence_number, int32_t length,
+                       microts server_time);
+
+#define SLOG_TRACING() (slog_level >= SLOG_TRACE)
+
+#endif // SLOG_H
@@ -0,0 +1,117 @@
+#include <math.h>
+#include <string.h>
+#include "stats.h"
+
+void quantile_sketch_init(quantile_sketch *sketch, double q) {
+    memset(sketch, 0, sizeof(*sketch));
+    sketch->q = q;
+    for (int i = 0; i < 5; ++i)
+        sketch->positions[i] = i;
+
+    sketch->desired[0] = 0;
+    sketch->desired[1] = 2 * q;
+    sketch->desired[2] = 4 * q;
+    sketch->desired[3] = 2 + 2 * q;
+    sketch->desired[4] = 4;
+
+    sketch->increments[0] = 0;
+    sketch->increments[1] = q / 2;
+    sketch->increments[2] = q;
+    sketch->increments[3] = (1 + q) / 2;
+    sketch->increments[4] = 1;
+}
+
+/* Piecewise-parabolic prediction of marker i moved by d (+1 or -1). */
+static double parabolic(const quantile_sketch *s, int i, double d) {
+    const double *h = s->heights, *n = s->positions;
+    return h[i] + d / (n[i + 1] - n[i - 1])
+        * ((n[i] - n[i - 1] + d) * (h[i + 1] - h[i]) / (n[i + 1] - n[i])
+           + (n[i + 1] - n[i] - d) * (h[i] - h[i - 1]) / (n[i] - n[i - 1]));
+}
+
+static double linear(const quantile_sketch *s, int i, int d) {
+    const double *h = s->heights, *n = s->positions;
+    return h[i] + d * (h[i + d] - h[i]) / (n[i + d] - n[i]);
+}
+
+void quantile_sketch_add(quantile_sketch *sketch, double x) {
+    double *h = sketch->heights;
+
+    /* The first five samples are kept sorted as the initial markers. */
+    if (sketch->count < 5) {
+        int i = sketch->count++;
+        for (; i > 0 && h[i - 1] > x; --i)
+            h[i] = h[i - 1];
+        h[i] = x;
+        return;
+    }
+    ++sketch->count;
+
+    /* Find the cell holding x, widening the extremes if needed. */
+    int k;
+    if (x < h[0]) {
+        h[0] = x;
+        k = 0;
+    } else if (x >= h[4]) {
+        h[4] = x;
+        k = 3;
+    } else {
+        for (k = 0; k < 3 && x >= h[k + 1]; ++k)
+            ;
+    }
+
+    for (int i = k + 1; i < 5; ++i)
+        sketch->positions[i] += 1;
+    for (int i = 0; i < 5; ++i)
+        sketch->desired[i] += sketch->increments[i];
+
+    /* Move the middle markers toward their desired positions. */
+    double *n = sketch->positions;
+    for (int i = 1; i < 4; ++i) {
+        double d = sketch->desired[i] - n[i];
+        if ((d >= 1 && n[i + 1] - n[i] > 1)
+            || (d <= -1 && n[i - 1] - n[i] < -1)) {
+            int step = d > 0 ? 1 : -1;
+            double height = parabolic(sketch, i, step);
+            if (h[i - 1] < height && height < h[i + 1])
+                h[i] = height;
+            else
+                h[i] = linear(sketch, i, step);
+            n[i] += step;
+        }
+    }
+}
+
+double quantile_sketch_value(const quantile_sketch *sketch) {
+    if (sketch->count == 0)
+        return 0;
+    if (sketch->count < 5)
+        return sketch->heights[(int) lround(sketch->q * (sketch->count - 1))];
+    return sketch->heights[2];
+}
+
+void stream_stats_init(stream_stats *stats) {
+    stats->count = 0;
+    stats->mean = 0;
+    stats->m2 = 0;
+    stats->max_abs = 0;
+    quantile_sketch_init(&stats->median, 0.5);
+    quantile_sketch_init(&stats->p99_abs, 0.99);
+}
+
+void stream_stats_add(stream_stats *stats, microts x) {
+    double delta = x - stats->mean;
+    stats->mean += delta / ++stats->count;
+    stats->m2 += delta * (x - stats->mean);
+
+    microts magnitude = x < 0 ? -x : x;
+    if (magnitude > stats->max_abs)
+        stats->max_abs = magnitude;
+
+    quantile_sketch_add(&stats->median, x);
+    quantile_sketch_add(&stats->p99_abs, magnitude);
+}
+
+double stream_stats_stdev(const stream_stats *stats) {
+    return stats->count > 1 ? sqrt(stats->m2 / (stats->count - 1)) : 0;
+}
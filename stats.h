@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include "sclock.h"
+#ifndef STATS_H
+#define STATS_H
+
+/* Constant-memory summaries of a stream of samples, updated one sample at
+   a time so a run can report its summary without keeping its samples. */
+
+/* P-square estimate of one quantile (Jain and Chlamtac, 1985). Keeps five
+   markers whose heights approximate the minimum, the q/2, q and (1+q)/2
+   quantiles and the maximum. */
+typedef struct quantile_sketch {
+    double q;
+    uint64_t count;
+    double heights[5];
+    double positions[5];
+    double desired[5];
+    double increments[5];
+} quantile_sketch;
+
+void quantile_sketch_init(quantile_sketch *sketch, double q);
+void quantile_sketch_add(quantile_sketch *sketch, double x);
+/* The current estimate. Exact until five samples have been seen. */
+double quantile_sketch_value(const quantile_sketch *sketch);
+
+/* Welford mean and variance, the largest absolute value, and streaming
+   estimates of the median and of the 99th percentile of absolute values. */
+typedef struct stream_stats {
+    uint64_t count;
+    double mean;
+    double m2;
+    microts max_abs;
+    quantile_sketch median;
+    quantile_sketch p99_abs;
+} stream_stats;
+
+void stream_stats_init(stream_stats *stats);
+void stream_stats_add(stream_stats *stats, microts x);
+/* Sample standard deviation, as Python's statistics.stdev. */
+double stream_stats_stdev(const stream_stats *stats);
+
+#endif // STATS_H
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "simulation.h"
+#include "rapport.h"
+
+/* Runs a grid of simulations on a thread pool and prints one table with
+   the columns of results/processor.py, one row per configuration.
+   Every point runs with the arguments simulate.sh passes to the client:
+   server drift D, client VHC drift -D and the given relative drift.
+   With --adaptive-rapport the rapport period of each point is only the
+   starting period, and a Rapport Queries column counts what was sent. */
+
+#define MAX_GRID_VALUES 64
+#define MAX_THREADS 256
+
+typedef struct grid_axis {
+    long values[MAX_GRID_VALUES];
+    int count;
+} grid_axis;
+
+typedef struct sweep_point {
+    simulation_config config;
+    long max_drift;
+    int failed;
+    double avg_error;
+    double median_error;
+    microts max_abs_error;
+    double stdev_error;
+    unsigned long rapport_queries;
+} sweep_point;
+
+typedef struct sweep {
+    sweep_point *points;
+    int count;
+    /* Index of the next point to claim. */
+    int next;
+} sweep;
+
+/* Parse a comma separated list of values or START:STOP:STEP ranges. */
+static int parse_axis(const char *text, grid_axis *axis) {
+    char *copy = strdup(text);
+    char *save = NULL;
+    axis->count = 0;
+
+    for (char *item = strtok_r(copy, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        long start, stop, step = 1;
+        int fields = sscanf(item, "%ld:%ld:%ld", &start, &stop, &step);
+        if (fields == 1)
+            stop = start;
+        if (fields < 1 || step <= 0) {
+            free(copy);
+            return -1;
+        }
+        for (long value = start; value <= stop; value += step) {
+            if (axis->count == MAX_GRID_VALUES) {
+                free(copy);
+                return -1;
+            }
+            axis->values[axis->count++] = value;
+        }
+    }
+
+    free(copy);
+    return axis->count > 0 ? 0 : -1;
+}
+
+static int compare_microts(const void *a, const void *b) {
+    microts x = *(const microts *) a, y = *(const microts *) b;
+    return (x > y) - (x < y);
+}
+
+/* Same statistics as processor.py: mean, median, max |error| and the
+   sample standard deviation. */
+static void summarize(sweep_point *point, simulation_errors *errors) {
+    size_t n = errors->count;
+    if (n < 2) {
+        point->failed = 1;
+        return;
+    }
+
+    double sum = 0;
+    microts max_abs = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += errors->values[i];
+        microts e = llabs(errors->values[i]);
+        if (e > max_abs)
+            max_abs = e;
+    }
+    double mean = sum / n;
+
+    double squares = 0;
+    for (size_t i = 0; i < n; ++i)
+        squares += (errors->values[i] - mean) * (errors->values[i] - mean);
+
+    qsort(errors->values, n, sizeof(microts), compare_microts);
+    point->median_error = n % 2 ? errors->values[n / 2]
+        : (errors->values[n / 2 - 1] + errors->values[n / 2]) / 2.0;
+    point->avg_error = mean;
+    point->max_abs_error = max_abs;
+    point->stdev_error = sqrt(squares / (n - 1));
+}
+
+static void *run_worker(void *arg) {
+    sweep *s = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->count) {
+        simulation_errors errors = {0};
+        sweep_point *point = &s->points[i];
+        if (simulation_run(&point->config, NULL, &errors) != 0)
+            point->failed = 1;
+        else
+            summarize(point, &errors);
+        point->rapport_queries = errors.rapport_queries;
+        simulation_errors_free(&errors);
+    }
+    return NULL;
+}
+
+static void parse_grid(const char *name, const char *text, grid_axis *axis) {
+    if (parse_axis(text, axis) != 0) {
+        printf("FATAL: Invalid %s list %s (at most %d values).\n",
+               name, text, MAX_GRID_VALUES);
+        exit(1);
+    }
+}
+
+static void parse_delay(const char *text, delay_spec *spec) {
+    if (delay_spec_parse(text, spec) != 0) {
+        printf("FATAL: Invalid delay distribution %s.\n", text);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    grid_axis drifts = {{0}}, rapports = {{0}}, amortizations = {{0}};
+    simulation_config base;
+    simulation_defaults(&base);
+    base.relative_drift = -16;
+    base.runtime = 1800 * (microts) MILLION;
+    base.timeout = 4000000;
+    base.print_period = 50000;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--drift") == 0 && i + 1 < argc) {
+            parse_grid("drift", argv[++i], &drifts);
+        } else if (strcmp(argv[i], "--rapport") == 0 && i + 1 < argc) {
+            parse_grid("rapport", argv[++i], &rapports);
+        } else if (strcmp(argv[i], "--amortization") == 0 && i + 1 < argc) {
+            parse_grid("amortization", argv[++i], &amortizations);
+        } else if (strcmp(argv[i], "--relative-drift") == 0 && i + 1 < argc) {
+            base.relative_drift = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--runtime") == 0 && i + 1 < argc) {
+            base.runtime = atol(argv[++i]) * MILLION;
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            base.timeout = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--print") == 0 && i + 1 < argc) {
+            base.print_period = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &base.uplink);
+            base.downlink = base.uplink;
+        } else if (strcmp(argv[i], "--uplink") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &base.uplink);
+        } else if (strcmp(argv[i], "--downlink") == 0 && i + 1 < argc) {
+            parse_delay(argv[++i], &base.downlink);
+        } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            base.loss = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            base.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--rapport-window") == 0 && i + 1 < argc) {
+            base.rapport_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rapport-burst") == 0 && i + 1 < argc) {
+            base.rapport_burst = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frequency-window") == 0 && i + 1 < argc) {
+            base.frequency_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--adaptive-rapport") == 0 && i + 1 < argc) {
+            base.adaptive_target = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--min-rapport") == 0 && i + 1 < argc) {
+            base.min_rapport_period = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-rapport") == 0 && i + 1 < argc) {
+            base.max_rapport_period = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            printf("FATAL: Unrecognized option %s.\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if (drifts.count == 0 || rapports.count == 0 || amortizations.count == 0) {
+        printf("Usage: sweep --drift LIST --rapport LIST --amortization LIST\n");
+        printf("             [--relative-drift PPM] [--runtime SECONDS]\n");
+        printf("             [--timeout USEC] [--print USEC]\n");
+        printf("             [--uplink DIST] [--downlink DIST] [--delay DIST]\n");
+        printf("             [--loss P] [--seed N] [--threads N]\n");
+        printf("             [--rapport-window N] [--rapport-burst N]\n");
+        printf("             [--frequency-window N]\n");
+        printf("             [--adaptive-rapport TARGET] [--min-rapport USEC]\n");
+        printf("             [--max-rapport USEC]\n");
+        printf("LIST is comma separated values or START:STOP:STEP ranges.\n");
+        exit(1);
+    }
+    if (threads < 1 || threads > MAX_THREADS) {
+        printf("FATAL: Thread count must be between 1 and %d.\n", MAX_THREADS);
+        exit(1);
+    }
+
+    sweep s = {0};
+    s.count = drifts.count * rapports.count * amortizations.count;
+    if ((s.points = calloc(s.count, sizeof(sweep_point))) == NULL) {
+        printf("FATAL: Could not allocate the sweep.\n");
+        exit(1);
+    }
+
+    /* Points are listed in grid order, which is also the output order. */
+    int n = 0;
+    for (int d = 0; d < drifts.count; ++d)
+        for (int r = 0; r < rapports.count; ++r)
+            for (int a = 0; a < amortizations.count; ++a, ++n) {
+                sweep_point *point = &s.points[n];
+                point->config = base;
+                point->max_drift = drifts.values[d];
+                point->config.server_drift = drifts.values[d];
+                point->config.local_vhc_drift = -drifts.values[d];
+                point->config.rapport_period = rapports.values[r];
+                point->config.amortization_period = amortizations.values[a];
+            }
+
+    if (threads > s.count)
+        threads = s.count;
+    pthread_t workers[MAX_THREADS];
+    for (int t = 0; t < threads; ++t) {
+        if (pthread_create(&workers[t], NULL, run_worker, &s) != 0) {
+            printf("FATAL: Sweep thread creation failed.\n");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < threads; ++t)
+        pthread_join(workers[t], NULL);
+
+    int adaptive = base.adaptive_target > 0;
+    printf("Max Drift,Rapport Period,Amortization Period,Avg. Error,Median Error,Max Absolute Error,Error Standard Deviation%s\n",
+           adaptive ? ",Rapport Queries" : "");
+    for (int i = 0; i < s.count; ++i) {
+        sweep_point *point = &s.points[i];
+        if (point->failed) {
+            printf("%ld,%ld,%ld,,,,", point->max_drift,
+                   point->config.rapport_period,
+                   point->config.amortization_period);
+        } else {
+            printf("%ld,%ld,%ld,%g,%g,%ld,%g", point->max_drift,
+                   point->config.rapport_period,
+                   point->config.amortization_period, point->avg_error,
+                   point->median_error, point->max_abs_error,
+                   point->stdev_error);
+        }
+        if (adaptive)
+            printf(",%lu", point->rapport_queries);
+        printf("\n");
+    }
+
+    free(s.points);
+    return 0;
+}
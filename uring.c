@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* There is no libc wrapper for these, and liburing is not a dependency. */
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring *r, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+
+    /* Only the thread that sets a ring up ever enters it, so completion
+       work can wait for that thread's next io_uring_enter instead of
+       interrupting it. Kernels before 6.1 do without. */
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((r->fd = io_uring_setup(entries, &params)) < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        r->fd = io_uring_setup(entries, &params);
+    }
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_ring_size = params.sq_off.array
+        + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED
+        || r->sqes == MAP_FAILED) {
+        int saved = errno;
+        uring_close(r);
+        errno = saved;
+        return -1;
+    }
+
+    char *sq = r->sq_ring;
+    r->sq_head = (unsigned *) (sq + params.sq_off.head);
+    r->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    r->sq_array = (unsigned *) (sq + params.sq_off.array);
+    r->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+
+    char *cq = r->cq_ring;
+    r->cq_head = (unsigned *) (cq + params.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    r->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    /* SQEs are always used in ring order, so the indirection array is
+       the identity and never changes. */
+    for (unsigned i = 0; i < r->sq_entries; ++i)
+        r->sq_array[i] = i;
+    return 0;
+}
+
+void uring_close(uring *r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    ++r->sq_local_tail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring *r, unsigned wait_nr) {
+    /* Counted from the kernel's head, so SQEs left over by a call that was
+       interrupted are submitted again. */
+    unsigned to_submit = r->sq_local_tail
+        - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    /* The SQE contents must be visible before the kernel sees the tail. */
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0)
+        return 0;
+    return io_uring_enter(r->fd, to_submit, wait_nr,
+                          wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buffers_init(uring *r, uring_buffers *b, uint16_t group,
+                       unsigned entries, unsigned size) {
+    memset(b, 0, sizeof(*b));
+    if (entries == 0 || (entries & (entries - 1)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    b->entries = entries;
+    b->size = size;
+    b->group = group;
+
+    /* The ring must be page aligned, which mmap guarantees. */
+    b->ring_size = entries * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (b->ring == MAP_FAILED) {
+        b->ring = NULL;
+        return -1;
+    }
+    b->memory = mmap(NULL, (size_t) entries * size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (b->memory == MAP_FAILED) {
+        b->memory = NULL;
+        uring_buffers_free(r, b);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) b->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        int saved = errno;
+        uring_buffers_free(r, b);
+        errno = saved;
+        return -1;
+    }
+    b->registered = 1;
+
+    for (unsigned i = 0; i < entries; ++i)
+        uring_buffer_recycle(b, i);
+    return 0;
+}
+
+void uring_buffers_free(uring *r, uring_buffers *b) {
+    if (b->registered) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = b->group;
+        io_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    if (b->memory != NULL)
+        munmap(b->memory, (size_t) b->entries * b->size);
+    if (b->ring != NULL)
+        munmap(b->ring, b->ring_size);
+    memset(b, 0, sizeof(*b));
+}
+
+char *uring_buffer(uring_buffers *b, unsigned id) {
+    return b->memory + (size_t) id * b->size;
+}
+
+void uring_buffer_recycle(uring_buffers *b, unsigned id) {
+    struct io_uring_buf *buf = &b->ring->bufs[b->tail & (b->entries - 1)];
+    buf->addr = (uint64_t) (uintptr_t) uring_buffer(b, id);
+    buf->len = b->size;
+    buf->bid = id;
+    ++b->tail;
+
+    /* The buffer entry must be visible before the kernel sees the tail. */
+    __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
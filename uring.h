@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+#ifndef URING_H
+#define URING_H
+
+/* A minimal io_uring layer over the raw system calls, enough for the
+   server's io_uring backend: one submission and one completion ring, and
+   rings of provided buffers that multishot receives fill on their own.
+
+   The application owns the SQ tail and the CQ head, and the kernel owns
+   the other ends. Every shared index is read with acquire and written with
+   release ordering. Not thread safe: each thread keeps its own ring. */
+
+typedef struct uring {
+    int fd;
+
+    /* Submission queue: SQEs handed out by uring_get_sqe are published
+       to the kernel by the next uring_submit_and_wait. */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring;
+
+/* A ring of `entries` buffers of `size` bytes each, registered with the
+   kernel as buffer group `group`. A receive with IOSQE_BUFFER_SELECT takes
+   the next free buffer; its id comes back in the CQE flags, and the buffer
+   must be recycled once the application is done with it. */
+typedef struct uring_buffers {
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    char *memory;
+    unsigned entries;
+    unsigned size;
+    uint16_t group;
+    uint16_t tail;
+    int registered;
+} uring_buffers;
+
+/* Set up a ring with room for entries SQEs (rounded up to a power of two
+   by the kernel). Only the calling thread may use it. Returns 0, or -1
+   with errno set. */
+int uring_init(uring *r, unsigned entries);
+void uring_close(uring *r);
+
+/* The next free SQE, zeroed, or NULL if the submission queue is full. */
+struct io_uring_sqe *uring_get_sqe(uring *r);
+
+/* Submit every SQE handed out so far and wait until at least wait_nr
+   completions are ready, in one system call. Returns the number of SQEs
+   submitted, or -1 with errno set. */
+int uring_submit_and_wait(uring *r, unsigned wait_nr);
+
+/* The oldest unconsumed CQE, or NULL if there is none. uring_cqe_seen
+   hands it back to the kernel. */
+struct io_uring_cqe *uring_peek_cqe(uring *r);
+void uring_cqe_seen(uring *r);
+
+/* entries must be a power of two. Returns 0, or -1 with errno set. */
+int uring_buffers_init(uring *r, uring_buffers *b, uint16_t group,
+                       unsigned entries, unsigned size);
+void uring_buffers_free(uring *r, uring_buffers *b);
+
+/* The memory of buffer id, and handing it back to the kernel. */
+char *uring_buffer(uring_buffers *b, unsigned id);
+void uring_buffer_recycle(uring_buffers *b, unsigned id);
+
+#endif // URING_H